@@ -0,0 +1,201 @@
+#ifndef AbsoluteEncoder_hpp
+#define AbsoluteEncoder_hpp
+/*
+  Device handler for an absolute (parallel Gray code) rotary switch
+  
+  Same interface as RotaryEncoder - getPulseCount(), getEvent(), drain(), getDroppedEvents(),
+  getPosition(), isActive() and scan() - so the application doesn't need to know which
+  sort of knob is fitted.
+  
+  The switch has "bits" output pins which must be consecutive bits of one port,
+  starting at firstPin, so the whole position is read in one port read (on AVR begin()
+  checks this and returns false, leaving the interrupts off, if they aren't). Only one
+  bit changes between neighbouring positions, so contact bounce just flicks between
+  two adjacent positions and cancels out - there is no debounce delay. In the event
+  queue a step back is merged into the newest rotation event (if the application hasn't
+  taken it yet, within coalesceInterval) so a bouncy click is still one event.
+  
+  Every pin interrupts on change. On AVR the pin change interrupt (PCINT) is enabled
+  for each pin but the vector has to be in the sketch, as other libraries may use it:
+  
+    AbsoluteEncoder<8, 4> selector;  //Pins 8-11 (PB0-PB3 on a Uno)
+    ISR(PCINT0_vect) { selector.intHandler(); }
+  
+  Elsewhere attachInterrupt() is used on each pin.
+*/
+
+#include "RotaryEncoder.hpp"
+
+template <uint8_t firstPin, uint8_t bits, class Config = RotaryEncoderConfig>
+class AbsoluteEncoder : public RotaryLatencyStats<Config::latencyStats> {
+   public:
+     static const uint16_t positions = 1u << bits;
+     static const uint16_t activityTimeoutTicks = Config::activityTimeout >> 10;
+
+     //  -- constructor
+     AbsoluteEncoder() {
+       instance = this;  //Needed by the interrupt handler
+     }
+
+//Must call this during setup(). Returns false if the pins can't be read as one port
+     bool begin() {
+       uint8_t pin;
+
+       static_assert(bits >= 1 && bits <= 8, "Gray code switches have 1 to 8 bits");
+#ifdef __AVR__
+       for (pin = firstPin; pin < firstPin + bits; pin++)
+         if ( digitalPinToPort(pin) != digitalPinToPort(firstPin)
+              || digitalPinToBitMask(pin) != (uint8_t)(digitalPinToBitMask(firstPin) << (pin - firstPin)) )
+           return(false);
+#endif
+       for (pin = firstPin; pin < firstPin + bits; pin++) {
+         pinMode(pin, INPUT_PULLUP);
+#ifdef __AVR__
+         *digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+         *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+#else
+         attachInterrupt(digitalPinToInterrupt(pin), intHandler, CHANGE);
+#endif
+       }
+#ifdef __AVR__
+       port = portInputRegister(digitalPinToPort(firstPin));
+       for (shift = 0; !(digitalPinToBitMask(firstPin) & (1 << shift)); shift++);
+#endif
+       lastCode = readPosition();
+       return(true);
+     }
+
+//Returns number of clicks since previous call
+     int getPulseCount () {  // is positive for clockwise steps, negative for anticlocwise clicks
+       int retVal;
+       noInterrupts();
+       retVal = pulseCount;
+       pulseCount = 0;
+       interrupts();
+       return(retVal);
+     }
+
+//Takes the oldest queued event, returns false if there is none
+     bool getEvent(RotaryEvent &ev) {
+       bool found;
+       uint16_t latency = 0;
+       noInterrupts();
+       found = events.pop(ev);
+       if (found && Config::latencyStats) latency = events.age(ev, 1, Config::now());
+       interrupts();
+       if (found && Config::latencyStats) this->recordLatency(this->EDGE_TO_CONSUME, latency);
+       return(found);
+     }
+
+     size_t drain(RotaryEvent *out, size_t max) {
+       uint8_t count;
+       long now;
+       noInterrupts();
+       count = events.drain(out, max);
+       if (Config::latencyStats) { //Before the ISR can reuse the slots
+         now = Config::now();
+         for (uint8_t i = 0; i < count; i++)
+           this->recordLatency(this->EDGE_TO_CONSUME, events.age(out[i], count - i, now));
+       }
+       interrupts();
+       return(count);
+     }
+
+     bool eventPending() {
+       return(!events.isEmpty());
+     }
+
+//Events lost since the previous call because the queue was full (up to 255)
+     uint8_t getDroppedEvents() {
+       uint8_t retVal;
+       noInterrupts();
+       retVal = events.takeDropped();
+       interrupts();
+       return(retVal);
+     }
+
+//Clicks accumulated since begin(), counting whole turns
+     long getPosition() {
+       long retVal;
+       noInterrupts();
+       retVal = position;
+       interrupts();
+       return(retVal);
+     }
+
+//Where the switch is now, 0 to positions - 1
+     uint8_t getAbsolutePosition() {
+       return(lastCode);
+     }
+
+     bool isActive() {
+       return(active);
+     }
+
+//Only times out the activity, all the decoding is done in intHandler()
+     void scan() {
+       uint16_t nowTicks = Config::now() >> 10;
+
+       noInterrupts();
+       if (active && (int16_t)(nowTicks - lastActivity) > (int16_t)activityTimeoutTicks) active = false;
+       interrupts();
+     }
+
+//Called on a change of any of the pins
+     static void intHandler() {
+       long now;
+       uint8_t code;
+       int8_t delta;
+
+       code = readPosition();
+       if (code == instance->lastCode) return;  //Glitch, or another pin on the port
+       now = Config::now();
+       //Shortest way round from the last position
+       delta = (int8_t)((uint8_t)(code - instance->lastCode) << (8 - bits)) >> (8 - bits);
+       instance->lastCode = code;
+       instance->active = true;
+       instance->lastActivity = now >> 10;
+       instance->position += delta;
+       instance->pulseCount += delta;
+       if (instance->pulseCount < 0) instance->pulseCount = 0;
+       instance->events.pushRotation(delta, now, true);  //A bounce back cancels out
+     }
+
+     //One port read on AVR, otherwise one digitalRead() per pin
+     static uint8_t readPosition() {
+       uint8_t gray = 0;
+#ifdef __AVR__
+       gray = (*port >> shift) & (positions - 1);
+#else
+       uint8_t bit;
+       for (bit = 0; bit < bits; bit++)
+         if (digitalRead(firstPin + bit)) gray |= 1 << bit;
+#endif
+       return(grayToBinary(gray));
+     }
+
+     static AbsoluteEncoder *instance;
+#ifdef __AVR__
+     static volatile uint8_t *port;
+     static uint8_t shift;
+#endif
+
+     //Properties
+     volatile int32_t position = 0;
+     volatile int16_t pulseCount = 0;
+     volatile uint16_t lastActivity = 0; //ticks of 1024us
+     volatile uint8_t lastCode = 0;      //Binary position at the last interrupt
+     volatile bool active = false;
+     RotaryEventQueue<Config> events;
+}; //end of AbsoluteEncoder class definition
+
+template <uint8_t firstPin, uint8_t bits, class Config>
+AbsoluteEncoder<firstPin, bits, Config> *AbsoluteEncoder<firstPin, bits, Config>::instance = NULL;
+#ifdef __AVR__
+template <uint8_t firstPin, uint8_t bits, class Config>
+volatile uint8_t *AbsoluteEncoder<firstPin, bits, Config>::port;
+template <uint8_t firstPin, uint8_t bits, class Config>
+uint8_t AbsoluteEncoder<firstPin, bits, Config>::shift;
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef RotaryDecode_hpp
+#define RotaryDecode_hpp
+/*
+  Quadrature transition logic for rotary encoders
+  
+  This has no Arduino dependencies so the same code is used by RotaryEncoder's
+  interrupt handler and by host tools decoding logic-analyser captures.
+  
+  A sample of one encoder is a 2 bit value with pin A in bit 1 and pin B in bit 0.
+  Turning clockwise (A leading B) the samples go 00 -> 10 -> 11 -> 01 -> 00.
+  A transition where both pins change at once is invalid and counts as no movement.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+// -- One encoder: +1 for a clockwise step, -1 for anticlockwise, 0 for none or invalid
+constexpr int8_t rotaryTransition(uint8_t prev, uint8_t cur) {
+  return( ((prev ^ cur) & 3) == 0 || ((prev ^ cur) & 3) == 3 ? 0        //no change or both pins changed
+        : ((prev ^ cur) & 2) ? ( ((cur >> 1) ^ cur) & 1 ? 1 : -1 )      //A changed: clockwise if A != B
+        : ( ((cur >> 1) ^ cur) & 1 ? -1 : 1 ) );                          //B changed: clockwise if A == B
+}
+
+// -- Step geometry, generated at compile time from the number of quadrature states
+// the encoder moves through per click (1, 2 or 4). The edges that count a click:
+//   4 - rising edges of pin A (00 -> 10 starts a click clockwise, 01 -> 11 is the
+//       second edge of one anticlockwise)
+//   2 - both edges of pin A (clicks rest at 00 and 11)
+//   1 - both edges of both pins
+// table[(prev << 2) | cur] is the clicks for a transition, so every geometry
+// counts exactly one per click. Pin A interrupts on both edges, and pin B as well if
+// interruptB - otherwise prev is cur with A inverted. With 4 states A falling counts
+// nothing (midClickA), but a bounce back up off it would read as a click the other
+// way, so the driver debounces it as well (see encoderIntHandler()).
+template <uint8_t statesPerDetent>
+struct RotaryGeometry {
+  static_assert(statesPerDetent == 1 || statesPerDetent == 2 || statesPerDetent == 4,
+                "statesPerDetent must be 1, 2 or 4");
+  static const bool midClickA = statesPerDetent == 4;
+  static const bool interruptB = statesPerDetent == 1;
+
+  static constexpr int8_t step(uint8_t prev, uint8_t cur) {
+    return( statesPerDetent == 1 ? rotaryTransition(prev, cur)
+          : ((prev ^ cur) & 3) != 2 ? 0                                     //Only pin A edges count
+          : (statesPerDetent == 2 || (cur & 2)) ? rotaryTransition(prev, cur) //4 - rising edges only
+          : 0 );
+  }
+
+  static const int8_t table[16];
+};
+
+template <uint8_t statesPerDetent>
+const int8_t RotaryGeometry<statesPerDetent>::table[16] = {
+  step(0, 0), step(0, 1), step(0, 2), step(0, 3),
+  step(1, 0), step(1, 1), step(1, 2), step(1, 3),
+  step(2, 0), step(2, 1), step(2, 2), step(2, 3),
+  step(3, 0), step(3, 1), step(3, 2), step(3, 3)
+};
+
+// -- Direction reversal hysteresis. After a change of direction the knob has to travel
+// clicks + 1 clicks before anything is counted, so a knob resting on a detent boundary
+// doesn't jitter between +1 and -1. The state is the last direction counted (bit 0)
+// and how far the knob has since moved back against it (bits 1-3). IDLE counts the
+// first click either way.
+// table[(state << 1) | clockwise] = (new state << 3) | REVERSED | CW or CCW
+template <uint8_t clicks>
+struct RotaryHysteresis {
+  static_assert(clicks < 7, "Hysteresis must be under 7 clicks");
+  enum : uint8_t { CW = 1, CCW = 2, REVERSED = 4, IDLE = 15 };
+
+  static constexpr uint8_t next(uint8_t state, bool cw) {
+    return( state == IDLE ? ((cw ? 1 : 0) << 3) | (cw ? CW : CCW)
+          : (cw == (state & 1)) ? ( (state >> 1) == 0 ? (state << 3) | (cw ? CW : CCW)  //Carrying on
+                                  : (state - 2) << 3 )                                  //Back towards the last count
+          : ((state >> 1) + 1 > clicks) ? ((cw ? 1 : 0) << 3) | REVERSED | (cw ? CW : CCW) //Far enough to reverse
+          : (state + 2) << 3 );
+  }
+
+  static const uint8_t table[32];
+};
+
+template <uint8_t clicks>
+const uint8_t RotaryHysteresis<clicks>::table[32] = {
+  next(0, 0),  next(0, 1),  next(1, 0),  next(1, 1),  next(2, 0),  next(2, 1),  next(3, 0),  next(3, 1),
+  next(4, 0),  next(4, 1),  next(5, 0),  next(5, 1),  next(6, 0),  next(6, 1),  next(7, 0),  next(7, 1),
+  next(8, 0),  next(8, 1),  next(9, 0),  next(9, 1),  next(10, 0), next(10, 1), next(11, 0), next(11, 1),
+  next(12, 0), next(12, 1), next(13, 0), next(13, 1), next(14, 0), next(14, 1), next(15, 0), next(15, 1)
+};
+
+// -- Compile time index lists, for building lookup tables from constexpr functions
+template <unsigned... i> struct RotaryIndices {};
+template <unsigned n, unsigned... i> struct RotaryMakeIndices : RotaryMakeIndices<n - 1, n - 1, i...> {};
+template <unsigned... i> struct RotaryMakeIndices<0, i...> {
+  typedef RotaryIndices<i...> type;
+};
+
+// -- Gray code to binary for absolute encoders with up to 8 bits - 3 shifts and XORs,
+// cheap enough inline in an interrupt handler that no table is needed in RAM
+constexpr uint8_t grayToBinary(uint8_t gray, uint8_t shift = 1) {
+  return( shift >= 8 ? gray : grayToBinary(gray ^ (gray >> shift), shift << 1) );
+}
+
+// -- Many encoders at once, one per bit of Word (bit sliced)
+// prevA/prevB/curA/curB hold pin A and pin B of every channel. On return cw and ccw
+// have a bit set for each channel that stepped clockwise or anticlockwise.
+// Only bitwise operations are used, so Word can be a GCC vector of words as well and
+// decode several samples at once (see test/CaptureDecode.hpp).
+template <typename Word>
+inline void rotaryTransitions(Word prevA, Word prevB, Word curA, Word curB, Word &cw, Word &ccw) {
+  Word changedA = prevA ^ curA;
+  Word changedB = prevB ^ curB;
+  Word valid = changedA ^ changedB;  //Exactly one pin changed
+  Word differ = curA ^ curB;
+
+  cw = valid & ((changedA & differ) | (changedB & ~differ));
+  ccw = valid & ~cw;
+}
+
+// -- Result of decoding a run of samples of one encoder
+// The count only depends on the sample before the run through the first transition,
+// so runs can be decoded independently (e.g. chunks of a capture on separate cores)
+// and joined afterwards with rotaryJoin() giving exactly the sequential result.
+struct RotarySpan {
+  uint8_t first, last; //First and last samples of the run
+  int32_t count;       //Steps from first to last sample
+  bool empty;
+};
+
+inline RotarySpan rotaryDecodeSpan(const uint8_t *samples, size_t n) {
+  RotarySpan span = { 0, 0, 0, true };
+  size_t i;
+
+  if (n == 0) return(span);
+  span.first = span.last = samples[0] & 3;
+  span.empty = false;
+  for (i = 1; i < n; i++) {
+    span.count += rotaryTransition(span.last, samples[i] & 3);
+    span.last = samples[i] & 3;
+  }
+  return(span);
+}
+
+//Run a followed by run b. Associative, so any grouping of chunks gives the same answer
+inline RotarySpan rotaryJoin(const RotarySpan &a, const RotarySpan &b) {
+  RotarySpan span;
+
+  if (a.empty) return(b);
+  if (b.empty) return(a);
+  span.first = a.first;
+  span.last = b.last;
+  span.count = a.count + rotaryTransition(a.last, b.first) + b.count;
+  span.empty = false;
+  return(span);
+}
+
+//Steps in the run when the sample before it was "start"
+inline int32_t rotarySpanCount(const RotarySpan &span, uint8_t start) {
+  return(span.empty ? 0 : rotaryTransition(start, span.first) + span.count);
+}
+
+#endif
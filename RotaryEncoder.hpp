@@ -20,190 +20,1220 @@
   Typically these transient pulses will be less than 100us duration.
   
   This driver assumes that anything with duration greater than 5ms is a valid pulse and
-  ignores anything with shorter duration. This can be tweaked if necessary (see below). 
+  ignores anything with shorter duration. This can be tweaked if necessary (see
+  RotaryEncoderConfig below). 
+  Alternatively call setAdaptiveDebounce(true) and the driver will measure the width of
+  each burst of bounces (first edge to last edge seen inside the debounce window) and
+  set the window for that channel (rotary or button) to twice the recent worst case,
+  kept between debounceMinInterval and debounceMaxInterval. The worst case decays by
+  1/8 a second. An edge arriving soon after the window closed widens it if it looks like
+  a bounce (the burst still going, a step back, or no step) rather than the next click of
+  a fast spin, and if the burst is still going the debounce carries on without a click.
   
   The driver uses two interrupts, one for the rotary pulses  and one
-  for the push button. Either interrupt will put the encoder into the "active"
-  state. While active the "scan() method should be called at (max) 3ms intervals
+  for the push button, each with its own debounce so a press just after a click
+  (or a click just after a press) isn't taken for a bounce. Either interrupt will
+  put the encoder into the "active" state, and a held button or a fault keeps it
+  there (see below). While active the "scan() method should be called regularly. It works from the times recorded by
+  the interrupt handlers, and the handlers end a debounce delay themselves if scan()
+  is late, so a period of 20-50ms loses nothing. Button presses are timed and queued
+  by the button interrupt handler, and scan() passes on up to 4 that arrived since the
+  last call to the StateMachine.
   
   The number of rotary pulses counted is artifically incremented if the 
   knob is rotated quickly.  
   
+  Encoders differ in how many quadrature states they move through per click (4, 2 or 1).
+  Set Config::statesPerDetent to match and the driver counts each click on one edge,
+  decoding it with a table generated at compile time (see RotaryGeometry). Pin A
+  interrupts on both edges, and with 1 state per click pin B needs an interrupt as well.
+  With 4 states A rising counts (it starts a click clockwise) and A falling, part way
+  through the click, is only debounced - a bounce back up off it would read as a click back.
+  Config::reversalHysteresis makes the knob travel that many extra clicks after changing
+  direction before it counts again (see RotaryHysteresis), and a reversal always
+  restarts the acceleration - with hysteresis the reversal it counts, so jitter it holds
+  back doesn't.
+  
+  scan() also runs an integer alpha-beta filter over the raw click position which gives
+  a smoothed position, velocity and predicted position (see getSmoothedPosition()).
+  Positions are in 1/256ths of a click, so the UI can move continuously between clicks.
+  
+  Rotation and button events are also placed in a small event queue (see getEvent() and drain()).
+  While a knob is being spun, consecutive steps in the same direction are merged into
+  the newest queued rotation event (if the consumer hasn't taken it yet) for up to
+  coalesceInterval. So a fast spin wakes the consumer a handful of times rather than
+  once per pulse. Rotation events are never merged across a button event.
+  If the application falls behind and the queue fills, new events are dropped (the clicks
+  are still counted by getPulseCount() and getPosition()) and getDroppedEvents() says how many.
+  
+  The pins and all the timing constants are template parameters, so each knob can be
+  tuned separately with no runtime cost:
+  
+    struct FineKnob : RotaryEncoderConfig {
+      static const long debounceInterval = 1000;
+    };
+    RotaryEncoder<2, 3, 4, FineKnob> fine;  //pin A, pin B, push button
+    RotaryEncoder<18, 19, 20> coarse;       //Defaults
+  
+  Each encoder is a separate type with its own interrupt handlers.
+  
+  RAM is tight on an AVR so the state is kept compact: the flags are packed into
+  one byte and times are kept as 16 bit values relative to micros() - either the
+  low 16 bits (for intervals under 65ms) or in "ticks" of 1024us (for the longer
+  ones). sizeof(RotaryEncoder) is checked against Config::ramBudget at compile time.
+  With the default configuration it is 111 bytes on AVR (61 of them are the event queue)
+  and 120 bytes on 32 bit boards.
+  
+  A health monitor guards against a loose wire or failing encoder flooding the CPU with
+  interrupts. More than Config::stormEdges interrupts in 64ms, or the button held down
+  for Config::stuckButtonInterval, detaches the interrupts and queues a FAULT event.
+  scan() then polls the pins, still counting clicks and presses at its own rate, and
+  re-attaches the interrupts (queuing FAULT_CLEARED) once the lines have been still for
+  Config::rearmInterval with the button up. A held button or a fault keeps the encoder
+  active, so a sketch that only calls scan() while isActive() keeps polling until
+  FAULT_CLEARED - scan() must keep running while faulted or the encoder stays dead.
+  
+  Setting Config::maskDuringDebounce detaches the interrupt of the pin(s) that started a
+  debounce until it ends, so a bouncy click costs one interrupt rather than one per
+  bounce. Only scan() can then end the debounce, so it has to be called more often than
+  debounceInterval or clicks are missed, and adaptive debounce has no bounces to learn from.
+  It can't be used with the hybrid mode (pollAboveEdges), as the end of a debounce would
+  re-attach the rotary interrupts while sample() has them.
+  
+  Because the configuration is a plain struct of constants, tuned values can come from
+  a generated header with no driver changes. test/KnobTuner sweeps debounceInterval,
+  longPressInterval and accelDivisor over labeled traces, scripted or recorded, and
+  writes the best ("make -C test tune", see test/KnobTuner.hpp). accelDivisor is only
+  tuned from captures labeled with the count the user meant to dial in:
+  
+    // KnobTuning.h - generated by test/KnobTuner from 240 scripted traces, seed 1, don't edit
+    struct TunedKnob : RotaryEncoderConfig {
+      static const long debounceInterval = 3000;
+      static const long longPressInterval = 700000;
+      //accelDivisor not tuned - no trace has an accelerated count to go by
+    };
+  
+  All the timing comes from Config::now(), which is micros() by default. A host
+  simulation can supply its own clock so several encoders run in virtual time:
+  
+    struct SimKnob : RotaryEncoderConfig {
+      static unsigned long now() { return(simulatedMicros); }
+    };
+  
+  Setting Config::latencyStats records how long events take to get to the application
+  in two log2 bucketed histograms (see RotaryLatencyStats): button release edge to scan()
+  passing the press on to the StateMachine queue, which is down to the scan() cadence, and
+  edge to the application taking the event from the event queue (getEvent() or drain()).
+  The histograms take another 84 bytes on AVR (with the default eventQueueSize - the queue keeps
+  a 2 byte tick per event as well) so ramBudget has to be raised too.
+  
 */
  
-#define DEBOUNCE_INTERVAL 5000  // 5 milliseconds
-#define LONG_PRESS_INTERVAL 3000000 //3 seconds
-#define ACTIVITY_TIMEOUT 10000000 //10 seconds
-#define BUTTON_UP false
-
 #include "TaskScheduler.h"
 #include "StateMachine.hpp"
+#include "RotaryDecode.hpp"
+
+// -- Default configuration, derive from this to override individual constants
+struct RotaryEncoderConfig {
+  static unsigned long now() { return(micros()); } //Clock for all the timing - replace for simulated time
+  static const long debounceInterval = 5000;     // 5 milliseconds
+  static const long debounceMinInterval = 500;   //Adaptive debounce limits - 0.5 milliseconds
+  static const long debounceMaxInterval = 10000; // 10 milliseconds
+  static const long longPressInterval = 3000000; //3 seconds
+  static const uint8_t accelDivisor = 3;         //Acceleration - extra clicks are 1 second / (accelDivisor * pulse time)
+  static const long activityTimeout = 10000000;  //10 seconds
+  static const bool buttonUp = false;
+  static const uint8_t filterAlphaShift = 2;     //alpha = 1/4
+  static const uint8_t filterBetaShift = 5;      //beta = 1/32
+  static const long filterMaxStep = 100;         //Longest filter time step (ticks of 1024us), longer gaps are clamped
+  static const uint8_t eventQueueSize = 8;       //Must be a power of 2, up to 128
+  static const long coalesceInterval = 50000;    //50 milliseconds, 0 disables merging of rotation events
+  static const uint16_t ramBudget = 120;         //Max sizeof(RotaryEncoder) in bytes
+  static const bool latencyStats = false;        //Keep latency histograms (68 bytes + 2 per event queue entry)
+  static const uint8_t statesPerDetent = 4;      //Quadrature states per click - 1, 2 or 4
+  static const uint8_t reversalHysteresis = 0;   //Clicks ignored after a change of direction (0-6)
+  static const uint8_t stormEdges = 200;         //Interrupts within 64ms that mean a faulty line, 0 disables
+  static const long stuckButtonInterval = 30000000; //30 seconds held down is a stuck button, 0 disables
+  static const long rearmInterval = 500000;      //0.5 seconds without a change before interrupts are re-enabled
+  static const bool maskDuringDebounce = false;  //Detach the pin interrupts for the debounce (see scan())
+  static const uint8_t pollAboveEdges = 0;       //Hybrid mode - interrupts within 64ms to switch to sample() (below stormEdges), 0 disables. 4 bytes - raise ramBudget
+  static const uint8_t pollBelowEdges = 16;      //Interrupts within 64ms (estimated by sample()) to switch back to interrupts
+};
+
+// -- Entry in the encoder event queue
+struct RotaryEvent {
+  enum Type : uint8_t { ROTATION, SHORT_PRESS, LONG_PRESS, FAULT };
+  enum Fault : uint8_t { FAULT_CLEARED, EDGE_STORM, STUCK_BUTTON };
+  uint8_t type;
+  int16_t delta;     //Rotation - accumulated clicks, positive is clockwise. Fault - a Fault code
+  uint16_t start;    //Low 16 bits of micros() at the first edge of the event
+  uint16_t duration; //Rotation - micros from first to last merged step. Button - 0, queued at the edge
+};
+
+// -- Tick (1024us) of the first edge of each queued event, kept only for the latency stats.
+// The 16 bit start wraps every 65ms, so on its own a long wait in the queue looks short
+template <bool enabled, uint8_t size>
+class RotaryEventTicks {
+   protected:
+     void setStartTicks(uint8_t slot, uint16_t ticks) {
+       startTicks[slot] = ticks;
+     }
+
+     uint16_t getStartTicks(uint8_t slot) {
+       return(startTicks[slot]);
+     }
+
+   private:
+     uint16_t startTicks[size];
+};
+
+template <uint8_t size>
+class RotaryEventTicks<false, size> {
+   protected:
+     void setStartTicks(uint8_t, uint16_t) {}
+     uint16_t getStartTicks(uint8_t) { return(0); }
+};
+
+// -- Single producer (ISR) / single consumer queue of RotaryEvents
+// pop() and drain() must be called with interrupts disabled as the ISR may be
+// merging a step into the event being read.
+template <class Config>
+class RotaryEventQueue : private RotaryEventTicks<Config::latencyStats, Config::eventQueueSize> {
+   static_assert(Config::eventQueueSize && !(Config::eventQueueSize & (Config::eventQueueSize - 1))
+                 && Config::eventQueueSize <= 128, "eventQueueSize must be a power of 2, up to 128");
+   public:
+     //Add a rotation step, merging it into the newest queued event where possible.
+     //The 16 bit start wraps every 65ms, so the step must also follow the last one within
+     //64 ticks and not appear to be earlier than it - then the event can't have wrapped.
+     //With cancel set a step the other way is merged as well, taking the event back
+     //towards 0 (and removing it at 0), so contact bounce doesn't fill the queue
+     bool pushRotation(int delta, long now, bool cancel = false) {
+       uint16_t nowTicks = now >> 10, elapsed;
+
+       if (head != tail) {
+         RotaryEvent &last = events[(tail - 1) & (Config::eventQueueSize - 1)];
+         elapsed = (uint16_t)now - last.start;
+         if ( last.type == RotaryEvent::ROTATION
+              && (cancel || (last.delta < 0) == (delta < 0))
+              && (uint16_t)(nowTicks - lastStep) < 64
+              && elapsed >= last.duration && elapsed < Config::coalesceInterval ) {
+           last.delta += delta;
+           last.duration = elapsed;
+           lastStep = nowTicks;
+           if (last.delta == 0) {       //Not taken yet, as head != tail
+             tail--;
+             lastStep = nowTicks - 64;  //The last step of the event before isn't known, so don't merge into it
+           }
+           return(true);
+         }
+       }
+       lastStep = nowTicks;
+       RotaryEvent *ev = reserve();
+       if (ev == NULL) return(false);  //Counted in dropped
+       ev->type = RotaryEvent::ROTATION;
+       ev->delta = delta;
+       ev->start = now;
+       ev->duration = 0;
+       this->setStartTicks(tail & (Config::eventQueueSize - 1), nowTicks);
+       tail++;
+       return(true);
+     }
+
+     //Add a button event - never merged, and it stops any further merging into the previous rotation
+     bool push(uint8_t type, long edge, uint16_t delay, int16_t delta = 0) {
+       RotaryEvent *ev = reserve();
+       if (ev == NULL) return(false);
+       ev->type = type;
+       ev->delta = delta;
+       ev->start = edge;
+       ev->duration = delay;
+       this->setStartTicks(tail & (Config::eventQueueSize - 1), edge >> 10);
+       tail++;
+       return(true);
+     }
+
+     bool pop(RotaryEvent &ev) {
+       if (head == tail) return(false);
+       ev = events[head & (Config::eventQueueSize - 1)];
+       head++;
+       return(true);
+     }
+
+     //Copy up to max events into out, oldest first, with one update of head
+     uint8_t drain(RotaryEvent *out, size_t max) {
+       uint8_t count = tail - head;
+       if (count > max) count = max;
+       for (uint8_t i = 0; i < count; i++)
+         out[i] = events[(uint8_t)(head + i) & (Config::eventQueueSize - 1)];
+       head += count;
+       return(count);
+     }
+
+     bool isEmpty() {
+       return(head == tail);
+     }
+
+     //Events lost to a full queue since the last call, up to 255. Interrupts must be off
+     uint8_t takeDropped() {
+       uint8_t count = dropped;
+       dropped = 0;
+       return(count);
+     }
+
+     //Micros from the first edge of an event to now, for one just taken by pop() or drain()
+     //"back" places behind head (1 after pop()). Only with Config::latencyStats. Anything
+     //over 16 ticks is past the last histogram bucket and comes back as 0xFFFF, so a wait
+     //of 65ms or more doesn't wrap round to a short one. Interrupts must be off
+     uint16_t age(const RotaryEvent &ev, uint8_t back, long now) {
+       uint16_t ticks = this->getStartTicks((uint8_t)(head - back) & (Config::eventQueueSize - 1));
+
+       if ((uint16_t)((now >> 10) - ticks) > 16) return(0xFFFF);
+       return((uint16_t)now - ev.start);
+     }
+
+   private:
+     RotaryEvent *reserve() { //Next free slot or NULL (counted as dropped) if the queue is full
+       if ((uint8_t)(tail - head) >= Config::eventQueueSize) {
+         if (dropped != 0xFF) dropped++;
+         return(NULL);
+       }
+       return(&events[tail & (Config::eventQueueSize - 1)]);
+     }
+
+     RotaryEvent events[Config::eventQueueSize];
+     uint16_t lastStep = 0;               //ticks - newest rotation step
+     volatile uint8_t head = 0, tail = 0; //Free running, wrapped on access
+     volatile uint8_t dropped = 0;        //Events that didn't fit, see takeDropped()
+};
+
+// -- Fast input pin read for use in the ISRs
+// On AVR the port register and bit mask are looked up once in begin(), which saves
+// the table lookups and PWM check digitalRead() does on every call (~50 cycles).
+struct RotaryInputPin {
+#ifdef __AVR__
+  volatile uint8_t *reg;
+  uint8_t mask;
+  void begin(uint8_t pin) {
+    reg = portInputRegister(digitalPinToPort(pin));
+    mask = digitalPinToBitMask(pin);
+  }
+  bool read() {
+    return(*reg & mask);
+  }
+#else
+  uint8_t pin;
+  void begin(uint8_t _pin) {
+    pin = _pin;
+  }
+  bool read() {
+    return(digitalRead(pin));
+  }
+#endif
+};
+
+// -- Event latency histograms, only kept if Config::latencyStats is set
+//   EDGE_TO_FORWARD  - button release edge to scan() passing the press to the StateMachine
+//                      (RotaryEncoder only, AbsoluteEncoder leaves it empty)
+//   EDGE_TO_CONSUME  - first edge of an event to the application taking it from the queue
+// (the ISRs queue events at the edge, so the second is all time spent in the queue).
+// Bucket 0 counts latencies of 0us, bucket n of 2^(n-1) to 2^n - 1us and the last
+// bucket everything from 16ms up, however long (the edges are timed in ticks as well
+// as the 16 bit micros, up to 67 seconds). Counts stop at 65535.
+template <bool enabled>
+class RotaryLatencyStats {
+   public:
+     enum Stage : uint8_t { EDGE_TO_FORWARD, EDGE_TO_CONSUME };
+     static const uint8_t buckets = 16;
+
+     const uint16_t *getLatencyHistogram(uint8_t stage) {
+       return(histogram[stage]);
+     }
+
+     void clearLatencyHistogram() {
+       memset(histogram, 0, sizeof(histogram));
+     }
+
+     //Raw dump of both histograms, little endian uint16_t[2][buckets]
+     void dumpLatencyHistogram() {
+       Serial.write((const uint8_t *)histogram, sizeof(histogram));
+     }
+
+   protected:
+     void recordLatency(uint8_t stage, uint16_t latency) {
+       uint8_t bucket = 0;
+
+       while (latency != 0 && bucket < buckets - 1) {
+         latency >>= 1;
+         bucket++;
+       }
+       if (histogram[stage][bucket] != 0xFFFF) histogram[stage][bucket]++;
+     }
+
+     //Time of the button release edge, for EDGE_TO_FORWARD. Set by the ISR, all 32 bits
+     //so a scan() 65ms or more later isn't taken as a short wait
+     void markEdge(long now) {
+       edge = now;
+     }
+
+     long edgeTime() {
+       return(edge);
+     }
+
+   private:
+     uint16_t histogram[2][buckets] = {};
+     volatile long edge = 0;
+};
+
+template <>
+class RotaryLatencyStats<false> {
+   public:
+     enum Stage : uint8_t { EDGE_TO_FORWARD, EDGE_TO_CONSUME };
+
+   protected:
+     void recordLatency(uint8_t, uint16_t) {}
+     void markEdge(long) {}
+     long edgeTime() { return(0); }
+};
+
+// -- Edge rate for the hybrid mode (Config::pollAboveEdges), in rotary interrupts per 64ms
+// window both ways. On interrupts it is the entries to encoderIntHandler(), bounces and
+// all, and how many of them were not bounces. sample() can't see bounces shorter than its
+// period, so once sampling each change it sees that would have been an interrupt counts
+// as the entries per change of the last window on interrupts. Only one of the two counts
+// at a time, as sample() only runs with the rotary interrupts detached. Nothing is kept
+// when the hybrid mode is off
+template <bool enabled>
+class RotaryEdgeRate {
+   protected:
+     //True if the window that started at the last restart is over
+     bool rateWindowOver(uint16_t nowTicks) {
+       return((uint16_t)(nowTicks - rateTime) >= 64);
+     }
+
+     void rateRestart(uint16_t nowTicks) {
+       rateTime = nowTicks;
+       rateEdges = rateChanges = 0;
+     }
+
+     //An interrupt - a change, or a bounce of one
+     void rateInterrupt(bool bounce) {
+       if (rateEdges != 0xFF) rateEdges++;
+       if (!bounce && rateChanges != 0xFF) rateChanges++;
+     }
+
+     //Over to sample() - keep the entries per change (rounded up) to scale what it sees
+     void rateSampling(uint16_t nowTicks) {
+       uint8_t changes = rateChanges ? rateChanges : 1;
+
+       rateChanges = (rateEdges + changes - 1) / changes;
+       rateNextWindow(nowTicks);
+     }
+
+     //Sampling - a new window, with the same entries per change
+     void rateNextWindow(uint16_t nowTicks) {
+       rateTime = nowTicks;
+       rateEdges = 0;
+     }
+
+     //Changes seen by sample() that would have been interrupts
+     void rateSampled(uint8_t changes) {
+       uint16_t edges = rateEdges + changes * (rateChanges ? rateChanges : 1);
+
+       rateEdges = edges > 0xFF ? 0xFF : edges;
+     }
+
+     uint8_t rateCount() {
+       return(rateEdges);
+     }
+
+   private:
+     volatile uint16_t rateTime = 0;   //ticks - start of the window
+     volatile uint8_t rateEdges = 0;   //Interrupts in the window, taken or estimated
+     volatile uint8_t rateChanges = 0; //On interrupts, those that weren't bounces. Sampling, interrupts per change
+};
+
+template <>
+class RotaryEdgeRate<false> {
+   protected:
+     bool rateWindowOver(uint16_t) { return(false); }
+     void rateRestart(uint16_t) {}
+     void rateInterrupt(bool) {}
+     void rateSampling(uint16_t) {}
+     void rateNextWindow(uint16_t) {}
+     void rateSampled(uint8_t) {}
+     uint8_t rateCount() { return(0); }
+};
+
+// -- Preemption points, the places in the main loop code where an encoder interrupt can
+// land between two reads or writes of shared state. Empty in a normal build; a host
+// harness can define it before including this file to run an ISR at each one, e.g.
+//   #define ROTARY_PREEMPTION_POINT() harnessPoint(__LINE__)
+// ROTARY_MASKED_POINT() marks the same inside a critical section, where the interrupt is
+// held until interrupts() - it is the critical section that makes the place safe, and a
+// harness checks it does (see test/PreemptionTest.cpp). test/avr leaves both empty - it
+// times the stretches with interrupts masked from noInterrupts() to interrupts()
+#ifndef ROTARY_PREEMPTION_POINT
+#define ROTARY_PREEMPTION_POINT()
+#endif
+#ifndef ROTARY_MASKED_POINT
+#define ROTARY_MASKED_POINT()
+#endif
 
 //Forward declarations
-class RotaryEncoder;
-RotaryEncoder *instance;
-static void encoderIntHandler();
-static void buttonIntHandler();
 static void enableDebounceDelayTerminate();
 extern Scheduler runner;
 
 // -- Main class definition 
-class RotaryEncoder {
+template <uint8_t pinA, uint8_t pinB, uint8_t pinC, class Config = RotaryEncoderConfig>
+class RotaryEncoder : public RotaryLatencyStats<Config::latencyStats>, public RotaryEdgeRate<Config::pollAboveEdges != 0> {
    public:
-     //  -- constructor
-     RotaryEncoder(uint8_t _pinA, uint8_t _pinB, uint8_t _pinC) {
-       pinA = _pinA; //Rotary "data" 
-       pinB = _pinB; //Rotary "clock"
-       pinC = _pinC; //Pushbutton
+     typedef RotaryGeometry<Config::statesPerDetent> Geometry;
+     typedef RotaryHysteresis<Config::reversalHysteresis> Hysteresis;
+
+     //pinA - Rotary "data", pinB - Rotary "clock", pinC - Pushbutton
+     enum Channel : uint8_t { ROTARY_CHANNEL, BUTTON_CHANNEL };
+
+     //Bits in flags. Set in the ISRs, cleared from scan() with interrupts disabled
+     enum Flag : uint8_t {
+       ACTIVE = 0x01,
+       ROTARY_DEBOUNCE = 0x02, //Debounce delay running on each channel - ROTARY_DEBOUNCE << channel
+       BUTTON_DEBOUNCE = 0x04,
+       BUTTON_DOWN = 0x08,
+       FAULT = 0x10,           //Interrupts detached by the health monitor, scan() is polling the pins
+       PULSE_STARTED = 0x20,
+       ACCEL = 0x40,
+       ADAPTIVE_DEBOUNCE = 0x80
+     };
 
+     //Long intervals are kept in 16 bit ticks of 1024us
+     static const uint16_t activityTimeoutTicks = Config::activityTimeout >> 10;
+     static const uint16_t longPressTicks = Config::longPressInterval >> 10;
+     static const uint16_t stuckButtonTicks = Config::stuckButtonInterval >> 10;
+     static const uint16_t rearmTicks = Config::rearmInterval >> 10;
+
+     //  -- constructor
+     RotaryEncoder() {
        instance = this;  //Needed by intrrupt handlers        
      }
 
 //Must call this during setup()     
      void begin(bool _accel=true) { 
+       static_assert(sizeof(RotaryEncoder) <= Config::ramBudget, "RotaryEncoder exceeds Config::ramBudget");
+       static_assert(Config::debounceInterval < 32768 && Config::debounceMaxInterval < 32768,
+                     "Debounce intervals must be under 32768us");
+       static_assert(Config::accelDivisor != 0, "accelDivisor can't be 0, use begin(false) for no acceleration");
+       static_assert(Config::pollAboveEdges == 0 || Config::pollBelowEdges < Config::pollAboveEdges,
+                     "pollBelowEdges must be below pollAboveEdges");
+       static_assert(Config::pollAboveEdges == 0 || Config::stormEdges == 0 || Config::pollAboveEdges < Config::stormEdges,
+                     "pollAboveEdges must be below stormEdges or a fast spin is reported as a storm");
+       static_assert(!Config::maskDuringDebounce || Config::pollAboveEdges == 0,
+                     "maskDuringDebounce can't be combined with the hybrid mode (pollAboveEdges)");
+       static_assert(Config::coalesceInterval < 65536, "Coalesce interval must fit in 16 bits");
+       static_assert((Config::activityTimeout >> 10) < 32768 && (Config::longPressInterval >> 10) < 32768
+                     && (Config::stuckButtonInterval >> 10) < 32768 && (Config::rearmInterval >> 10) < 32768,
+                     "Activity timeout, long press, stuck button and rearm intervals must be under 33 seconds");
        pinMode(pinA,INPUT_PULLUP);
        pinMode(pinB,INPUT_PULLUP);
        pinMode(pinC,INPUT_PULLUP);
-       accel = _accel;
-       attachInterrupt(digitalPinToInterrupt(pinA), encoderIntHandler, RISING); //rotary motion are we only inetrested in one edge
-       attachInterrupt(digitalPinToInterrupt(pinC), buttonIntHandler, CHANGE); //push button - we want to time down and up
-       
+       inputA.begin(pinA);
+       inputB.begin(pinB);
+       inputC.begin(pinC);
+       lastState = (inputA.read() << 1) | inputB.read();
+       setFlag(ACCEL, _accel);
+       attachInterrupts();
      }        
 
 //Returns number of clicks since previous call     
      int getPulseCount () {  // is positive for clockwise steps, negative for anticlocwise clicks
-       int retVal = pulseCount;
+       int retVal;
+       ROTARY_PREEMPTION_POINT();
+       noInterrupts();  //A click between the read and the clear would be lost
+       retVal = pulseCount;
+       ROTARY_MASKED_POINT();
        pulseCount = 0;
+       interrupts();
+       ROTARY_PREEMPTION_POINT();
+       return(retVal);
+     }
+
+//Takes the oldest queued event, returns false if there is none
+     bool getEvent(RotaryEvent &ev) {
+       bool found;
+       uint16_t latency = 0;
+       noInterrupts();
+       found = events.pop(ev);
+       if (found && Config::latencyStats) latency = events.age(ev, 1, Config::now());
+       interrupts();
+       if (found && Config::latencyStats) this->recordLatency(this->EDGE_TO_CONSUME, latency);
+       return(found);
+     }
+
+//Takes everything waiting (up to max) in one critical section, returns the number copied.
+//Cheaper than looping on getEvent() when a burst has built up, e.g. during a display refresh
+     size_t drain(RotaryEvent *out, size_t max) {
+       uint8_t count;
+       long now;
+       noInterrupts();
+       count = events.drain(out, max);
+       if (Config::latencyStats) { //Before the ISR can reuse the slots
+         now = Config::now();
+         for (uint8_t i = 0; i < count; i++)
+           this->recordLatency(this->EDGE_TO_CONSUME, events.age(out[i], count - i, now));
+       }
+       interrupts();
+       return(count);
+     }
+
+     bool eventPending() {
+       return(!events.isEmpty());
+     }
+
+//Events lost since the previous call because the queue was full (up to 255). The clicks
+//are still in getPulseCount() and getPosition(), only their events are missing
+     uint8_t getDroppedEvents() {
+       uint8_t retVal;
+       noInterrupts();
+       retVal = events.takeDropped();
+       interrupts();
+       return(retVal);
+     }
+
+//Raw click position, accumulated since begin() (no acceleration, no clamp at zero)
+     long getPosition() {
+       long retVal;
+       noInterrupts();
+       retVal = position;
+       interrupts();
        return(retVal);
      }
+
+//Filtered position in 1/256ths of a click
+     long getSmoothedPosition() {
+       return(filterPos);
+     }
+
+//Filtered velocity in 1/256ths of a click per second. filterVel is per tick, and a
+//second is 1000000 / 1024 = 15625 / 16 ticks
+     long getVelocity() {
+       return(((filterVel >> 4) * 15625L) >> 8);
+     }
+
+//Position (1/256ths of a click) expected "ahead" micros after the last scan().
+//ahead / 1024 ticks, split between the two factors so neither overflows
+     long getPredictedPosition(long ahead) {
+       return(filterPos + (((filterVel >> 4) * (ahead >> 6)) >> 8));
+     }
+
+//Synthetic input (remote control, test rigs) through the same acceleration, press
+//timing and event queue as the interrupt handlers, skipping the debounce. "when" is
+//the micros() time of the click or button change - space clicks out to get acceleration
+     void injectClick(int8_t direction, long when) {
+       noInterrupts();
+       countClick(direction < 0 ? -1 : 1, when);
+       interrupts();
+     }
+
+     void injectClick(int8_t direction) {
+       injectClick(direction, Config::now());
+     }
+
+     void injectButton(bool down, long when) {
+       noInterrupts();
+       buttonChange(down, when);
+       interrupts();
+     }
+
+     void injectButton(bool down) {
+       injectButton(down, Config::now());
+     }
+
+//Learn the debounce window from observed bounce widths (off by default)
+     void setAdaptiveDebounce(bool _adaptive) {
+       noInterrupts();  //The ISRs read the intervals
+       if (_adaptive) flags |= ADAPTIVE_DEBOUNCE;
+       else {
+         flags &= ~ADAPTIVE_DEBOUNCE;
+         debounceInterval[ROTARY_CHANNEL] = debounceInterval[BUTTON_CHANNEL] = Config::debounceInterval;
+       }
+       interrupts();
+     }
+
+     long getDebounceInterval(uint8_t channel) {
+       return(debounceInterval[channel]);
+     }
      
-//Returns true if there has been recent activity (in last 60 secs)
+//Hybrid mode (Config::pollAboveEdges) - call from a timer interrupt handler, every 250-500us say.
+//Interrupts are cheaper while the knob turns slowly, but a fast spin (with its bounces) costs
+//more in interrupts than sampling at a fixed rate. So above pollAboveEdges interrupts in 64ms
+//the rotary pin interrupts are detached and the pins are decoded here instead, until the
+//samples show fewer than pollBelowEdges interrupts would have been taken in 64ms (the same
+//unit both ways, see RotaryEdgeRate). A sample has to be seen twice running to count, which
+//is the debounce, so the sample rate needs to be at least 8 times the fastest click rate.
+//Does nothing (quickly) while the interrupts are in use. The button always uses its interrupt
+     void sample() {
+       long now;
+       uint16_t nowTicks;
+       uint8_t pins;
+       int8_t direction;
+
+       if (!polling) return;
+       now = Config::now();
+       nowTicks = now >> 10;
+       pins = (inputA.read() << 2) | (inputB.read() << 1);
+       if (pins != (pollState >> 4)) {
+         this->rateSampled(interruptEdges(pollState >> 4, pins));
+         pollState = (pollState & 0x0F) | (pins << 4);
+       } else if (pins != (pollState & 0x0F)) {
+         direction = Geometry::table[((pollState & 6) << 1) | (pins >> 1)];
+         pollState = pins | (pins << 4);
+         if (direction != 0) {  //As the handler would have - the debounce is in case it takes over again
+           if (direction != lastDirection) flags &= ~PULSE_STARTED;
+           lastDirection = direction;
+           deBounceStart[ROTARY_CHANNEL] = lastBounce[ROTARY_CHANNEL] = now;
+           countClick(direction, now);
+         }
+       }
+       //At the end of the window, unless a change is still being confirmed (the handler would
+       //take its bounce for a step back) - the window then runs on to the next settled sample
+       if (this->rateWindowOver(nowTicks) && pollState == (pins | (pins << 4))) {
+         if (this->rateCount() < Config::pollBelowEdges) {  //Slowed down - back to interrupts
+           polling = false;
+           lastState = pins >> 1;
+           flags |= ROTARY_DEBOUNCE;  //The last click's bounces may still be going - scan() ends it
+           attachRotary();
+         }
+         this->rateNextWindow(nowTicks);
+       }
+     }
+
+//True while the health monitor has the interrupts switched off (see scan())
+    bool isFaulted() {
+      return(flags & FAULT);
+    }
+
+//Returns true if there has been recent activity (in last 60 secs), the button is held
+//down, or the encoder is faulted - scan() has to keep running to re-arm it
     bool isActive() {
-      return(active);
+      return(flags & (ACTIVE | FAULT));
     }
     
 //Called every time through loop() if encoder is active - must be non-blocking and quick
     void scan() {
       long now = 0;
+      uint16_t nowTicks;
+      uint8_t press, presses, shift, channel;
+      long pressEdge;
       
       //What time is it now?
-      now = micros();
+      now = Config::now();
+      nowTicks = now >> 10;
+      ROTARY_PREEMPTION_POINT();
       
-      //Check for recent activity
-      if ( now > lastActivity + ACTIVITY_TIMEOUT || now < lastActivity ) {
-        active = false;
-        lastActivity = 0;
+      //Check for recent activity. An ISR may have run since now was read, so times it
+      //has stored can be later than now - the comparisons are signed so that reads as recent
+      //A held button, or a fault being polled, keeps the encoder active so scan() keeps running
+      //(not during a debounce, where lastActivity is the time of the last edge)
+      noInterrupts();
+      if ( !(flags & (ROTARY_DEBOUNCE | BUTTON_DEBOUNCE)) && ((flags & FAULT) || ((flags & BUTTON_DOWN) && !inputC.read())) )
+        lastActivity = nowTicks;
+      if ( (flags & ACTIVE) && (int16_t)(nowTicks - lastActivity) > (int16_t)activityTimeoutTicks ) {
+        flags &= ~(ACTIVE | PULSE_STARTED);
+        lastActivity = nowTicks;
+        hysteresis = Hysteresis::IDLE;
+        resetFilter(nowTicks);  //Not run while inactive, so it would hold its last velocity
       }
+      interrupts();
+      ROTARY_PREEMPTION_POINT();
     
-      //Check for end of de-bounce interval
-      if (inDebounceDelay) {
-        if ( now > deBounceEnd ) {
-          inDebounceDelay = false; 
-        } else return; //In debounce - ignore all events
+      if (flags & ACTIVE) updateFilter(nowTicks);
+      ROTARY_PREEMPTION_POINT();
+
+      //Health monitor - a button held down for too long is stuck, and a faulty line is polled until it settles
+      if (Config::stuckButtonInterval != 0) {
+        noInterrupts();
+        if ( (flags & BUTTON_DOWN) && (int16_t)(nowTicks - pressStart) > (int16_t)stuckButtonTicks
+             && !inputC.read() )
+          fault(RotaryEvent::STUCK_BUTTON, now);
+        interrupts();
+        ROTARY_PREEMPTION_POINT();
       }
+      if (flags & FAULT) poll(now, nowTicks);
 
-      //Has the button state changed? (recorded by int handler);
-      if (buttonDown != buttonState ) {
-      Serial.println("Button change");
-        if (buttonDown) 
-          pressStart = now; //New button press started
-        else 
-          pressEnd = now; 
-        if (!buttonDown) { //Button released
-          if ( now - pressStart > LONG_PRESS_INTERVAL )
-            encoderEvent = LONGPRESS;
-          else
-            //Short press event
-            encoderEvent = SHORTPRESS;
-          eventQueue.push(&encoderEvent);
-        } 
-        buttonState = buttonDown; //Save current state         
+      //Check for end of each channel's de-bounce interval (the ISRs end it themselves if we are
+      //late, unless their interrupts are masked for the debounce - then only scan() can end it).
+      //The clock is read again with interrupts off, as an ISR may have started a debounce since
+      noInterrupts();
+      now = Config::now();
+      nowTicks = now >> 10;
+      ROTARY_MASKED_POINT();
+      for (channel = ROTARY_CHANNEL; channel <= BUTTON_CHANNEL; channel++) {
+        if (!(flags & (ROTARY_DEBOUNCE << channel)) || !debounceExpired(channel, now, nowTicks)) continue;
+        if (Config::maskDuringDebounce) unmask(channel, now);
+        flags &= ~(ROTARY_DEBOUNCE << channel);
+        if ((flags & ADAPTIVE_DEBOUNCE) && !Config::maskDuringDebounce)
+          learnDebounce(channel, lastBounce[channel] - deBounceStart[channel], nowTicks);
+      }
+      presses = pendingPress;
+      ROTARY_MASKED_POINT();
+      pendingPress = 0;
+      pressEdge = this->edgeTime();
+      interrupts();
+      ROTARY_PREEMPTION_POINT();
+
+      //Pass on button presses timed and queued by buttonIntHandler(), oldest first - a
+      //double tap while scan() was held up is two presses. Only the newest edge is kept
+      //for the latency, so that is the one recorded
+      if (presses && Config::latencyStats) {
+        unsigned long latency = Config::now() - pressEdge;
+        this->recordLatency(this->EDGE_TO_FORWARD, latency < 0xFFFF ? latency : 0xFFFF);
+      }
+      for (shift = 6; presses; shift -= 2) {
+        press = (presses >> shift) & 3;
+        if (!press) continue;
+        presses &= ~(3 << shift);
+        if (press == RotaryEvent::LONG_PRESS)
+          encoderEvent = LONGPRESS;
+        else
+          //Short press event
+          encoderEvent = SHORTPRESS;
+        eventQueue.push(&encoderEvent);
       }
     } // End of scan() method
     
     void dumpState() { //output state variables (for debug)
       char buff[128];
-      sprintf(buff, "active: %d, lastActivity %d, inDebounceDelay: %d, buttonDown: %d, buttonState: %d\n",
-          active,lastActivity,inDebounceDelay,buttonDown,buttonState);
+      sprintf(buff, "active: %d, lastActivity %u, inDebounceDelay: %d, buttonDown: %d, pendingPress: %d\n",
+          !!(flags & ACTIVE),lastActivity,!!(flags & (ROTARY_DEBOUNCE | BUTTON_DEBOUNCE)),!!(flags & BUTTON_DOWN),pendingPress);
       Serial.print(buff);
     }
 
-     //Allow ISR access to members
-     friend void encoderIntHandler();
-     friend void buttonIntHandler();
-
-     //Properties
-     volatile int pulseCount;
-     uint8_t pinA, pinB, pinC; 
-     volatile long deBounceEnd, lastActivity, rotaryPulseStart;
-     volatile bool inDebounceDelay = false;
-     volatile bool active = false;
-     volatile bool buttonDown = BUTTON_UP;
-     volatile bool buttonState = BUTTON_UP;
-     long pressStart, pressEnd;  //Measures button press
-     bool accel = true;
-     bool pulseStarted = false;
-}; //end of RotaryEncoder class definition
+    //Alpha-beta filter step. filterPos is 1/256 clicks, filterVel is 1/65536 clicks per tick (1024us)
+    void updateFilter(uint16_t nowTicks) {
+      int32_t dt, predicted, residual;
 
-//Interrupt Handlers
+      dt = (uint16_t)(nowTicks - filterTime);
+      if (dt <= 0) return;
+      filterTime = nowTicks;
+      if (dt > Config::filterMaxStep) dt = Config::filterMaxStep;
+      predicted = filterPos + ((filterVel * dt + 128) >> 8);  //Rounded, or a small velocity never decays
+      residual = getPosition() * 256 - predicted;
+      //Settled - the velocity no longer moves the prediction, and the residual is too small
+      //for alpha to close (the shift floors, so that is only short of the click, not past it).
+      //Left to the rounding the velocity would hover either side of 0
+      if ((filterVel * dt + 128) >> 8 == 0 && (residual >> Config::filterAlphaShift) == 0) {
+        filterPos = predicted + residual;  //The raw position
+        filterVel = 0;
+        return;
+      }
+      filterPos = predicted + (residual >> Config::filterAlphaShift);
+      //The prediction has run a click past the position - the step it expected never
+      //came, so the knob has stopped (or slowed) and beta starts again from standstill
+      if ((filterVel > 0 && residual <= -256) || (filterVel < 0 && residual >= 256)) filterVel = 0;
+      else filterVel += ((residual * 256) >> Config::filterBetaShift) / dt;  //Not << 8, residual can be negative
+    }
+
+    //Back to standstill on the raw position, for when the encoder goes inactive
+    void resetFilter(uint16_t nowTicks) {
+      filterPos = position * 256;
+      filterVel = 0;
+      filterTime = nowTicks;
+    }
+
+    //Adaptive debounce - is the burst of bounces that started the channel's debounce still going?
+    //Its edges come closer together than debounceMinInterval. After a quiet spell an edge in the
+    //same direction could be the next click of a fast spin, and learning from those would
+    //widen the window until it ate real clicks (the bounces of that click, steps back, too)
+    bool burstGoing(uint8_t channel, uint16_t now) {
+      return((uint16_t)(now - lastBounce[channel]) < Config::debounceMinInterval);
+    }
+
+    //Adaptive debounce - a bounce that lands after the window has closed never shows in the
+    //burst width. An edge within one more window of the channel's last debounce starting is
+    //taken as one, and widens the window, if the ISR found it bounce like: the burst still
+    //going (see burstGoing()), a rotary step back or no step, or the button pin already back
+    //where it was. Called by the ISRs before deBounceStart is overwritten.
+    //lastEdge (ticks) rules out a gap that has wrapped the 16 bit micros()
+    //Returns true if it was learned
+    bool lateBounce(uint8_t channel, uint16_t now, uint16_t nowTicks, uint16_t lastEdge) {
+      uint16_t gap = now - deBounceStart[channel];
+
+      if (!(flags & ADAPTIVE_DEBOUNCE) || Config::maskDuringDebounce
+          || (uint16_t)(nowTicks - lastEdge) >= 32 || gap >= 2u * debounceInterval[channel])
+        return(false);
+      learnDebounce(channel, gap, nowTicks);
+      return(true);
+    }
+
+    //Track a decaying peak of the bounce widths for the channel and allow 100% margin above it.
+    //The peak decays by 1/8 a second, so an occasional long burst is remembered for a while.
+    //Called from scan() or the ISRs, interrupts must be off
+    void learnDebounce(uint8_t channel, uint16_t width, uint16_t nowTicks) {
+      uint16_t interval;
+      uint8_t seconds = (uint16_t)(nowTicks - peakTime) >> 10;
+
+      if (seconds > 0) {
+        if (seconds > 16) seconds = 16;
+        while (seconds--) {
+          bouncePeak[ROTARY_CHANNEL] -= bouncePeak[ROTARY_CHANNEL] / 8;
+          bouncePeak[BUTTON_CHANNEL] -= bouncePeak[BUTTON_CHANNEL] / 8;
+        }
+        peakTime = nowTicks;
+      }
+      if (width > bouncePeak[channel]) bouncePeak[channel] = width;
+      interval = (bouncePeak[channel] < 16384) ? 2 * bouncePeak[channel] : 32767;
+      if (interval < Config::debounceMinInterval) interval = Config::debounceMinInterval;
+      if (interval > Config::debounceMaxInterval) interval = Config::debounceMaxInterval;
+      debounceInterval[channel] = interval;
+    }
+
+    //Channel's debounce delay over? Works from the edge times so it doesn't matter when it is checked.
+    //lastActivity covers the 16 bit micros() values wrapping during a long wait.
+    //now must be read after the debounce started, i.e. with interrupts off
+    bool debounceExpired(uint8_t channel, uint16_t now, uint16_t nowTicks) {
+      return( (uint16_t)(now - deBounceStart[channel]) >= debounceInterval[channel]
+              || (uint16_t)(nowTicks - lastActivity) > 32 );
+    }
+
+    //A click that got past the debounce - acceleration, counts and the event queue.
+    //Called from encoderIntHandler() or injectClick(), so interrupts are off
+    void countClick(int8_t direction, long now) {
+       int increment;
+       uint16_t nowTicks, pulseDuration; 
+       bool pulseReceived;
+
+       nowTicks = now >> 10;
+       flags |= ACTIVE;
+       lastActivity = nowTicks;
 
-//Called on edge (on pinA) - rotary motion
-static void encoderIntHandler() {
-   int pinBval, increment;
-   long now, pulseDuration; 
-   bool pulseReceived;
-    
-   now = micros();
-   instance->active = true;
-   instance->lastActivity = now;    //Start activity timer
-   
-   //Main body only executed if not in de-bounce period
-   if ( instance->inDebounceDelay == false ) {
-   
-       // initiate de-bounce delay and set end time
-       instance->inDebounceDelay = true;  //DebounceDelay is terminated in scan()
-       instance->deBounceEnd = now + DEBOUNCE_INTERVAL; 
-      
        // Work out if we have received a complete pulse
        pulseReceived = false;
-       if (!instance->pulseStarted) { //start of pulse
-         instance->pulseStarted = true;
-         instance->rotaryPulseStart = now;
+       if (!(flags & PULSE_STARTED)) { //start of pulse
+         flags |= PULSE_STARTED;
+         rotaryPulseStart = nowTicks;
        } else { //end of pulse
-         instance->pulseStarted = false;
-         pulseDuration = now - instance->rotaryPulseStart;
+         flags &= ~PULSE_STARTED;
+         pulseDuration = nowTicks - rotaryPulseStart;
          pulseReceived = true;
        }
   
-       // --- Get the current pin states and increment pulseCount accordingly
+       // --- increment pulseCount accordingly
        increment = 1;
        if ( pulseReceived ) {
-         if(instance->accel)  //calculate increment        
-           increment = 1 + (1000000 / (3*pulseDuration)); //If using encoder speed add a factor 
+         if (pulseDuration == 0) pulseDuration = 1;
+         if(flags & ACCEL)  //calculate increment (1000000us / accelDivisor*duration)        
+           increment = 1 + ((uint16_t)(1000000L / (Config::accelDivisor * 1024L)) / pulseDuration); //If using encoder speed add a factor 
        }
            
-       //Need to look at the CLK pin to work out diretion of rotation  
-       pinBval = digitalRead(instance->pinB);
-       if ( pinBval == 0 ) instance->pulseCount += increment; //clockwise rotation
-       else instance->pulseCount -= increment;
-       if (instance->pulseCount < 0) instance->pulseCount = 0;
+       increment *= direction;
+       pulseCount += increment;
+       if (pulseCount < 0) pulseCount = 0;
+       position += direction;
+       events.pushRotation(increment, now);
+    }
+
+    //Debounced button position - times the press from the edges and queues it on release.
+    //Called from buttonIntHandler() or injectButton(), so interrupts are off
+    void buttonChange(bool down, long now) {
+      uint16_t nowTicks = now >> 10;
+      uint8_t press;
+
+      flags |= ACTIVE;
+      lastActivity = nowTicks;
+      if (down) {
+        if (!(flags & BUTTON_DOWN)) pressStart = nowTicks;
+        flags |= BUTTON_DOWN;
+      } else if (flags & BUTTON_DOWN) { //Button released
+        flags &= ~BUTTON_DOWN;
+        if ( (uint16_t)(nowTicks - pressStart) > longPressTicks )
+          press = RotaryEvent::LONG_PRESS;
+        else
+          press = RotaryEvent::SHORT_PRESS;
+        events.push(press, now, 0);
+        if (!(pendingPress & 0xC0)) pendingPress = (pendingPress << 2) | press; //Dropped if 4 are waiting
+        this->markEdge(now);
+      }
+    }
+
+    void attachInterrupts() {
+      attachRotary();
+      attachInterrupt(digitalPinToInterrupt(pinC), buttonIntHandler, CHANGE); //push button - we want to time down and up
+    }
+
+    //rotary motion - both edges of pin A, and of pin B with 1 state per click
+    static void attachRotary() {
+      attachInterrupt(digitalPinToInterrupt(pinA), encoderIntHandler, CHANGE);
+      if (Geometry::interruptB)
+        attachInterrupt(digitalPinToInterrupt(pinB), encoderIntHandler, CHANGE);
+    }
+
+    static void detachRotary() {
+      detachInterrupt(digitalPinToInterrupt(pinA));
+      if (Geometry::interruptB) detachInterrupt(digitalPinToInterrupt(pinB));
+    }
+
+    //End of a debounce with Config::maskDuringDebounce - re-attach the channel's interrupts
+    //and pick up where its pins have got to. Interrupts are off on entry and exit
+    void unmask(uint8_t channel, long now) {
+      uint8_t state;
+
+      if (channel == BUTTON_CHANNEL) {
+        attachInterrupt(digitalPinToInterrupt(pinC), buttonIntHandler, CHANGE);
+        interrupts();   //An edge latched while detached is taken here, as a bounce
+        state = inputC.read();
+        noInterrupts();
+        buttonChange(!state, now);
+      } else {
+        attachRotary();
+        interrupts();
+        state = (inputA.read() << 1) | inputB.read();
+        noInterrupts();
+        lastState = state;
+      }
+    }
+
+    //Counts interrupts in 64ms windows, a storm of them means a faulty line. Called by both ISRs
+    bool edgeStorm(long now, uint16_t nowTicks) {
+      if (Config::stormEdges == 0) return(false);
+      if ((uint16_t)(nowTicks - healthTime) >= 64) {
+        healthTime = nowTicks;
+        healthCount = 0;
+      }
+      if (++healthCount <= Config::stormEdges) return(false);
+      fault(RotaryEvent::EDGE_STORM, now);
+      return(true);
+    }
+
+    //Switch to polling from scan() until the lines settle. Interrupts must be off
+    void fault(uint8_t code, long now) {
+      uint8_t pins = (inputA.read() << 2) | (inputB.read() << 1) | inputC.read();
+
+      detachRotary();
+      detachInterrupt(digitalPinToInterrupt(pinC));
+      flags = (flags | FAULT | ACTIVE) & ~(ROTARY_DEBOUNCE | BUTTON_DEBOUNCE | PULSE_STARTED | BUTTON_DOWN); //No press from a faulty button
+      lastActivity = now >> 10;
+      polling = false;
+      healthTime = now >> 10;
+      pollState = pins | (pins << 4);
+      events.push(RotaryEvent::FAULT, now, 0, code);
+    }
+
+    //Low rate fallback while faulted. pollState has the pins (A, B, button) last counted in
+    //the low nibble and the last sample in the high nibble - a sample has to be seen twice
+    //running to count, so a noisy line doesn't count as rotation.
+    void poll(long now, uint16_t nowTicks) {
+      uint8_t pins = (inputA.read() << 2) | (inputB.read() << 1) | inputC.read();
+      int8_t direction;
+
+      if (pins != (pollState >> 4)) {
+        pollState = (pollState & 0x0F) | (pins << 4);
+        healthTime = nowTicks;   //Still changing
+      } else if (pins != (pollState & 0x0F)) {
+        direction = Geometry::table[((pollState & 6) << 1) | (pins >> 1)];
+        noInterrupts();
+        if (direction != 0) countClick(direction, now);
+        if ((pins ^ pollState) & 1) buttonChange(!(pins & 1), now);
+        interrupts();
+        pollState = pins | (pins << 4);
+      } else if ((pins & 1) && (uint16_t)(nowTicks - healthTime) >= rearmTicks) {
+        //Settled with the button up - back to interrupts
+        noInterrupts();
+        lastState = pins >> 1;
+        flags &= ~FAULT;
+        healthCount = 0;
+        healthTime = nowTicks;
+        events.push(RotaryEvent::FAULT, now, 0, RotaryEvent::FAULT_CLEARED);
+        attachInterrupts();
+        interrupts();
+      }
+    }
+
+    //Hybrid mode - the knob is spinning fast, so hand the rotary pins over to sample().
+    //The edge that tipped it over is left for sample() to count, from prev. Called by encoderIntHandler()
+    void startPolling(uint8_t prev, uint16_t nowTicks) {
+      detachRotary();
+      polling = true;
+      pollState = (prev << 1) | (prev << 5);
+      this->rateSampling(nowTicks);
+    }
+
+    //Rotary interrupts a change of the pins from prev to cur would take (A in bit 2, B in bit 1)
+    static uint8_t interruptEdges(uint8_t prev, uint8_t cur) {
+      uint8_t changed = prev ^ cur;
+
+      return( ((changed & 4) ? 1 : 0)
+            + ((changed & 2) && Geometry::interruptB ? 1 : 0) );
+    }
+
+    //Update flags from the main loop, the ISRs modify the same byte
+    void setFlag(uint8_t flag, bool on) {
+      noInterrupts();
+      if (on) flags |= flag;
+      else flags &= ~flag;
+      interrupts();
+    }
+
+     //Interrupt handlers, one pair per encoder
+     static void encoderIntHandler();
+     static void buttonIntHandler();
+     static RotaryEncoder *instance;
+     static RotaryInputPin inputA, inputB, inputC; //Per encoder type, so not counted in sizeof()
+
+     //Properties - widest first so nothing is padded
+     volatile int32_t position = 0; //Raw clicks, input to the tracking filter
+     int32_t filterPos = 0, filterVel = 0;
+     volatile int16_t pulseCount = 0;
+     uint16_t filterTime = 0;                          //ticks
+     volatile uint16_t lastActivity = 0, pressStart = 0; //ticks
+     volatile uint16_t rotaryPulseStart = 0;           //ticks
+     volatile uint16_t deBounceStart[2] = { 0, 0 }, lastBounce[2] = { 0, 0 }; //Per channel, low 16 bits of micros()
+     volatile uint16_t healthTime = 0;  //ticks - start of the storm window, or last line change while faulted
+     uint16_t debounceInterval[2] = { Config::debounceInterval, Config::debounceInterval };
+     uint16_t bouncePeak[2] = { 0, 0 };
+     uint16_t peakTime = 0;                            //ticks - last decay of bouncePeak
+     volatile uint8_t flags = ACCEL | (Config::buttonUp ? BUTTON_DOWN : 0);
+     volatile uint8_t pendingPress = 0; //Up to 4 press types (2 bits, newest lowest) not yet passed to the state machine by scan()
+     volatile uint8_t lastState = 0;    //Pins A and B at the last rotary edge
+     volatile int8_t lastDirection = 0; //Of the click that started the last rotary debounce
+     volatile uint8_t hysteresis = Hysteresis::IDLE;
+     volatile uint8_t healthCount = 0;  //Interrupts in this storm window
+     uint8_t pollState = 0;             //Pins sampled by poll() while faulted, or sample() in hybrid mode
+     volatile bool polling = false;     //Hybrid mode - sample() is decoding the rotary pins
+     RotaryEventQueue<Config> events;
+}; //end of RotaryEncoder class definition
+
+template <uint8_t pinA, uint8_t pinB, uint8_t pinC, class Config>
+RotaryEncoder<pinA, pinB, pinC, Config> *RotaryEncoder<pinA, pinB, pinC, Config>::instance = NULL;
+template <uint8_t pinA, uint8_t pinB, uint8_t pinC, class Config>
+RotaryInputPin RotaryEncoder<pinA, pinB, pinC, Config>::inputA;
+template <uint8_t pinA, uint8_t pinB, uint8_t pinC, class Config>
+RotaryInputPin RotaryEncoder<pinA, pinB, pinC, Config>::inputB;
+template <uint8_t pinA, uint8_t pinB, uint8_t pinC, class Config>
+RotaryInputPin RotaryEncoder<pinA, pinB, pinC, Config>::inputC;
+
+//Interrupt Handlers
+
+//Called on edge (on pinA, and pinB for 1 state per click) - rotary motion
+template <uint8_t pinA, uint8_t pinB, uint8_t pinC, class Config>
+void RotaryEncoder<pinA, pinB, pinC, Config>::encoderIntHandler() {
+   int8_t direction;
+   uint8_t state, prev, last;
+   long now;
+   uint16_t nowTicks, lastEdge;
+    
+   now = Config::now();
+   nowTicks = now >> 10;
+   if (instance->edgeStorm(now, nowTicks)) return;
+   if ( !Config::maskDuringDebounce && (instance->flags & ROTARY_DEBOUNCE)
+        && instance->debounceExpired(ROTARY_CHANNEL, now, nowTicks) )
+     instance->flags &= ~ROTARY_DEBOUNCE; //scan() hasn't got round to it yet
+   instance->flags |= ACTIVE;
+   lastEdge = instance->lastActivity;
+   instance->lastActivity = nowTicks;    //Start activity timer
+
+   //Look up the transition - tracked through the debounce period so the next one is valid
+   state = (inputA.read() << 1) | inputB.read();
+   prev = Geometry::interruptB ? instance->lastState : state ^ 2;
+   last = instance->lastState;
+   instance->lastState = state;
+   direction = Geometry::table[(prev << 2) | state];
+   if (Config::pollAboveEdges != 0) {
+     if (instance->rateWindowOver(nowTicks)) instance->rateRestart(nowTicks);
+     instance->rateInterrupt(instance->flags & ROTARY_DEBOUNCE);
+     if (instance->rateCount() > Config::pollAboveEdges) {
+       instance->startPolling(prev, nowTicks);
+       return;
+     }
+   }
+   
+   //4 states per click - A falling counts nothing, but the pin bouncing back up would read
+   //as a click back, so it starts a debounce of its own. Part way through a click (B has
+   //moved on since A rose) it always does, and in it only a click with B moved on again
+   //counts, so a fast spin isn't held up. Back where A rose (B hasn't moved) it is a bounce
+   //during a debounce, else a late one. A may read high again if the handler ran late
+   if ( Geometry::midClickA && (last & 2) && (((state ^ last) & 1) || !(state & 2)) ) {
+     if (!((state ^ last) & 1)) {
+       if (instance->flags & ROTARY_DEBOUNCE) {
+         if (!(instance->flags & ADAPTIVE_DEBOUNCE) || instance->burstGoing(ROTARY_CHANNEL, now))
+           instance->lastBounce[ROTARY_CHANNEL] = now;
+         return;
+       }
+       instance->lateBounce(ROTARY_CHANNEL, now, nowTicks, lastEdge);
+     }
+     instance->flags |= ROTARY_DEBOUNCE;
+     instance->deBounceStart[ROTARY_CHANNEL] = instance->lastBounce[ROTARY_CHANNEL] = now;
+     if (Config::maskDuringDebounce) detachRotary(); //scan() re-attaches at the end of the debounce
+     return;
+   }
+
+   //Main body only executed if not in de-bounce period (or in A falling's with B moved on),
+   //and the edge counts a click - with 4 states, A rising since the last edge
+   if ( direction != 0 && (!Geometry::midClickA || !(last & 2))
+        && ( !(instance->flags & ROTARY_DEBOUNCE) || (Geometry::midClickA && ((state ^ last) & 1)) ) ) {
+   
+       // initiate de-bounce delay - unless the last one's burst is still going, when the
+       // (now wider) window just carries on from the start of the burst
+       if (instance->burstGoing(ROTARY_CHANNEL, now)) {
+         if (instance->lateBounce(ROTARY_CHANNEL, now, nowTicks, lastEdge)) {
+           instance->flags |= ROTARY_DEBOUNCE;
+           instance->lastBounce[ROTARY_CHANNEL] = now;
+           return;
+         }
+       } else if (direction != instance->lastDirection) {
+         instance->lateBounce(ROTARY_CHANNEL, now, nowTicks, lastEdge);
+       }
+       //A reversal restarts the acceleration - with hysteresis, the one the table counts
+       if (Config::reversalHysteresis == 0 && direction != instance->lastDirection) instance->flags &= ~PULSE_STARTED;
+       instance->lastDirection = direction;
+       instance->flags |= ROTARY_DEBOUNCE;  //DebounceDelay is terminated in scan()
+       instance->deBounceStart[ROTARY_CHANNEL] = instance->lastBounce[ROTARY_CHANNEL] = now;
+       if (Config::maskDuringDebounce) detachRotary(); //scan() re-attaches at the end of the debounce
+
+       //Hold back clicks just after a change of direction
+       if (Config::reversalHysteresis != 0) {
+         uint8_t next = Hysteresis::table[(instance->hysteresis << 1) | (direction > 0)];
+         instance->hysteresis = next >> 3;
+         if (!(next & (Hysteresis::CW | Hysteresis::CCW))) return;
+         if (next & Hysteresis::REVERSED) instance->flags &= ~PULSE_STARTED; //Not the jitter held back
+       }
+      
+       instance->countClick(direction, now);
+   } else if (instance->flags & ROTARY_DEBOUNCE) {
+       //A bounce, or the next click come early - which isn't part of the burst
+       if (!(instance->flags & ADAPTIVE_DEBOUNCE) || instance->burstGoing(ROTARY_CHANNEL, now))
+         instance->lastBounce[ROTARY_CHANNEL] = now;
+   } else {
+       instance->lateBounce(ROTARY_CHANNEL, now, nowTicks, lastEdge); //No step - a late bounce?
    }
 }
 
 //Called on falling and rising edges of the button pin
-static void buttonIntHandler() {
+template <uint8_t pinA, uint8_t pinB, uint8_t pinC, class Config>
+void RotaryEncoder<pinA, pinB, pinC, Config>::buttonIntHandler() {
   long now;
+  uint16_t nowTicks;
+  bool down;
   
-  instance->active = true;
-  if ( instance->inDebounceDelay == false ) { 
+  now = Config::now();
+  nowTicks = now >> 10;
+  if (instance->edgeStorm(now, nowTicks)) return;
+  if ( !Config::maskDuringDebounce && (instance->flags & BUTTON_DEBOUNCE)
+       && instance->debounceExpired(BUTTON_CHANNEL, now, nowTicks) )
+    instance->flags &= ~BUTTON_DEBOUNCE; //scan() hasn't got round to it yet
+  instance->flags |= ACTIVE;
+  if ( !(instance->flags & BUTTON_DEBOUNCE) ) { 
        // initiate de-bounce delay (ignore further interrupts for a while)
-       instance->inDebounceDelay = true;
-       now = micros();
-       instance->lastActivity = now;
-       instance->deBounceEnd = now + DEBOUNCE_INTERVAL;
-       instance->buttonDown = !digitalRead(instance->pinC); //record current button position, up or down
+       down = !inputC.read();
+       if ( down == !!(instance->flags & BUTTON_DOWN)   //Already back, or the burst still going - a late bounce?
+            || instance->burstGoing(BUTTON_CHANNEL, now) )
+         instance->lateBounce(BUTTON_CHANNEL, now, nowTicks, instance->lastActivity);
+       instance->flags |= BUTTON_DEBOUNCE;
+       instance->lastActivity = nowTicks;
+       instance->deBounceStart[BUTTON_CHANNEL] = instance->lastBounce[BUTTON_CHANNEL] = now;
+       if (Config::maskDuringDebounce) detachInterrupt(digitalPinToInterrupt(pinC));
+       instance->buttonChange(down, now); //record current button position, up or down
+   } else {
+       instance->lastBounce[BUTTON_CHANNEL] = now;
    }
 }       
 
 #endif
-
@@ -0,0 +1,157 @@
+#ifndef RotaryMap_hpp
+#define RotaryMap_hpp
+/*
+  Mapping a knob position to a control value through a precomputed curve
+
+  Volume, brightness and frequency want equal steps to sound or look equal, which
+  means a logarithmic or exponential curve rather than a straight line. The curves
+  here are worked out by the compiler into a small table of points, evenly spaced
+  over 0..inputMax, and the position is mapped with an integer lookup and linear
+  interpolation between points - there is no floating point at run time.
+
+    typedef RotaryExpMap<100, 20, 20000> Frequency;   //20Hz - 20kHz, equal ratio per click
+    typedef RotaryLogMap<64, 0, 255, 50> Brightness;  //Fast at first, slope falls 50:1
+    typedef RotaryPointMap<40, 0, 10, 30, 100, 1000> Custom;
+
+    level = constrain(level + knob.getPulseCount(), 0, 64);  //getPulseCount() is clicks since the last call
+    analogWrite(LED, Brightness::map(level));
+
+  Positions outside 0..inputMax are clamped. inputMax can be up to 32767. Each table
+  is (segments + 1) * 2 bytes, 34 bytes for the default 16 segments, kept in flash
+  (PROGMEM) on AVR and read with pgm_read_word(), so it takes no RAM - read a table's
+  points directly with rotaryReadPoint(&Map::table[i]).
+
+  No Arduino dependencies (just avr-libc's pgmspace.h on AVR), so the same tables can
+  be checked on a host build - see test/RotaryMapTest.cpp.
+*/
+
+#include "RotaryDecode.hpp"
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define ROTARY_PROGMEM PROGMEM
+inline uint16_t rotaryReadPoint(const uint16_t *point) {
+  return(pgm_read_word(point));
+}
+#else
+#define ROTARY_PROGMEM
+inline uint16_t rotaryReadPoint(const uint16_t *point) {
+  return(*point);
+}
+#endif
+
+// -- Compile time maths for generating the tables (C++11 constexpr, so all recursion)
+constexpr double rotaryExpSeries(double x, double term, unsigned n) {
+  return( n > 16 ? term : term + rotaryExpSeries(x, term * x / n, n + 1) );
+}
+
+constexpr double rotarySquare(double y) {
+  return( y * y );
+}
+
+constexpr double rotaryExp(double x) {
+  return( x < 0 ? 1 / rotaryExp(-x)
+        : x > 0.5 ? rotarySquare(rotaryExp(x / 2))
+        : rotaryExpSeries(x, 1, 1) );
+}
+
+constexpr double rotaryAtanhSeries(double z2, double power, unsigned n) {
+  return( n > 41 ? 0 : power / n + rotaryAtanhSeries(z2, power * z2, n + 2) );
+}
+
+//ln(y) = 2 atanh((y - 1) / (y + 1)), with y brought into 0.5..2 first so the series converges quickly
+constexpr double rotaryLn(double y) {
+  return( y > 2 ? rotaryLn(y / 2) + 0.69314718055994531
+        : y < 0.5 ? -rotaryLn(1 / y)
+        : 2 * rotaryAtanhSeries(((y - 1) / (y + 1)) * ((y - 1) / (y + 1)), (y - 1) / (y + 1), 1) );
+}
+
+constexpr uint16_t rotaryRound(double v) {
+  return( v <= 0 ? 0 : v >= 65534.5 ? 65535 : (uint16_t)(v + 0.5) );
+}
+
+// -- Table point i of n for each curve
+//Exponential: lo * (hi / lo) ^ (i / n) - every step is the same ratio (lo must not be 0)
+constexpr uint16_t rotaryExpPoint(uint16_t lo, uint16_t hi, unsigned i, unsigned n) {
+  return( rotaryRound(lo * rotaryExp(rotaryLn((double)hi / lo) * i / n)) );
+}
+
+//Logarithmic: lo + (hi - lo) * ln(1 + (curve - 1) * i / n) / ln(curve)
+//The slope at the start is curve times the slope at the end (curve must be above 1)
+constexpr uint16_t rotaryLogPoint(uint16_t lo, uint16_t hi, uint16_t curve, unsigned i, unsigned n) {
+  return( rotaryRound(lo + ((double)hi - lo) * rotaryLn(1 + (curve - 1.0) * i / n) / rotaryLn(curve)) );
+}
+
+// -- Integer lookup and interpolation in a table (in PROGMEM on AVR) of n points spread over 0..inputMax
+template <size_t n>
+uint16_t rotaryInterpolate(const uint16_t (&table)[n], long inputMax, long position) {
+  long scaled;
+  uint8_t seg;
+  uint16_t start;
+  int32_t diff;
+
+  if (position <= 0) return(rotaryReadPoint(&table[0]));
+  if (position >= inputMax) return(rotaryReadPoint(&table[n - 1]));
+  scaled = position * (long)(n - 1);
+  seg = scaled / inputMax;
+  start = rotaryReadPoint(&table[seg]);
+  diff = (int32_t)rotaryReadPoint(&table[seg + 1]) - start;
+  return( start + diff * (scaled - seg * inputMax) / inputMax );
+}
+
+// -- Custom curve - the points are given directly, evenly spaced over 0..inputMax
+template <long inputMax, uint16_t... points>
+struct RotaryPointMap {
+  static_assert(sizeof...(points) >= 2 && sizeof...(points) <= 256, "2 to 256 points");
+  static_assert(inputMax > 0 && inputMax <= 32767, "inputMax must be 1 to 32767");
+  static const uint16_t table[sizeof...(points)] ROTARY_PROGMEM;
+
+  static uint16_t map(long position) {
+    return( rotaryInterpolate(table, inputMax, position) );
+  }
+};
+
+template <long inputMax, uint16_t... points>
+const uint16_t RotaryPointMap<inputMax, points...>::table[sizeof...(points)] ROTARY_PROGMEM = { points... };
+
+// -- Exponential curve from lo to hi (a "log taper" pot)
+template <long inputMax, uint16_t lo, uint16_t hi, uint8_t segments = 16,
+          class = typename RotaryMakeIndices<segments + 1>::type>
+struct RotaryExpMap;
+
+template <long inputMax, uint16_t lo, uint16_t hi, uint8_t segments, unsigned... i>
+struct RotaryExpMap<inputMax, lo, hi, segments, RotaryIndices<i...> > {
+  static_assert(lo != 0 && hi != 0, "An exponential curve can't start or end at 0");
+  static_assert(inputMax > 0 && inputMax <= 32767, "inputMax must be 1 to 32767");
+  static const uint16_t table[sizeof...(i)] ROTARY_PROGMEM;
+
+  static uint16_t map(long position) {
+    return( rotaryInterpolate(table, inputMax, position) );
+  }
+};
+
+template <long inputMax, uint16_t lo, uint16_t hi, uint8_t segments, unsigned... i>
+const uint16_t RotaryExpMap<inputMax, lo, hi, segments, RotaryIndices<i...> >::table[sizeof...(i)] ROTARY_PROGMEM =
+  { rotaryExpPoint(lo, hi, i, segments)... };
+
+// -- Logarithmic curve from lo to hi, steep at first
+template <long inputMax, uint16_t lo, uint16_t hi, uint16_t curve = 100, uint8_t segments = 16,
+          class = typename RotaryMakeIndices<segments + 1>::type>
+struct RotaryLogMap;
+
+template <long inputMax, uint16_t lo, uint16_t hi, uint16_t curve, uint8_t segments, unsigned... i>
+struct RotaryLogMap<inputMax, lo, hi, curve, segments, RotaryIndices<i...> > {
+  static_assert(curve > 1, "curve is the ratio of start to end slope, so must be above 1");
+  static_assert(inputMax > 0 && inputMax <= 32767, "inputMax must be 1 to 32767");
+  static const uint16_t table[sizeof...(i)] ROTARY_PROGMEM;
+
+  static uint16_t map(long position) {
+    return( rotaryInterpolate(table, inputMax, position) );
+  }
+};
+
+template <long inputMax, uint16_t lo, uint16_t hi, uint16_t curve, uint8_t segments, unsigned... i>
+const uint16_t RotaryLogMap<inputMax, lo, hi, curve, segments, RotaryIndices<i...> >::table[sizeof...(i)] ROTARY_PROGMEM =
+  { rotaryLogPoint(lo, hi, curve, i, segments)... };
+
+#endif
@@ -0,0 +1,156 @@
+/*
+  Host tests for AbsoluteEncoder with the stub Arduino core
+  
+  A 4 bit Gray code switch on pins 8-11. Off AVR every pin has its own change
+  interrupt, so setting a pin through mockEdge() runs intHandler() as the hardware would.
+*/
+#include "Arduino.h"
+#include "AbsoluteEncoder.hpp"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+struct LatencyConfig : RotaryEncoderConfig {
+  static const bool latencyStats = true;
+  static const uint16_t ramBudget = 220;
+};
+
+typedef AbsoluteEncoder<8, 4> Selector;
+typedef AbsoluteEncoder<8, 4, LatencyConfig> Switch;
+
+// -- Helpers
+//Move the switch to binary position "to" at "when" - one pin changes between neighbours
+static void moveTo(uint8_t to, unsigned long when) {
+  uint8_t gray = to ^ (to >> 1);
+
+  for (uint8_t bit = 0; bit < 4; bit++)
+    mockEdge(8 + bit, (gray >> bit) & 1, when);
+}
+
+//Resting at position 0 - all pins low
+static void restingPins() {
+  for (uint8_t bit = 0; bit < 4; bit++) mockPins[8 + bit] = LOW;
+}
+
+//Move to "to" with bounces back to "from", 100us apart
+static void bouncyMove(uint8_t from, uint8_t to, unsigned long when, int bounces) {
+  moveTo(to, when);
+  for (int i = 0; i < bounces; i++) {
+    moveTo(from, when + 200 * i + 100);
+    moveTo(to, when + 200 * i + 200);
+  }
+}
+
+//Everything queued, delta added up
+static long drainedDelta(Selector &knob, int &events) {
+  RotaryEvent ev[8] = {};
+  long delta = 0;
+  int n;
+
+  events = 0;
+  while ((n = knob.drain(ev, 8)) > 0)
+    for (int i = 0; i < n; i++, events++) delta += ev[i].delta;
+  return(delta);
+}
+
+// -- Tests
+void testTurn() {
+  Selector knob;
+  int events;
+
+  restingPins();
+  knob.begin();
+  CHECK_EQUAL(0, knob.getAbsolutePosition());
+  moveTo(1, 100000);
+  moveTo(2, 200000);
+  moveTo(3, 300000);
+  CHECK_EQUAL(3, knob.getAbsolutePosition());
+  CHECK_EQUAL(3, knob.getPosition());
+  CHECK_EQUAL(3, knob.getPulseCount());
+  CHECK(knob.isActive());
+  moveTo(2, 400000);
+  moveTo(15, 500000);                    //3 back, the short way across the join
+  moveTo(0, 600000);
+  CHECK_EQUAL(0, knob.getPosition());
+  CHECK_EQUAL(0, drainedDelta(knob, events));
+}
+
+//3 detents, each with 4 bounces back - all the bounces cancel in the queue, and
+//what the application drains adds up to the position
+void testBounce() {
+  Selector knob;
+  int events;
+
+  restingPins();
+  knob.begin();
+  bouncyMove(0, 1, 100000, 4);
+  bouncyMove(1, 2, 101000, 4);           //A quick turn, merged into one event
+  bouncyMove(2, 3, 102000, 4);
+  CHECK_EQUAL(3, knob.getPosition());
+  CHECK_EQUAL(3, drainedDelta(knob, events));
+  CHECK_EQUAL(1, events);
+
+  bouncyMove(3, 4, 300000, 4);           //Slowly, an event a detent
+  bouncyMove(4, 5, 500000, 4);
+  bouncyMove(5, 4, 700000, 4);
+  CHECK_EQUAL(4, knob.getPosition());
+  CHECK_EQUAL(1, drainedDelta(knob, events));
+  CHECK_EQUAL(3, events);
+
+  bouncyMove(4, 5, 900000, 2);           //Taken mid bounce - the rest cancel out on their own
+  CHECK_EQUAL(1, drainedDelta(knob, events));
+  moveTo(4, 900500);
+  moveTo(5, 900600);
+  moveTo(4, 900700);
+  moveTo(5, 900800);
+  CHECK_EQUAL(5, knob.getPosition());
+  CHECK_EQUAL(0, drainedDelta(knob, events));
+  CHECK_EQUAL(0, events);
+}
+
+void testLatencyStats() {
+  Switch knob;
+  const uint16_t *consume;
+  RotaryEvent ev[4] = {};
+
+  restingPins();
+  knob.begin();
+  consume = knob.getLatencyHistogram(knob.EDGE_TO_CONSUME);
+  moveTo(1, 100000);
+  mockMicros = 105000;                   //5ms - bucket 13 is 4096-8191us
+  CHECK(knob.getEvent(ev[0]));
+  CHECK_EQUAL(1, consume[13]);
+  moveTo(2, 200000);
+  mockMicros = 270000;                   //70ms, which wraps to 4464us in 16 bits
+  CHECK(knob.getEvent(ev[0]));
+  CHECK_EQUAL(1, consume[13]);
+  CHECK_EQUAL(1, consume[15]);
+  moveTo(3, 400000);
+  moveTo(2, 600000);                     //Not merged - a step back does merge, but 200ms is past coalesceInterval
+  mockMicros = 665600;                   //Ages 265.6ms and 65.6ms, 3072 and 64us wrapped
+  CHECK_EQUAL(2, knob.drain(ev, 4));
+  CHECK_EQUAL(3, consume[15]);
+  CHECK_EQUAL(0, consume[7]);
+  CHECK_EQUAL(0, consume[12]);
+}
+
+//Decoded inline - every 8 bit code against the bit by bit definition
+void testGrayToBinary() {
+  uint8_t binary, bit;
+
+  for (unsigned gray = 0; gray < 256; gray++) {
+    binary = 0;
+    for (bit = 8; bit-- > 0; )  //Each binary bit is the XOR of the Gray bits above and at it
+      binary |= (((gray >> bit) ^ (binary >> (bit + 1))) & 1) << bit;
+    CHECK_EQUAL(binary, grayToBinary(gray));
+  }
+}
+
+int main() {
+  RUN(testGrayToBinary);
+  RUN(testTurn);
+  RUN(testBounce);
+  RUN(testLatencyStats);
+  printf("AbsoluteEncoderTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
@@ -0,0 +1,164 @@
+/*
+  Adaptive debounce against the fixed window, replayed on the stub core
+
+  Each trace is a run of clicks through the full quadrature cycle, every edge followed
+  by a burst of contact bounce (the pin flicking back every 100us). With 4 states per
+  click a bounce back up off A falling would read as a click back, so the driver
+  debounces A falling as well (see RotaryGeometry) and the bursts there count. The same
+  trace is played into an encoder with the fixed 5ms window and one with adaptive
+  debounce on, scan() every 1ms, and the clicks counted are compared with the clicks
+  made (after a few slow clicks for the adaptive window to settle on). Then the click
+  period is stepped down to find the fastest spin each one still counts exactly, down
+  to 1.5ms where the bursts start to run into the next edge. The table is printed, and
+  the checks are:
+
+  - a fast spin (clicks 7ms apart) is counted in full - forward clicks must not be
+    learned as late bounces and widen the window until it eats clicks
+  - the same with 1 state per click, where every edge is a click (one every 4ms)
+  - an occasional long burst is no more trouble for the adaptive window than the fixed one
+  - adaptive counts exactly at least as fast a spin as the fixed window
+*/
+#include <stdlib.h>
+#include <vector>
+#include "Arduino.h"
+#include "RotaryEncoder.hpp"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+struct OneState : RotaryEncoderConfig {
+  static const uint8_t statesPerDetent = 1;
+};
+
+struct Edge {
+  unsigned long when;
+  uint8_t pin, level;
+};
+
+struct Trace {
+  const char *name;
+  int clicks;            //Detents turned
+  unsigned long period;  //us per full quadrature cycle
+  unsigned long burst;   //Bounce after each pin change, us
+  unsigned long longBurst; //Every tenth click, 0 for none
+};
+
+//Turned slowly first, so the adaptive window has settled before the trace proper
+static const int warmup = 4;
+
+//A pin change at when, then bounces every 100us for burst us, ending at level
+static void bouncyEdge(std::vector<Edge> &edges, unsigned long when, uint8_t pin, uint8_t level, unsigned long burst) {
+  unsigned long t;
+
+  edges.push_back({ when, pin, level });
+  for (t = 100; t + 100 <= burst; t += 200) {
+    edges.push_back({ when + t, pin, (uint8_t)!level });
+    edges.push_back({ when + t + 100, pin, level });
+  }
+}
+
+//Clockwise cycles 00 -> 10 -> 11 -> 01 -> 00 (A is pin 2, B pin 3)
+static std::vector<Edge> recording(const Trace &trace) {
+  std::vector<Edge> edges;
+  unsigned long t = 100000, quarter, burst;
+
+  for (int i = -warmup; i < trace.clicks; i++) {
+    quarter = (i < 0 ? 50000 : trace.period) / 4;
+    burst = (trace.longBurst && i % 10 == 9) ? trace.longBurst : trace.burst;
+    bouncyEdge(edges, t, 2, HIGH, burst);
+    bouncyEdge(edges, t + quarter, 3, HIGH, burst);
+    bouncyEdge(edges, t + 2 * quarter, 2, LOW, burst);
+    bouncyEdge(edges, t + 3 * quarter, 3, LOW, burst);
+    t += 4 * quarter;
+  }
+  return(edges);
+}
+
+//Clicks counted from the trace, scan() every 1ms
+template <class Config>
+static long play(const std::vector<Edge> &edges, bool adaptive) {
+  RotaryEncoder<2, 3, 4, Config> enc;
+  size_t next = 0;
+  unsigned long end = edges.back().when + 100000;
+
+  mockReset();
+  mockPins[2] = mockPins[3] = LOW;
+  mockMicros = 1000;
+  enc.begin(false);
+  enc.setAdaptiveDebounce(adaptive);
+  for (unsigned long now = 2000; now < end; now += 1000) {
+    while (next < edges.size() && edges[next].when <= now) {
+      mockEdge(edges[next].pin, edges[next].level, edges[next].when);
+      next++;
+    }
+    mockMicros = now;
+    enc.scan();
+  }
+  return(enc.getPosition() - warmup * (4 / Config::statesPerDetent));
+}
+
+//Shortest click period (in steps of 250us) counted exactly with 300us bursts
+template <class Config>
+static unsigned long fastestExact(bool adaptive) {
+  unsigned long period, best = 0;
+
+  for (period = 40000; period >= 1500; period -= 250) {
+    Trace trace = { "", 40, period, 300, 0 };
+    if (play<Config>(recording(trace), adaptive) != 40L * (4 / Config::statesPerDetent)) break;
+    best = period;
+  }
+  return(best);
+}
+
+template <class Config>
+static void compare(const Trace &trace, long &fixed, long &adaptive) {
+  std::vector<Edge> edges = recording(trace);
+
+  fixed = play<Config>(edges, false);
+  adaptive = play<Config>(edges, true);
+  printf("  %-36s %4ld %5ld %8ld\n", trace.name, trace.clicks * (4L / Config::statesPerDetent), fixed, adaptive);
+}
+
+// -- Tests
+void testAccuracy() {
+  Trace slow = { "50ms clicks, 300us bursts", 40, 50000, 300, 0 };
+  Trace longBursts = { "50ms clicks, 1.5ms burst every 10th", 40, 50000, 300, 1500 };
+  Trace fast = { "fast spin, 7ms clicks", 40, 7000, 300, 0 };
+  Trace oneState = { "1 state per click, 4ms edges", 20, 16000, 300, 0 };
+  long fixed, adaptive;
+
+  printf("AdaptiveDebounceTest - clicks counted\n  %-36s %4s %5s %8s\n", "trace", "made", "fixed", "adaptive");
+  compare<RotaryEncoderConfig>(slow, fixed, adaptive);
+  CHECK_EQUAL(40, fixed);
+  CHECK_EQUAL(40, adaptive);
+  compare<RotaryEncoderConfig>(longBursts, fixed, adaptive);
+  CHECK_EQUAL(40, fixed);
+  CHECK_EQUAL(40, adaptive);
+  compare<RotaryEncoderConfig>(fast, fixed, adaptive);
+  CHECK_EQUAL(40, fixed);
+  CHECK_EQUAL(40, adaptive);
+  compare<OneState>(oneState, fixed, adaptive);
+  CHECK_EQUAL(80, adaptive);
+  CHECK(adaptive >= fixed);
+}
+
+void testFastestSpin() {
+  unsigned long fixed, adaptive;
+
+  printf("AdaptiveDebounceTest - fastest click period counted exactly, 300us bursts\n");
+  fixed = fastestExact<RotaryEncoderConfig>(false);
+  adaptive = fastestExact<RotaryEncoderConfig>(true);
+  printf("  4 states per click: fixed %luus, adaptive %luus\n", fixed, adaptive);
+  CHECK(fixed != 0 && adaptive != 0 && adaptive <= fixed);
+  fixed = fastestExact<OneState>(false);
+  adaptive = fastestExact<OneState>(true);
+  printf("  1 state per click:  fixed %luus, adaptive %luus\n", fixed, adaptive);
+  CHECK(fixed != 0 && adaptive != 0 && adaptive <= fixed);
+}
+
+int main() {
+  RUN(testAccuracy);
+  RUN(testFastestSpin);
+  printf("AdaptiveDebounceTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
@@ -0,0 +1,64 @@
+#ifndef Arduino_h
+#define Arduino_h
+/*
+  Stub of the Arduino core for the host tests
+  
+  Just enough of the core for RotaryEncoder.hpp to compile with g++. The clock,
+  the pins and the interrupt vectors are plain variables (see mock.cpp) so a test
+  can set the time, change a pin and then call the handler attachInterrupt() was
+  given, as the hardware would (see mockEdge()). They are per thread, as are the
+  Serial buffer and the StateMachine stub, so encoders can be replayed on several
+  threads at once (KnobTuner.hpp). noInterrupts() is recorded in mockInterruptsOff,
+  and interrupts() calls mockInterruptsOn if set, for a test to deliver an interrupt
+  held while they were off. Serial output goes to a buffer.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define HIGH 1
+#define LOW 0
+
+typedef void (*voidFuncPtr)();
+
+extern thread_local unsigned long mockMicros;    //What micros() returns
+extern thread_local uint8_t mockPins[64];        //Pin levels, read by digitalRead()
+extern thread_local voidFuncPtr mockIsr[64];     //Attached interrupt handlers, by pin
+extern thread_local uint8_t mockIsrMode[64];
+extern thread_local char mockSerial[1024];       //Everything printed since the last mockReset()
+extern thread_local bool mockInterruptsOff;      //Between noInterrupts() and interrupts()
+extern thread_local voidFuncPtr mockInterruptsOn; //Called by interrupts(), e.g. to run an interrupt held while they were off
+
+inline unsigned long micros() { return(mockMicros); }
+inline unsigned long millis() { return(mockMicros / 1000); }
+inline int digitalRead(uint8_t pin) { return(mockPins[pin]); }
+inline void pinMode(uint8_t, uint8_t) {}
+inline uint8_t digitalPinToInterrupt(uint8_t pin) { return(pin); }
+inline void attachInterrupt(uint8_t n, voidFuncPtr isr, int mode) { mockIsr[n] = isr; mockIsrMode[n] = mode; }
+inline void detachInterrupt(uint8_t n) { mockIsr[n] = NULL; }
+inline void noInterrupts() { mockInterruptsOff = true; }
+inline void interrupts() { mockInterruptsOff = false; if (mockInterruptsOn != NULL) mockInterruptsOn(); }
+
+struct Print {
+  size_t print(const char *s) { return(append(s)); }
+  size_t println(const char *s) { return(append(s) + append("\n")); }
+  size_t write(const uint8_t *buf, size_t n) { (void)buf; return(n); }
+  size_t append(const char *s) {
+    strncat(mockSerial, s, sizeof(mockSerial) - strlen(mockSerial) - 1);
+    return(strlen(s));
+  }
+};
+extern thread_local Print Serial;
+
+//Set a pin at time "when" and run its interrupt handler if the edge matches the attached mode
+void mockEdge(uint8_t pin, uint8_t level, unsigned long when);
+//Time zero, all pins high (pulled up), nothing attached, no output
+void mockReset();
+
+#endif
@@ -0,0 +1,410 @@
+/*
+  Host microbenchmark of the encoder's interrupt handlers and scan()
+
+  Each path through the handlers, and scan() idle and active, is run in a loop that
+  takes it on every call - a click, a bounce inside the debounce, A falling part way
+  through a click (which starts its own debounce), an edge with no step, the button
+  edge that starts a debounce and a button bounce. The calls are timed in batches
+  between two reads of steady_clock, less the same batch with the handlers detached
+  (or scan() not called), which takes off the clock, the loop and the stub core's pin
+  writes. The quickest of many batches is the cost, as a preempted batch is only ever
+  slower.
+
+  Four recorded workloads are then replayed through the stub core, the edges through
+  mockEdge() (so into encoderIntHandler() and buttonIntHandler() as attachInterrupt()
+  left them) and scan() every 1ms, as a main loop would call it:
+
+    slow_turn     - clean clicks 200ms apart
+    fast_spin     - clicks 6ms apart, every edge bouncing once
+    heavy_bounce  - clicks 40ms apart, every edge bouncing for 2ms
+    button_mash   - presses 60ms apart, each edge bouncing for 1ms
+
+  Each whole replay is timed, the quickest of 40 for the edges a second through the
+  decoder with its scan() calls, and each interrupt is put down to the path it took
+  for the counts. Then injectClick() is run flat out for the injection throughput.
+
+  Every figure is checked against BenchmarkBaseline.h, and one over tolerance times
+  its baseline fails the run. The baseline is this host CPU's, not an AVR's - the
+  numbers are for comparing changes to the driver on the machine the baseline was
+  taken on (see test/avr for cycle counts on the real part), so take it again on a
+  new machine, or after a change that is meant to cost more. The results are printed
+  as JSON:
+
+    make -C test bench
+    make -C test baseline   # Benchmark -o BenchmarkBaseline.h
+*/
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "Arduino.h"
+#include "RotaryEncoder.hpp"
+
+struct BaselineEntry {
+  const char *name;
+  double ns;
+};
+#include "BenchmarkBaseline.h"
+
+typedef RotaryEncoder<2, 3, 4> Encoder;
+typedef std::chrono::steady_clock Clock;
+
+//Over tolerance times the baseline, and slack ns, fails. The replays of one build move by up to
+//1.8 times from run to run here (the paths much less), and paths of a few ns by a nanosecond or two
+static const double tolerance = 2;
+static const double slack = 2;
+static const int batchCalls = 16;     //Calls a batch - the 8 presses of 16 button edges fit the event queue
+static const int batches = 20000;
+
+struct Edge {
+  unsigned long when;
+  uint8_t pin, level;
+};
+
+enum Path { CLICK, BOUNCE, FALL, NO_STEP, BUTTON_EDGE, BUTTON_BOUNCE, SCAN_IDLE, SCAN_ACTIVE, PATHS };
+static const char *pathNames[PATHS] = { "click", "bounce", "fall", "no_step", "button_edge", "button_bounce",
+                                        "scan_idle", "scan_active" };
+
+struct Result {
+  const char *name;
+  unsigned long edges;         //Pin changes in the recording, times the repeats
+  int repeats;
+  unsigned long isr[SCAN_IDLE], scans;
+  double ns;                   //The quickest replay, edges and scan() calls
+  long position, presses;      //What the encoder made of it, for a sanity check
+};
+
+struct Measure {               //A figure against its baseline
+  const char *name;
+  double ns, baseline;
+};
+
+static std::vector<Measure> measures;
+
+static double elapsed(Clock::time_point start, Clock::time_point end) {
+  return(std::chrono::duration<double, std::nano>(end - start).count());
+}
+
+// -- Paths
+//The path an interrupt on pin took, from the position and the channel's debounce before it -
+//still running at when, the handler ends one that is over itself
+static bool debounceOf(Encoder &enc, uint8_t pin, unsigned long when) {
+  uint8_t channel = pin == 4 ? Encoder::BUTTON_CHANNEL : Encoder::ROTARY_CHANNEL;
+
+  return((enc.flags & (Encoder::ROTARY_DEBOUNCE << channel)) && !enc.debounceExpired(channel, when, when >> 10));
+}
+
+static Path took(Encoder &enc, uint8_t pin, long position, bool debounce) {
+  if (pin == 4) return(debounce ? BUTTON_BOUNCE : BUTTON_EDGE);
+  if (enc.position != position) return(CLICK);
+  if (debounce) return(BOUNCE);
+  return((enc.flags & Encoder::ROTARY_DEBOUNCE) ? FALL : NO_STEP);
+}
+
+//An encoder at rest, for the button's bounces pressed at 1ms and for the rotary paths with
+//a click counted at 100ms - A up, in its debounce
+static void setup(Encoder &enc, Path path) {
+  mockReset();
+  mockPins[2] = mockPins[3] = LOW;
+  eventQueue.count = 0;
+  enc.begin(false);
+  if (path == BUTTON_BOUNCE) mockEdge(4, LOW, 1000);
+  if (path == SCAN_IDLE || path == BUTTON_EDGE || path == BUTTON_BOUNCE) return;
+  mockEdge(2, HIGH, 100000);
+  if (path == FALL) mockEdge(3, HIGH, 101000);  //B on, part way through the click
+  if (path == SCAN_ACTIVE) {
+    mockMicros = 110000;
+    enc.scan();  //Ends the debounce
+  }
+}
+
+//When the i'th call of the path is made - 6ms on, past the debounce (the handler ends it),
+//or for a bounce inside it
+static unsigned long callTime(Path path, int i) {
+  if (path == BOUNCE) return(100100);
+  if (path == BUTTON_BOUNCE) return(1000);
+  if (path >= SCAN_IDLE) return(110000 + (i + 1) * 1024);
+  return(200000 + i * 6000);
+}
+
+//The i'th call of the path. The pins are set up so the handler takes the path every time,
+//and a fresh encoder each batch keeps the event queue from filling
+static void call(Encoder &enc, Path path, int i) {
+  unsigned long t = callTime(path, i);
+
+  switch (path) {
+    case CLICK:
+      mockPins[2] = LOW;  //The rest of the last cycle, A down and B down without interrupts
+      enc.lastState = 0;
+      mockEdge(2, HIGH, t);
+      break;
+    case BOUNCE:
+      mockEdge(2, i & 1, t);  //Back and forth inside the click's debounce
+      break;
+    case FALL:
+      mockPins[2] = HIGH;
+      enc.lastState = 2;  //A rose, and B has moved since
+      mockEdge(2, LOW, t);
+      break;
+    case NO_STEP:
+      mockPins[2] = LOW;  //A up again where it rose - nothing to count, and no debounce
+      mockEdge(2, HIGH, t);
+      break;
+    case BUTTON_EDGE:
+      mockEdge(4, i & 1, t);  //Down and up
+      break;
+    case BUTTON_BOUNCE:
+      mockEdge(4, !(i & 1), t);  //Up and down again inside the press's debounce
+      break;
+    case SCAN_IDLE:
+    case SCAN_ACTIVE:
+      mockMicros = t;
+      break;
+    default:
+      break;
+  }
+}
+
+//Does every call of a batch take the path?
+static bool takes(Path path) {
+  Encoder enc;
+  uint8_t pin = path >= BUTTON_EDGE ? 4 : 2;
+  bool debounce;
+  long position;
+
+  setup(enc, path);
+  for (int i = 0; i < batchCalls && path < SCAN_IDLE; i++) {
+    position = enc.position;
+    debounce = debounceOf(enc, pin, callTime(path, i));
+    call(enc, path, i);
+    if (took(enc, pin, position, debounce) != path) return(false);
+  }
+  return(true);
+}
+
+//ns a call of the path, from the quickest batch. run false is the harness alone
+static double batch(Path path, bool run) {
+  Clock::time_point start, end;
+  double best = 1e18;
+  int i;
+
+  for (int b = 0; b < batches; b++) {
+    Encoder enc;  //Fresh - the storm detector would trip on the batches at the same time
+
+    setup(enc, path);
+    if (!run) mockIsr[2] = mockIsr[3] = mockIsr[4] = NULL;
+    start = Clock::now();
+    if (path >= SCAN_IDLE) {
+      for (i = 0; i < batchCalls; i++) {
+        call(enc, path, i);
+        if (run) enc.scan();
+      }
+    } else {
+      for (i = 0; i < batchCalls; i++) call(enc, path, i);
+    }
+    end = Clock::now();
+    if (elapsed(start, end) < best) best = elapsed(start, end);
+  }
+  return(best / batchCalls);
+}
+
+// -- Workloads
+//A pin change at when, then bounces more edges back and forth 100us apart, ending at level
+static void bouncyEdge(std::vector<Edge> &edges, unsigned long when, uint8_t pin, uint8_t level, int bounces) {
+  edges.push_back({ when, pin, level });
+  for (int i = 0; i < bounces; i++) {
+    edges.push_back({ when + 200 * i + 100, pin, (uint8_t)!level });
+    edges.push_back({ when + 200 * i + 200, pin, level });
+  }
+}
+
+//Clockwise clicks, period us apart, every edge bouncing
+static std::vector<Edge> turning(int clicks, unsigned long period, int bounces) {
+  std::vector<Edge> edges;
+  unsigned long t = 100000, quarter = period / 4;
+
+  for (int i = 0; i < clicks; i++, t += period) {
+    bouncyEdge(edges, t, 2, HIGH, bounces);
+    bouncyEdge(edges, t + quarter, 3, HIGH, bounces);
+    bouncyEdge(edges, t + 2 * quarter, 2, LOW, bounces);
+    bouncyEdge(edges, t + 3 * quarter, 3, LOW, bounces);
+  }
+  return(edges);
+}
+
+static std::vector<Edge> mashing(int presses, unsigned long period, int bounces) {
+  std::vector<Edge> edges;
+  unsigned long t = 100000;
+
+  for (int i = 0; i < presses; i++, t += period) {
+    bouncyEdge(edges, t, 4, LOW, bounces);
+    bouncyEdge(edges, t + period / 2, 4, HIGH, bounces);
+  }
+  return(edges);
+}
+
+// -- Replay
+//Would mockEdge() run a handler for this edge?
+static bool fires(const Edge &edge) {
+  uint8_t mode = mockIsrMode[edge.pin];
+
+  if (mockIsr[edge.pin] == NULL || mockPins[edge.pin] == edge.level) return(false);
+  return(mode == CHANGE || (mode == RISING && edge.level) || (mode == FALLING && !edge.level));
+}
+
+//The edges and a scan() every 1ms. Timed as a whole, or with each interrupt put down to its path
+static void play(Result &result, const std::vector<Edge> &edges, bool count) {
+  Encoder enc;
+  Clock::time_point start;
+  RotaryEvent ev;
+  size_t next = 0;
+  unsigned long until = edges.back().when + 100000;
+  long position;
+  bool debounce;
+  double ns;
+
+  mockReset();
+  mockPins[2] = mockPins[3] = LOW;
+  eventQueue.count = 0;
+  enc.begin(false);
+  start = Clock::now();
+  for (unsigned long now = 1000; now < until; now += 1000) {
+    for (; next < edges.size() && edges[next].when <= now; next++) {
+      if (!count || !fires(edges[next])) {
+        mockEdge(edges[next].pin, edges[next].level, edges[next].when);
+        continue;
+      }
+      position = enc.position;
+      debounce = debounceOf(enc, edges[next].pin, edges[next].when);
+      mockEdge(edges[next].pin, edges[next].level, edges[next].when);
+      result.isr[took(enc, edges[next].pin, position, debounce)]++;
+    }
+    mockMicros = now;
+    enc.scan();
+    if (count) result.scans++;
+    while (enc.getEvent(ev));  //The application takes them as they come
+  }
+  if (count) return;
+  ns = elapsed(start, Clock::now());
+  if (result.ns == 0 || ns < result.ns) result.ns = ns;
+  result.position += enc.getPosition();
+  result.presses += eventQueue.count;
+}
+
+static Result run(const char *name, const std::vector<Edge> &edges, int repeats) {
+  Result result = {};
+
+  result.name = name;
+  result.edges = edges.size() * repeats;
+  result.repeats = repeats;
+  play(result, edges, true);
+  for (int i = 0; i < repeats; i++) play(result, edges, false);
+  return(result);
+}
+
+// -- Output
+static double baseline(const char *name) {
+  for (const BaselineEntry &entry : benchmarkBaseline)
+    if (!strcmp(entry.name, name)) return(entry.ns);
+  return(0);
+}
+
+//The figure, noted for the baseline check, as JSON fields
+static double measure(const char *name, double ns) {
+  measures.push_back({ name, ns, baseline(name) });
+  return(ns);
+}
+
+static void print(const Result &result, bool last) {
+  double ns = measure(result.name, result.ns * result.repeats / result.edges);
+
+  printf("    {\n      \"name\": \"%s\",\n      \"edges\": %lu,\n", result.name, result.edges);
+  printf("      \"clicks\": %ld,\n      \"presses\": %ld,\n", result.position, result.presses);
+  printf("      \"edges_per_s\": %.0f,\n      \"ns_per_edge\": %.1f,\n", 1e9 / ns, ns);
+  printf("      \"scan_calls\": %lu,\n      \"isr_calls\": {", result.scans);
+  for (int path = 0; path < SCAN_IDLE; path++)
+    printf(" \"%s\": %lu%s", pathNames[path], result.isr[path], path < SCAN_IDLE - 1 ? "," : " }\n");
+  printf("    }%s\n", last ? "" : ",");
+}
+
+//injectClick() flat out, taking the events as they come
+static void injection() {
+  Encoder enc;
+  RotaryEvent ev[8];
+  Clock::time_point start, end;
+  const long clicks = 20000000;
+  double ns;
+  long i;
+
+  mockReset();
+  mockPins[2] = mockPins[3] = LOW;
+  enc.begin();
+  start = Clock::now();
+  for (i = 0; i < clicks; i++) {
+    enc.injectClick(i & 64 ? -1 : 1, 100000 + i * 1000);
+    if ((i & 15) == 15) enc.drain(ev, 8);
+  }
+  end = Clock::now();
+  ns = measure("injection", elapsed(start, end) / clicks);
+  printf("  \"injection\": { \"clicks\": %ld, \"clicks_per_s\": %.0f, \"position\": %ld },\n",
+         clicks, 1e9 / ns, enc.getPosition());
+}
+
+static bool writeBaseline(const char *path) {
+  FILE *file = fopen(path, "w");
+
+  if (file == NULL) return(false);
+  fprintf(file, "// BenchmarkBaseline.h - written by test/Benchmark -o, don't edit\n");
+  fprintf(file, "// ns a call (a path), an edge (a workload) or a click (injection) on the machine it was taken on\n");
+  fprintf(file, "#ifndef BenchmarkBaseline_h\n#define BenchmarkBaseline_h\n\n");
+  fprintf(file, "static const BaselineEntry benchmarkBaseline[] = {\n");
+  for (size_t i = 0; i < measures.size(); i++)
+    fprintf(file, "  { \"%s\", %.1f }%s\n", measures[i].name, measures[i].ns, i + 1 < measures.size() ? "," : "");
+  fprintf(file, "};\n\n#endif\n");
+  return(fclose(file) == 0);
+}
+
+int main(int argc, char **argv) {
+  const char *header = NULL;
+  Result results[4];
+  int i, over = 0;
+
+  if (argc == 3 && !strcmp(argv[1], "-o")) header = argv[2];
+  else if (argc != 1) {
+    fprintf(stderr, "usage: Benchmark [-o baseline.h]\n");
+    return(2);
+  }
+
+  for (i = 0; i < PATHS; i++) {
+    if (takes((Path)i)) continue;
+    fprintf(stderr, "Benchmark - the %s loop doesn't take its path\n", pathNames[i]);
+    return(1);
+  }
+  printf("{\n  \"paths\": {\n");
+  for (i = 0; i < PATHS; i++)
+    printf("    \"%s\": %.1f%s\n", pathNames[i], measure(pathNames[i], batch((Path)i, true) - batch((Path)i, false)),
+           i < PATHS - 1 ? "," : "");
+  printf("  },\n  \"workloads\": [\n");
+  results[0] = run("slow_turn", turning(50, 200000, 0), 40);
+  results[1] = run("fast_spin", turning(1000, 6000, 1), 40);
+  results[2] = run("heavy_bounce", turning(200, 40000, 10), 40);
+  results[3] = run("button_mash", mashing(200, 60000, 5), 40);
+  for (i = 0; i < 4; i++) print(results[i], i == 3);
+  printf("  ],\n");
+  injection();
+
+  if (header != NULL) {
+    printf("  \"baseline\": \"%s\"\n}\n", header);
+    if (writeBaseline(header)) return(0);
+    fprintf(stderr, "Benchmark - can't write %s\n", header);
+    return(1);
+  }
+  printf("  \"tolerance\": %.2f,\n  \"slack_ns\": %.1f,\n  \"over_baseline\": [", tolerance, slack);
+  for (const Measure &m : measures) {
+    if (m.baseline == 0 || m.ns <= m.baseline * tolerance + slack) continue;
+    printf("%s\n    { \"name\": \"%s\", \"ns\": %.1f, \"baseline\": %.1f }", over ? "," : "", m.name, m.ns, m.baseline);
+    over++;
+  }
+  printf("%s]\n}\n", over ? "\n  " : " ");
+  if (over) fprintf(stderr, "Benchmark - %d over %.2f times the baseline\n", over, tolerance);
+  return(over ? 1 : 0);
+}
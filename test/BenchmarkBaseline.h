@@ -0,0 +1,22 @@
+// BenchmarkBaseline.h - written by test/Benchmark -o, don't edit
+// ns a call (a path), an edge (a workload) or a click (injection) on the machine it was taken on
+#ifndef BenchmarkBaseline_h
+#define BenchmarkBaseline_h
+
+static const BaselineEntry benchmarkBaseline[] = {
+  { "click", 9.9 },
+  { "bounce", 7.1 },
+  { "fall", 5.3 },
+  { "no_step", 4.6 },
+  { "button_edge", 7.4 },
+  { "button_bounce", 4.6 },
+  { "scan_idle", 13.1 },
+  { "scan_active", 17.5 },
+  { "slow_turn", 1560.7 },
+  { "fast_spin", 27.0 },
+  { "heavy_bounce", 28.5 },
+  { "button_mash", 103.4 },
+  { "injection", 14.5 }
+};
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef CaptureDecode_hpp
+#define CaptureDecode_hpp
+/*
+  Host decoder for logic analyser captures of many encoders at once
+
+  A capture is an array of 64 bit sample words, one per sample clock, with encoder c
+  on bits 2c + 1 (pin A) and 2c (pin B) - the 2 bit sample of RotaryDecode.hpp, 32
+  encoders side by side. Each word is decoded for all 32 encoders at once with
+  rotaryTransitions() (bit sliced, the same rule as rotaryTransition()), and the steps
+  are added up in bit sliced counters: bit plane k of a counter holds bit k of every
+  encoder's count, so adding a step to all 32 is a handful of ANDs and XORs. Every 255
+  samples the counters are emptied into the per encoder counts.
+
+  Several sample words go through at once in a GCC vector (captureLanes words - 4 with
+  AVX2, 2 with plain x86-64 SSE2), so the loop is all SIMD bitwise operations with no
+  intrinsics. captureDecodeScalar() decodes one encoder at a time with
+  rotaryTransition() and is the reference the fast path is checked against (see
+  CaptureDecodeTest.cpp), as well as the fallback for the odd samples at the end.
+
+  Long captures are split into chunks decoded on separate threads by
+  captureDecodeParallel(). A chunk's counts only depend on the sample before it
+  through its first transition, so each chunk is decoded once from its own first
+  sample and the boundary transitions are added afterwards - the same idea as
+  RotarySpan and rotaryJoin() in RotaryDecode.hpp, which rotaryDecodeParallel() uses
+  for a capture of a single encoder, one 2 bit sample per byte.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "RotaryDecode.hpp"
+
+typedef uint64_t CaptureWord;
+static const unsigned captureEncoders = 32;
+static const CaptureWord captureBitsB = 0x5555555555555555ULL;  //Pin B of every encoder
+
+#ifdef __AVX2__
+static const unsigned captureLanes = 4;
+#else
+static const unsigned captureLanes = 2;
+#endif
+typedef CaptureWord CaptureVector __attribute__((vector_size(captureLanes * sizeof(CaptureWord))));
+
+// -- Reference decoder, one encoder at a time
+//Adds the steps of each encoder over samples[0..n) to counts, prev is the sample before them
+inline void captureDecodeScalar(const CaptureWord *samples, size_t n, CaptureWord prev, int64_t *counts) {
+  size_t i;
+  unsigned c;
+
+  for (i = 0; i < n; i++) {
+    for (c = 0; c < captureEncoders; c++)
+      counts[c] += rotaryTransition((prev >> (2 * c)) & 3, (samples[i] >> (2 * c)) & 3);
+    prev = samples[i];
+  }
+}
+
+// -- Bit sliced counter of up to 255 steps for every encoder in every lane
+template <typename Word>
+struct CaptureCounter {
+  Word plane[8];
+
+  void clear() {
+    memset(plane, 0, sizeof(plane));
+  }
+
+  //Add 1 to the count of each encoder with its bit set in steps
+  void add(Word steps) {
+    Word carry = steps, next;
+
+    for (unsigned k = 0; k < 8; k++) {
+      next = plane[k] & carry;
+      plane[k] ^= carry;
+      carry = next;
+    }
+  }
+
+  //Add the counts (times sign) to counts[] and clear them. Only the pin B bits are used
+  void flush(int64_t *counts, int sign) {
+    const CaptureWord *words = (const CaptureWord *)plane;
+    CaptureWord bits;
+    unsigned k, lane;
+
+    for (k = 0; k < 8; k++)
+      for (lane = 0; lane < sizeof(Word) / sizeof(CaptureWord); lane++)
+        for (bits = words[k * (sizeof(Word) / sizeof(CaptureWord)) + lane]; bits; bits &= bits - 1)
+          counts[__builtin_ctzll(bits) / 2] += sign * (1 << k);
+    clear();
+  }
+};
+
+//Steps from the words before to the words in cur, added to the counters
+template <typename Word>
+inline void captureStep(Word prev, Word cur, CaptureCounter<Word> &cw, CaptureCounter<Word> &ccw) {
+  Word stepCw, stepCcw;
+
+  rotaryTransitions<Word>((prev >> 1) & captureBitsB, prev & captureBitsB,
+                          (cur >> 1) & captureBitsB, cur & captureBitsB, stepCw, stepCcw);
+  cw.add(stepCw);
+  ccw.add(stepCcw);
+}
+
+// -- Fast decoder, all encoders per word and captureLanes words at a time
+//Same result as captureDecodeScalar()
+inline void captureDecode(const CaptureWord *samples, size_t n, CaptureWord prev, int64_t *counts) {
+  CaptureCounter<CaptureVector> cw, ccw;
+  CaptureCounter<CaptureWord> tailCw, tailCcw;
+  CaptureVector before, after;
+  size_t i = 0, batch;
+
+  if (n == 0) return;
+  tailCw.clear();
+  tailCcw.clear();
+  captureStep<CaptureWord>(prev, samples[0], tailCw, tailCcw);
+  cw.clear();
+  ccw.clear();
+  //Lanes of sample words i + 1... against the words before them, i...
+  while (i + captureLanes < n) {
+    for (batch = 0; batch < 255 && i + captureLanes < n; batch++, i += captureLanes) {
+      memcpy(&before, samples + i, sizeof(before));
+      memcpy(&after, samples + i + 1, sizeof(after));
+      captureStep<CaptureVector>(before, after, cw, ccw);
+    }
+    cw.flush(counts, 1);
+    ccw.flush(counts, -1);
+  }
+  for (i++; i < n; i++) captureStep<CaptureWord>(samples[i - 1], samples[i], tailCw, tailCcw);
+  tailCw.flush(counts, 1);
+  tailCcw.flush(counts, -1);
+}
+
+// -- Chunked decoding on several threads
+//Same result as captureDecode(), with the capture split into threads chunks
+inline void captureDecodeParallel(const CaptureWord *samples, size_t n, CaptureWord prev, int64_t *counts,
+                                  unsigned threads) {
+  std::vector<std::thread> workers;
+  std::vector<int64_t> chunkCounts(threads * captureEncoders, 0);
+  size_t chunk = (n + threads - 1) / threads, begin;
+  unsigned t, c;
+
+  if (threads < 2 || n < 2 * threads) {
+    captureDecode(samples, n, prev, counts);
+    return;
+  }
+  for (t = 0; t < threads; t++) {
+    begin = t * chunk;
+    if (begin >= n) break;
+    //From the chunk's own first sample, so its first transition is none
+    workers.push_back(std::thread(captureDecode, samples + begin, (begin + chunk < n ? chunk : n - begin),
+                                  samples[begin], &chunkCounts[t * captureEncoders]));
+  }
+  for (t = 0; t < workers.size(); t++) {
+    workers[t].join();
+    for (c = 0; c < captureEncoders; c++) counts[c] += chunkCounts[t * captureEncoders + c];
+    begin = t * chunk;  //The transition into the chunk
+    captureDecodeScalar(samples + begin, 1, begin ? samples[begin - 1] : prev, counts);
+  }
+}
+
+//Steps of one encoder over samples[0..n), one 2 bit sample a byte, decoded as threads
+//RotarySpans and joined. Same result as rotaryDecodeSpan() of the whole capture
+inline RotarySpan rotaryDecodeParallel(const uint8_t *samples, size_t n, unsigned threads) {
+  std::vector<std::thread> workers;
+  std::vector<RotarySpan> spans(threads);
+  RotarySpan span = { 0, 0, 0, true };
+  size_t chunk = (n + threads - 1) / threads, begin;
+  unsigned t;
+
+  if (threads < 2) return(rotaryDecodeSpan(samples, n));
+  for (t = 0; t < threads; t++) {
+    begin = t * chunk;
+    if (begin >= n) break;
+    workers.push_back(std::thread([=, &spans]() {
+      spans[t] = rotaryDecodeSpan(samples + begin, begin + chunk < n ? chunk : n - begin);
+    }));
+  }
+  for (t = 0; t < workers.size(); t++) {
+    workers[t].join();
+    span = rotaryJoin(span, spans[t]);
+  }
+  return(span);
+}
+
+#endif
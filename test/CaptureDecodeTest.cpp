@@ -0,0 +1,226 @@
+/*
+  The capture decoders (CaptureDecode.hpp) against the one encoder at a time reference
+
+  Random captures of 32 encoders - each wandering back and forth through its Gray
+  sequence at its own rate, with the odd invalid double step and glitch - are decoded
+  both ways and the counts must be identical, for every length up to a few lanes
+  (the odd samples at the end) and for long captures (the 255 sample flushes). Then
+  an 8MB capture is timed both ways and the rates printed.
+
+  Chunked decoding must match too: RotarySpans of random runs of one encoder, split
+  anywhere and joined in any grouping, against a plain rotaryTransition() loop, and
+  captureDecodeParallel() and rotaryDecodeParallel() with 1 to 8 threads.
+*/
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "CaptureDecode.hpp"
+#include "Arduino.h"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+typedef std::chrono::steady_clock Clock;
+
+//Small fixed random sequence, so every run decodes the same captures
+static uint64_t seed = 11;
+static uint32_t nextRandom(uint32_t range) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return((seed >> 33) % range);
+}
+
+//n samples, encoder c stepping on about 1 sample in 2 << (c % 8)
+static std::vector<CaptureWord> capture(size_t n) {
+  static const uint8_t gray[4] = { 0, 2, 3, 1 };  //Clockwise 00 -> 10 -> 11 -> 01
+  std::vector<CaptureWord> samples(n);
+  uint8_t phase[captureEncoders] = {};
+  CaptureWord word;
+  unsigned c, r;
+
+  for (size_t i = 0; i < n; i++) {
+    word = 0;
+    for (c = 0; c < captureEncoders; c++) {
+      r = nextRandom(2u << (c % 8));
+      if (r == 0) phase[c]++;
+      else if (r == 1) phase[c]--;
+      else if (r == 2 && nextRandom(64) == 0) phase[c] += 2;  //Both pins at once - invalid
+      word |= (CaptureWord)gray[phase[c] & 3] << (2 * c);
+    }
+    if (nextRandom(256) == 0) word ^= 1ULL << nextRandom(64);  //A glitch on one pin
+    samples[i] = word;
+  }
+  return(samples);
+}
+
+static bool sameCounts(const CaptureWord *samples, size_t n, CaptureWord prev) {
+  int64_t fast[captureEncoders] = {}, reference[captureEncoders] = {};
+
+  captureDecode(samples, n, prev, fast);
+  captureDecodeScalar(samples, n, prev, reference);
+  return(memcmp(fast, reference, sizeof(fast)) == 0);
+}
+
+// -- Tests
+//The bit sliced rule gives rotaryTransition() for all 16 pairs of samples
+void testTransitions() {
+  CaptureWord prev = 0, cur = 0, cw, ccw;
+  unsigned c;
+
+  for (c = 0; c < 16; c++) {
+    prev |= (CaptureWord)(c >> 2) << (2 * c);
+    cur |= (CaptureWord)(c & 3) << (2 * c);
+  }
+  rotaryTransitions<CaptureWord>((prev >> 1) & captureBitsB, prev & captureBitsB,
+                                 (cur >> 1) & captureBitsB, cur & captureBitsB, cw, ccw);
+  for (c = 0; c < 16; c++)
+    CHECK_EQUAL(rotaryTransition(c >> 2, c & 3), (int)((cw >> (2 * c)) & 1) - (int)((ccw >> (2 * c)) & 1));
+}
+
+void testShortCaptures() {
+  std::vector<CaptureWord> samples = capture(64);
+  size_t n;
+
+  for (n = 0; n <= samples.size(); n++) {
+    CHECK(sameCounts(samples.data(), n, 0));
+    CHECK(sameCounts(samples.data(), n, samples[0] ^ 0xFFFFFFFFFFFFFFFFULL));
+  }
+}
+
+void testLongCapture() {
+  std::vector<CaptureWord> samples = capture(100003);
+  int64_t counts[captureEncoders] = {};
+  long moved = 0;
+
+  CHECK(sameCounts(samples.data(), samples.size(), samples[0]));
+  CHECK(sameCounts(samples.data() + 1, samples.size() - 1, samples[0]));
+  captureDecode(samples.data(), samples.size(), samples[0], counts);
+  for (unsigned c = 0; c < captureEncoders; c++) moved += llabs(counts[c]);
+  CHECK(moved > 0);
+}
+
+//Every encoder turning clockwise flat out, so the counters fill and flush every time
+void testFullCounters() {
+  static const uint8_t gray[4] = { 0, 2, 3, 1 };
+  std::vector<CaptureWord> samples(5000);
+  int64_t counts[captureEncoders] = {};
+
+  for (size_t i = 0; i < samples.size(); i++)
+    for (unsigned c = 0; c < captureEncoders; c++)
+      samples[i] |= (CaptureWord)gray[(i + 1) & 3] << (2 * c);
+  captureDecode(samples.data(), samples.size(), 0, counts);
+  for (unsigned c = 0; c < captureEncoders; c++) CHECK_EQUAL(5000, counts[c]);
+}
+
+//Sequential count of one encoder's samples, from the sample before them
+static int32_t sequential(const std::vector<uint8_t> &samples, size_t begin, size_t end, uint8_t prev) {
+  int32_t count = 0;
+
+  for (size_t i = begin; i < end; i++) {
+    count += rotaryTransition(prev, samples[i]);
+    prev = samples[i];
+  }
+  return(count);
+}
+
+//A random walk of one encoder, with repeats and invalid double steps
+static std::vector<uint8_t> walk(size_t n) {
+  std::vector<uint8_t> samples(n);
+  uint8_t phase = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    phase += nextRandom(5) == 0 ? 2 : nextRandom(3) - 1;
+    samples[i] = phase & 1 ? (phase & 2 ? 1 : 2) : (phase & 2 ? 3 : 0);
+  }
+  return(samples);
+}
+
+static bool sameSpan(const RotarySpan &a, const RotarySpan &b) {
+  return(a.empty == b.empty && (a.empty || (a.first == b.first && a.last == b.last && a.count == b.count)));
+}
+
+//200 random runs, each split at random into chunks and joined - bit exact with the loop
+void testSpans() {
+  for (int run = 0; run < 200; run++) {
+    std::vector<uint8_t> samples = walk(nextRandom(5000));
+    std::vector<RotarySpan> chunks;
+    RotarySpan joined = { 0, 0, 0, true }, left = { 0, 0, 0, true }, right = { 0, 0, 0, true };
+    size_t begin = 0, length;
+    uint8_t start = nextRandom(4);
+
+    while (begin < samples.size() || chunks.empty()) {
+      length = nextRandom(300);                     //0 is an empty chunk
+      if (begin + length > samples.size()) length = samples.size() - begin;
+      chunks.push_back(rotaryDecodeSpan(samples.data() + begin, length));
+      begin += length;
+    }
+    for (size_t i = 0; i < chunks.size(); i++) joined = rotaryJoin(joined, chunks[i]);
+    CHECK_EQUAL(sequential(samples, 0, samples.size(), start), rotarySpanCount(joined, start));
+    CHECK(sameSpan(joined, rotaryDecodeSpan(samples.data(), samples.size())));
+
+    //Grouped the other way - the first chunk with all the rest joined from the right
+    for (size_t i = chunks.size(); i-- > 1;) right = rotaryJoin(chunks[i], right);
+    left = rotaryJoin(chunks[0], right);
+    CHECK(sameSpan(joined, left));
+  }
+}
+
+void testParallel() {
+  std::vector<CaptureWord> samples = capture(20011);
+  std::vector<uint8_t> single = walk(20011);
+  int64_t reference[captureEncoders], counts[captureEncoders];
+  size_t lengths[] = { 0, 1, 5, 17, 20011 }, n;
+  unsigned threads;
+
+  for (unsigned l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    n = lengths[l];
+    memset(reference, 0, sizeof(reference));
+    captureDecodeScalar(samples.data(), n, 0, reference);
+    for (threads = 1; threads <= 8; threads++) {
+      memset(counts, 0, sizeof(counts));
+      captureDecodeParallel(samples.data(), n, 0, counts, threads);
+      CHECK(memcmp(counts, reference, sizeof(counts)) == 0);
+      CHECK(sameSpan(rotaryDecodeSpan(single.data(), n), rotaryDecodeParallel(single.data(), n, threads)));
+    }
+  }
+}
+
+void testThroughput() {
+  std::vector<CaptureWord> samples = capture(1 << 20);
+  int64_t fast[captureEncoders] = {}, reference[captureEncoders] = {};
+  Clock::time_point start, middle, end;
+  double fastSeconds, referenceSeconds, parallelSeconds;
+  unsigned threads;
+
+  start = Clock::now();
+  captureDecode(samples.data(), samples.size(), samples[0], fast);
+  middle = Clock::now();
+  captureDecodeScalar(samples.data(), samples.size(), samples[0], reference);
+  end = Clock::now();
+  CHECK(memcmp(fast, reference, sizeof(fast)) == 0);
+  memset(reference, 0, sizeof(reference));
+  threads = std::thread::hardware_concurrency();
+  if (threads < 2) threads = 2;
+  end = Clock::now();
+  captureDecodeParallel(samples.data(), samples.size(), samples[0], reference, threads);
+  parallelSeconds = std::chrono::duration<double>(Clock::now() - end).count();
+  CHECK(memcmp(fast, reference, sizeof(fast)) == 0);
+  fastSeconds = std::chrono::duration<double>(middle - start).count();
+  referenceSeconds = std::chrono::duration<double>(end - middle).count();
+  printf("CaptureDecodeTest - %u words a lane, %zu samples of %u encoders: %.0fM samples/s "
+         "(%.1fG encoder samples/s), one at a time %.0fM samples/s\n", captureLanes, samples.size(),
+         captureEncoders, samples.size() / fastSeconds / 1e6, samples.size() * captureEncoders / fastSeconds / 1e9,
+         samples.size() / referenceSeconds / 1e6);
+  printf("CaptureDecodeTest - %u threads: %.0fM samples/s\n", threads, samples.size() / parallelSeconds / 1e6);
+}
+
+int main() {
+  RUN(testTransitions);
+  RUN(testShortCaptures);
+  RUN(testLongCapture);
+  RUN(testFullCounters);
+  RUN(testSpans);
+  RUN(testParallel);
+  RUN(testThroughput);
+  printf("CaptureDecodeTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
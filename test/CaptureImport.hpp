@@ -0,0 +1,216 @@
+#ifndef CaptureImport_hpp
+#define CaptureImport_hpp
+/*
+  Streaming import of logic analyser captures, for replaying them into the host tests
+
+  The file is memory mapped and read once from front to back, handing each change of
+  the signals asked for to a callback as a CaptureEdge (time in microseconds, pin,
+  level), so a gigabyte capture replays in constant memory with the kernel reading
+  ahead. Two formats are read:
+
+    VCD    - value changes of 1 bit wires, as written by sigrok-cli -O vcd, PulseView
+             or a logic simulator. The wires are picked by name (the reference in
+             $var, any scope) and each is given a pin. Initial values ($dumpvars, or
+             the first change) come through as edges at their time, x and z are ignored.
+    binary - sigrok-cli -O binary, the raw samples with unitsize bytes a sample and
+             one bit a channel. The sample rate isn't in the file, so it is passed in.
+
+  sigrok's own session files (.sr) are zip archives, usually deflated, so they aren't
+  read directly - convert them first, e.g. sigrok-cli -i knob.sr -O binary > knob.bin
+
+    uint8_t pins[] = { 2, 3, 4 };
+    const char *names[] = { "A", "B", "SW" };
+    vcdImport("knob.vcd", names, pins, 3, [&](const CaptureEdge &edge) {
+      mockEdge(edge.pin, edge.level, edge.when);
+    });
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct CaptureEdge {
+  unsigned long when;  //Microseconds from the start of the capture
+  uint8_t pin, level;
+};
+
+// -- Read only memory map of a whole file
+class CaptureFile {
+   public:
+     CaptureFile(const char *path) {
+       struct stat info;
+       int fd = open(path, O_RDONLY);
+
+       if (fd < 0) return;
+       if (fstat(fd, &info) == 0 && info.st_size > 0) {
+         data = (const char *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (data == MAP_FAILED) data = NULL;
+         else {
+           size = info.st_size;
+           madvise((void *)data, size, MADV_SEQUENTIAL);  //Read ahead, drop pages behind
+         }
+       }
+       close(fd);
+     }
+
+     ~CaptureFile() {
+       if (data != NULL) munmap((void *)data, size);
+     }
+
+     const char *data = NULL;
+     size_t size = 0;
+};
+
+// -- VCD
+//Whitespace separated token at p, up to end. Returns its length, p is moved to its start
+inline size_t vcdToken(const char *&p, const char *end) {
+  const char *start;
+
+  while (p < end && (unsigned char)*p <= ' ') p++;
+  for (start = p; p < end && (unsigned char)*p > ' '; p++);
+  size_t length = p - start;
+  p = start;
+  return(length);
+}
+
+inline bool vcdIs(const char *p, size_t length, const char *word) {
+  return(length == strlen(word) && memcmp(p, word, length) == 0);
+}
+
+//Microseconds per timescale unit, as a fraction
+struct VcdScale {
+  uint64_t multiply = 1, divide = 1;
+
+  bool parse(const char *p, size_t length) {
+    uint64_t number = 0;
+    size_t i;
+
+    for (i = 0; i < length && p[i] >= '0' && p[i] <= '9'; i++) number = number * 10 + p[i] - '0';
+    if (number == 0) return(false);
+    multiply = number;
+    divide = 1;
+    if (vcdIs(p + i, length - i, "s")) multiply *= 1000000;
+    else if (vcdIs(p + i, length - i, "ms")) multiply *= 1000;
+    else if (vcdIs(p + i, length - i, "us")) {}
+    else if (vcdIs(p + i, length - i, "ns")) divide = 1000;
+    else if (vcdIs(p + i, length - i, "ps")) divide = 1000000;
+    else if (vcdIs(p + i, length - i, "fs")) divide = 1000000000;
+    else return(false);
+    return(true);
+  }
+};
+
+//Calls sink(edge) for every change of the wires named in names[0..count), which go to
+//pins[0..count). Returns false if the file can't be read or a wire isn't in it
+template <class Sink>
+bool vcdImport(const char *path, const char *const *names, const uint8_t *pins, unsigned count, Sink sink) {
+  static const unsigned maxWires = 16;
+  CaptureFile file(path);
+  const char *p = file.data, *end = file.data + file.size, *id[maxWires] = {};
+  size_t idLength[maxWires] = {}, length;
+  uint8_t level[maxWires];
+  VcdScale scale;
+  uint64_t time = 0;
+  unsigned wire, found = 0;
+  char value;
+
+  if (file.data == NULL || count > maxWires) return(false);
+  memset(level, 0xFF, sizeof(level));  //Not known yet
+
+  //Header - $timescale, and the $var of each wire wanted, up to $enddefinitions
+  while ((length = vcdToken(p, end)) > 0) {
+    if (vcdIs(p, length, "$enddefinitions")) break;
+    if (vcdIs(p, length, "$timescale")) {  //"1us" or "1 us", up to $end
+      char joined[16];
+      size_t used = 0;
+      for (p += length; (length = vcdToken(p, end)) > 0 && !vcdIs(p, length, "$end"); p += length) {
+        if (used + length >= sizeof(joined)) return(false);
+        memcpy(joined + used, p, length);
+        used += length;
+      }
+      if (!scale.parse(joined, used)) return(false);
+    } else if (vcdIs(p, length, "$var")) {
+      const char *token[4];
+      size_t tokenLength[4];
+      p += length;
+      for (int t = 0; t < 4; t++) {  //type, width, id, reference
+        tokenLength[t] = vcdToken(p, end);
+        token[t] = p;
+        p += tokenLength[t];
+      }
+      for (wire = 0; wire < count; wire++)
+        if (id[wire] == NULL && vcdIs(token[3], tokenLength[3], names[wire]) && vcdIs(token[1], tokenLength[1], "1")) {
+          id[wire] = token[2];
+          idLength[wire] = tokenLength[2];
+          found++;
+        }
+      length = 0;
+    }
+    p += length;
+  }
+  if (found != count) return(false);
+
+  //Value changes
+  while ((length = vcdToken(p, end)) > 0) {
+    switch (*p) {
+      case '#':
+        time = 0;
+        for (size_t i = 1; i < length; i++) time = time * 10 + p[i] - '0';
+        break;
+      case '0': case '1': case 'x': case 'X': case 'z': case 'Z':
+        value = *p;
+        for (wire = 0; wire < count; wire++) {
+          if (idLength[wire] == length - 1 && memcmp(id[wire], p + 1, length - 1) == 0) {
+            if ((value == '0' || value == '1') && level[wire] != (uint8_t)(value - '0')) {
+              level[wire] = value - '0';
+              sink(CaptureEdge { (unsigned long)(time * scale.multiply / scale.divide), pins[wire], level[wire] });
+            }
+            break;
+          }
+        }
+        break;
+      case 'b': case 'B': case 'r': case 'R':  //Vector or real - skip its id too
+        p += length;
+        length = vcdToken(p, end);
+        break;
+      default:  //$dumpvars, $end, $comment... - keywords between the changes
+        break;
+    }
+    p += length;
+  }
+  return(true);
+}
+
+// -- sigrok binary output
+//Calls sink(edge) for every change of channels[0..count) (bit numbers in the sample),
+//which go to pins[0..count). unitsize is 1 to 8 bytes, little endian
+template <class Sink>
+bool sigrokBinaryImport(const char *path, unsigned unitsize, uint64_t samplerate, const uint8_t *channels,
+                        const uint8_t *pins, unsigned count, Sink sink) {
+  CaptureFile file(path);
+  const uint8_t *p = (const uint8_t *)file.data;
+  uint64_t mask = 0, sample, last = 0, changed;
+  size_t i, samples;
+  unsigned channel;
+
+  if (file.data == NULL || unitsize < 1 || unitsize > 8 || samplerate == 0) return(false);
+  for (channel = 0; channel < count; channel++) mask |= 1ULL << channels[channel];
+  samples = file.size / unitsize;
+  for (i = 0; i < samples; i++, p += unitsize) {
+    sample = 0;
+    memcpy(&sample, p, unitsize);
+    changed = (i == 0) ? mask : (sample ^ last) & mask;
+    last = sample;
+    if (changed == 0) continue;
+    for (channel = 0; channel < count; channel++)
+      if (changed & (1ULL << channels[channel]))
+        sink(CaptureEdge { (unsigned long)(i * 1000000 / samplerate), pins[channel],
+                           (uint8_t)((sample >> channels[channel]) & 1) });
+  }
+  return(true);
+}
+
+#endif
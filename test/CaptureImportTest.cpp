@@ -0,0 +1,289 @@
+/*
+  The capture importers (CaptureImport.hpp), replayed into the encoder
+
+  A recording of clicks and presses, bouncing as real contacts do, is written out as a
+  VCD file (ns timescale, multi character ids, $dumpvars, a clock and a bus that aren't
+  wanted) and as sigrok binary output (2 byte samples at 1MHz, the pins on scattered
+  bits among noise), then each is imported and streamed straight into
+  encoderIntHandler()/buttonIntHandler() with scan() every 1ms. Both must give the same
+  clicks and presses as replaying the recording directly, and the same steps through
+  RotarySpan as the encoder counted.
+
+  Then a 32MB binary capture and a VCD of a long spin are imported and the rates
+  printed - the import is one pass over the mapped file, so it should run at about
+  memory (or disk) bandwidth, in constant memory.
+*/
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include "CaptureImport.hpp"
+#include "Arduino.h"
+#include "RotaryEncoder.hpp"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+typedef RotaryEncoder<2, 3, 4> Encoder;
+typedef std::chrono::steady_clock Clock;
+
+static const uint8_t pins[3] = { 2, 3, 4 };
+static const char *names[3] = { "A", "B", "SW" };
+
+// -- The recording
+static void bouncyEdge(std::vector<CaptureEdge> &edges, unsigned long when, uint8_t pin, uint8_t level, int bounces) {
+  edges.push_back({ when, pin, level });
+  for (int i = 0; i < bounces; i++) {
+    edges.push_back({ when + 200 * i + 100, pin, (uint8_t)!level });
+    edges.push_back({ when + 200 * i + 200, pin, level });
+  }
+}
+
+//15 clicks clockwise, 5 back, then 4 presses, every edge bouncing
+static std::vector<CaptureEdge> recording() {
+  std::vector<CaptureEdge> edges;
+  unsigned long t = 100000;
+  int i;
+
+  for (i = 0; i < 20; i++, t += 50000) {
+    uint8_t first = i < 15 ? 2 : 3, second = i < 15 ? 3 : 2;
+    bouncyEdge(edges, t, first, HIGH, 2);
+    bouncyEdge(edges, t + 5000, second, HIGH, 2);
+    bouncyEdge(edges, t + 10000, first, LOW, 2);
+    bouncyEdge(edges, t + 15000, second, LOW, 2);
+  }
+  for (i = 0; i < 4; i++, t += 200000) {
+    bouncyEdge(edges, t, 4, LOW, 3);
+    bouncyEdge(edges, t + 80000, 4, HIGH, 3);
+  }
+  return(edges);
+}
+
+static unsigned long endOf(const std::vector<CaptureEdge> &edges) {
+  return(edges.back().when + 100000);
+}
+
+// -- Replay into the encoder, one edge at a time as they stream in
+struct Replay {
+  Encoder *enc;
+  unsigned long nextScan;
+  uint8_t sample;     //A on bit 1, B on bit 0, as RotaryDecode.hpp has it
+  RotarySpan span;
+  unsigned long edges;
+
+  void start(Encoder &encoder) {
+    mockReset();
+    mockPins[2] = mockPins[3] = LOW;
+    mockPins[4] = HIGH;
+    enc = &encoder;
+    enc->begin();
+    nextScan = 1000;
+    sample = 0;
+    span = { 0, 0, 0, false };
+    edges = 0;
+  }
+
+  void scanUntil(unsigned long when) {
+    for (; nextScan <= when; nextScan += 1000) {
+      mockMicros = nextScan;
+      enc->scan();
+    }
+  }
+
+  void operator()(const CaptureEdge &edge) {
+    scanUntil(edge.when);
+    mockEdge(edge.pin, edge.level, edge.when);
+    if (edge.pin != 4) {
+      uint8_t bit = edge.pin == 2 ? 2 : 1;
+      sample = edge.level ? sample | bit : sample & ~bit;
+      span = rotaryJoin(span, RotarySpan { sample, sample, 0, false });
+    }
+    edges++;
+  }
+};
+
+// -- Writers
+static const char *vcdPath = "/tmp/CaptureImportTest.vcd";
+static const char *binaryPath = "/tmp/CaptureImportTest.bin";
+
+//Times in ns, with a 20kHz clock ("!") and a 4 bit bus ("*") between the changes wanted
+static bool writeVcd(const char *path, const std::vector<CaptureEdge> &edges) {
+  static const char *ids[5] = { NULL, NULL, "#a", "%", "&" };
+  FILE *file = fopen(path, "w");
+  unsigned long clock = 0;
+  int level = 0, bus = 0;
+
+  if (file == NULL) return(false);
+  fprintf(file, "$date today $end\n$version CaptureImportTest $end\n$timescale 1 ns $end\n"
+                "$scope module knob $end\n$var wire 1 ! clk $end\n$var wire 1 #a A $end\n"
+                "$var wire 1 %% B $end\n$var wire 1 & SW $end\n$var wire 4 * bus [3:0] $end\n"
+                "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n0!\n0#a\n0%%\n1&\nbx *\n$end\n");
+  for (size_t i = 0; i < edges.size(); i++) {
+    for (; clock + 25 < edges[i].when; clock += 25) {
+      fprintf(file, "#%lu000\n%d!\n", clock + 25, level ^= 1);
+      if (clock % 1000 == 0) fprintf(file, "b%d%d%d%d *\n", bus >> 3 & 1, bus >> 2 & 1, bus >> 1 & 1, bus & 1), bus++;
+    }
+    fprintf(file, "#%lu000\n%d%s\n", edges[i].when, edges[i].level, ids[edges[i].pin]);
+  }
+  fprintf(file, "#%lu000\n", endOf(edges));
+  return(fclose(file) == 0);
+}
+
+//1MHz, 2 byte samples: A on bit 9, B on bit 3, SW on bit 12, the rest noise
+static const uint8_t binaryBits[3] = { 9, 3, 12 };
+static const uint16_t binaryNoise = ~(1 << 9 | 1 << 3 | 1 << 12);
+
+static bool writeBinary(const char *path, const std::vector<CaptureEdge> &edges, unsigned long until) {
+  FILE *file = fopen(path, "wb");
+  uint16_t sample = 1 << 12, noise = 0;
+  size_t next = 0;
+
+  if (file == NULL) return(false);
+  for (unsigned long t = 0; t < until; t++) {
+    for (; next < edges.size() && edges[next].when <= t; next++) {
+      uint16_t bit = 1 << binaryBits[edges[next].pin - 2];
+      sample = edges[next].level ? sample | bit : sample & ~bit;
+    }
+    noise = noise * 31421 + 6927;
+    uint16_t word = sample | (noise & binaryNoise);
+    fwrite(&word, 2, 1, file);
+  }
+  return(fclose(file) == 0);
+}
+
+// -- Tests
+struct Outcome {
+  long position, presses;
+};
+
+static Outcome direct(const std::vector<CaptureEdge> &edges) {
+  Encoder enc;
+  Replay replay;
+
+  replay.start(enc);
+  for (size_t i = 0; i < edges.size(); i++) replay(edges[i]);
+  replay.scanUntil(endOf(edges));
+  return(Outcome { enc.getPosition(), (long)eventQueue.count });
+}
+
+void testDirect() {
+  Outcome outcome = direct(recording());
+
+  CHECK_EQUAL(10, outcome.position);
+  CHECK_EQUAL(4, outcome.presses);
+}
+
+void testVcd() {
+  std::vector<CaptureEdge> edges = recording();
+  Outcome expected = direct(edges);
+  Encoder enc;
+  Replay replay;
+
+  CHECK(writeVcd(vcdPath, edges));
+  replay.start(enc);
+  CHECK(vcdImport(vcdPath, names, pins, 3, [&](const CaptureEdge &edge) { replay(edge); }));
+  replay.scanUntil(endOf(edges));
+  CHECK_EQUAL(edges.size() + 3, replay.edges);  //And the 3 initial values
+  CHECK_EQUAL(expected.position, enc.getPosition());
+  CHECK_EQUAL(expected.presses, eventQueue.count);
+  CHECK_EQUAL(4 * expected.position, replay.span.count);
+  unlink(vcdPath);
+}
+
+void testBinary() {
+  std::vector<CaptureEdge> edges = recording();
+  Outcome expected = direct(edges);
+  Encoder enc;
+  Replay replay;
+
+  CHECK(writeBinary(binaryPath, edges, endOf(edges)));
+  replay.start(enc);
+  CHECK(sigrokBinaryImport(binaryPath, 2, 1000000, binaryBits, pins, 3,
+                           [&](const CaptureEdge &edge) { replay(edge); }));
+  replay.scanUntil(endOf(edges));
+  CHECK_EQUAL(edges.size() + 3, replay.edges);
+  CHECK_EQUAL(expected.position, enc.getPosition());
+  CHECK_EQUAL(expected.presses, eventQueue.count);
+  CHECK_EQUAL(4 * expected.position, replay.span.count);
+  unlink(binaryPath);
+}
+
+//Timescales other than 1ns, and the files that must be turned down
+void testVcdErrors() {
+  static const char *missing[1] = { "C" };
+  FILE *file;
+  unsigned long last = 0;
+  int edges = 0;
+
+  file = fopen(vcdPath, "w");
+  fprintf(file, "$timescale 10us $end\n$var wire 1 ! A $end\n$var wire 1 \" B $end\n$var wire 1 # SW $end\n"
+                "$enddefinitions $end\n#0\n0!\n0\"\nx#\n#5\n1!\n#7\n1#\n1\"\n#9\nz!\n#12\n0!\n");
+  fclose(file);
+  CHECK(vcdImport(vcdPath, names, pins, 3, [&](const CaptureEdge &edge) { last = edge.when; edges++; }));
+  CHECK_EQUAL(6, edges);  //x and z aren't changes
+  CHECK_EQUAL(120, last);
+  CHECK(!vcdImport(vcdPath, missing, pins, 1, [](const CaptureEdge &) {}));
+  unlink(vcdPath);
+  CHECK(!vcdImport(vcdPath, names, pins, 3, [](const CaptureEdge &) {}));
+  CHECK(!sigrokBinaryImport(binaryPath, 1, 1000000, binaryBits, pins, 3, [](const CaptureEdge &) {}));
+}
+
+static double rate(size_t bytes, Clock::time_point start) {
+  return(bytes / std::chrono::duration<double>(Clock::now() - start).count() / 1e6);
+}
+
+void testThroughput() {
+  std::vector<CaptureEdge> edges;
+  Clock::time_point start;
+  unsigned long count = 0, until = 32 << 20;
+  Encoder enc;
+  Replay replay;
+  struct stat info;
+
+  //A fast spin, 6ms clicks, over 32s at 1MHz with 1 byte samples
+  for (unsigned long t = 100000; t + 6000 < until; t += 6000) {
+    bouncyEdge(edges, t, 2, HIGH, 1);
+    bouncyEdge(edges, t + 1500, 3, HIGH, 1);
+    bouncyEdge(edges, t + 3000, 2, LOW, 0);
+    bouncyEdge(edges, t + 4500, 3, LOW, 0);
+  }
+  FILE *file = fopen(binaryPath, "wb");
+  uint8_t sample = 0x04;
+  size_t next = 0;
+  for (unsigned long t = 0; t < until; t++) {
+    for (; next < edges.size() && edges[next].when <= t; next++)
+      sample = edges[next].level ? sample | (1 << (edges[next].pin - 2)) : sample & ~(1 << (edges[next].pin - 2));
+    fputc(sample, file);
+  }
+  fclose(file);
+  static const uint8_t bits[3] = { 0, 1, 2 };
+
+  start = Clock::now();
+  CHECK(sigrokBinaryImport(binaryPath, 1, 1000000, bits, pins, 3, [&](const CaptureEdge &) { count++; }));
+  printf("CaptureImportTest - sigrok binary: %lu MB, %.0f MB/s\n", until >> 20, rate(until, start));
+  CHECK_EQUAL(edges.size() + 3, count);
+
+  replay.start(enc);
+  start = Clock::now();
+  CHECK(sigrokBinaryImport(binaryPath, 1, 1000000, bits, pins, 3, replay));
+  printf("CaptureImportTest - sigrok binary into the encoder: %.0f MB/s\n", rate(until, start));
+  unlink(binaryPath);
+
+  CHECK(writeVcd(vcdPath, edges));
+  stat(vcdPath, &info);
+  count = 0;
+  start = Clock::now();
+  CHECK(vcdImport(vcdPath, names, pins, 3, [&](const CaptureEdge &) { count++; }));
+  printf("CaptureImportTest - VCD: %ld MB, %.0f MB/s\n", (long)(info.st_size >> 20), rate(info.st_size, start));
+  CHECK_EQUAL(edges.size() + 3, count);
+  unlink(vcdPath);
+}
+
+int main() {
+  RUN(testDirect);
+  RUN(testVcd);
+  RUN(testBinary);
+  RUN(testVcdErrors);
+  RUN(testThroughput);
+  printf("CaptureImportTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
@@ -0,0 +1,207 @@
+/*
+  Host tests for the hybrid interrupt/sampled mode (Config::pollAboveEdges)
+
+  A 1 state per click encoder is spun steadily for a second at rates from 20 to 2000
+  clicks a second, every edge bouncing twice, with sample() called every 250us as
+  from a timer interrupt and scan() every 1ms. Three configurations are compared:
+
+    isr     - interrupts only (pollAboveEdges 0)
+    poll    - sample() only, switched to at the first interrupts and never back
+    hybrid  - pollAboveEdges 40, pollBelowEdges 16
+
+  For each the test counts the handler entries, the sample() calls that decoded the
+  pins (rather than returning straight away) and the switches between the modes, and
+  puts a CPU fraction on the counts with RotarySim's costs for the MCU (the host's own
+  times for calls this short are mostly noise). The hybrid mode has to switch at most
+  once each way in a steady spin (it used to flap around 200 clicks/s, when entry
+  counted interrupts with their bounces and exit counted the changes sample() saw,
+  without them), cost no more than the dearer of the other two (and less than either
+  once the bounces make interrupts dearer than sampling - not before, at 8us a
+  sample()) and end at the right position - less the clicks the interrupts dropped
+  before it switched, when they come faster than the debounce. The table is printed.
+*/
+#include "RotarySim.hpp"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+struct OneState : RotaryEncoderConfig {
+  static const uint8_t statesPerDetent = 1;
+  static const uint8_t stormEdges = 0;        //Measuring the modes, not the health monitor
+  static const uint16_t ramBudget = 124;      //The hybrid mode's edge count
+};
+
+struct Poll : OneState {
+  static const uint8_t pollAboveEdges = 1;
+  static const uint8_t pollBelowEdges = 0;
+};
+
+struct Hybrid : OneState {
+  static const uint8_t pollAboveEdges = 40;
+  static const uint8_t pollBelowEdges = 16;
+};
+
+struct Cost {
+  long position;
+  unsigned long interrupts, samples, idleSamples, switches, scans;
+  double cpu;            //% of the MCU, from the counts
+};
+
+//us on the MCU - a handler entry and a scan() as RotarySim costs them. sample() runs from a
+//timer interrupt, so one that decodes the pins costs about a handler entry and one that
+//returns straight away the entry and exit alone. Interrupts only has no timer to pay for
+static const RotarySimCosts mcu;
+static const unsigned long sampleCost = mcu.isrCost, idleSampleCost = 3;
+
+//Would mockEdge() run a handler for this change?
+static bool fires(uint8_t pin, uint8_t level) {
+  uint8_t mode = mockIsrMode[pin];
+
+  if (mockIsr[pin] == NULL || mockPins[pin] == level) return(false);
+  return(mode == CHANGE || (mode == RISING && level) || (mode == FALLING && !level));
+}
+
+//clicks a second clockwise for 1s from 100ms, then 300ms still. Time moves in 50us steps
+template <class Config>
+static Cost spin(long rate) {
+  static const uint8_t gray[4] = { 0, 2, 3, 1 };
+  RotaryEncoder<2, 3, 4, Config> enc;
+  Cost cost = {};
+  unsigned long period = 1000000 / rate, next = 100000, t;
+  long clicks = 0;
+  int bounce = 0;
+  uint8_t pin = 2, level = 0;
+  bool polling = false;
+
+  mockReset();
+  mockPins[2] = mockPins[3] = LOW;
+  mockPins[4] = HIGH;
+  enc.begin(false);
+  for (t = 50; t < 1400000; t += 50) {
+    mockMicros = t;
+    //The next edge of the spin, or one of its bounces 100us apart (back, forward, back, forward)
+    if (bounce == 0 && t >= next && t < 1100000 && clicks < rate) {
+      uint8_t from = gray[clicks & 3], to = gray[(clicks + 1) & 3];
+      pin = ((from ^ to) & 2) ? 2 : 3;
+      level = (to >> (pin == 2 ? 1 : 0)) & 1;
+      clicks++;
+      next += period;
+      bounce = 5;
+    }
+    if (bounce > 0 && (bounce == 5 || t % 100 == 0)) {
+      uint8_t now = (bounce & 1) ? level : !level;
+      bounce--;
+      if (fires(pin, now)) cost.interrupts++;
+      mockEdge(pin, now, t);
+    }
+    if (t % 250 == 0) {
+      if (enc.polling) cost.samples++;
+      else cost.idleSamples++;
+      enc.sample();
+    }
+    if (t % 1000 == 0) {
+      cost.scans++;
+      enc.scan();
+    }
+    if (enc.polling != polling) {
+      polling = enc.polling;
+      cost.switches++;
+    }
+  }
+  cost.position = enc.getPosition();
+  if (Config::pollAboveEdges == 0) cost.idleSamples = 0;
+  cost.cpu = (cost.interrupts * mcu.isrCost + cost.samples * sampleCost + cost.idleSamples * idleSampleCost
+              + cost.scans * mcu.scanCost) * 100.0 / t;
+  return(cost);
+}
+
+static const long rates[] = { 20, 50, 100, 200, 300, 400, 800, 2000 };
+static const int rateCount = sizeof(rates) / sizeof(rates[0]);
+
+void testHybrid() {
+  Cost isr, poll, hybrid;
+
+  printf("HybridModeTest - 1 state per click, 2 bounce pairs per edge, sample() every 250us, 1s spin\n");
+  printf("  clicks/s   isr: entries  cpu%%   poll: samples  cpu%%   hybrid: entries + samples  switches  cpu%%\n");
+  for (int i = 0; i < rateCount; i++) {
+    isr = spin<OneState>(rates[i]);
+    poll = spin<Poll>(rates[i]);
+    hybrid = spin<Hybrid>(rates[i]);
+    printf("  %6ld    %12lu  %5.2f   %13lu  %5.2f   %15lu + %-6lu  %8lu  %5.2f\n", rates[i],
+           isr.interrupts, isr.cpu, poll.samples, poll.cpu,
+           hybrid.interrupts, hybrid.samples, hybrid.switches, hybrid.cpu);
+
+    CHECK_EQUAL(rates[i], poll.position);
+    if (1000000 / rates[i] > RotaryEncoderConfig::debounceInterval) {  //Interrupts alone can keep up
+      CHECK_EQUAL(rates[i], isr.position);
+      CHECK_EQUAL(rates[i], hybrid.position);
+    } else {  //Only the clicks before the switch, 5 entries each, can be lost
+      CHECK(hybrid.position <= rates[i] && hybrid.position >= rates[i] - Hybrid::pollAboveEdges / 5);
+      CHECK(hybrid.position >= isr.position);
+    }
+
+    //Into sampling and back once at most - no flapping
+    CHECK(hybrid.switches <= 2);
+    //Slow spins stay on interrupts, fast ones go over to sampling
+    if (rates[i] * 5 * 64 / 1000 <= Hybrid::pollAboveEdges) CHECK_EQUAL(0, hybrid.switches);
+    if (rates[i] >= 400) CHECK(hybrid.samples > 0 && hybrid.interrupts <= Hybrid::pollAboveEdges + 1);
+    //Never many more entries than interrupts only, or samples than sampling only
+    CHECK(hybrid.interrupts <= isr.interrupts);
+    CHECK(hybrid.samples <= poll.samples);
+    CHECK(hybrid.cpu <= (isr.cpu > poll.cpu ? isr.cpu : poll.cpu));
+    if (isr.cpu > poll.cpu) CHECK(hybrid.cpu < poll.cpu);  //Sampling without the idle start
+  }
+}
+
+//Out of sampling once the knob slows - the same unit, interrupts that would have been taken.
+//The last click is counted by sample() and its bounces carry on after the interrupts are back
+void testBackToInterrupts() {
+  RotaryEncoder<2, 3, 4, Hybrid> enc;
+  static const uint8_t gray[4] = { 0, 2, 3, 1 };
+  unsigned long t = 100000;
+  int clicks = 0;
+
+  mockPins[2] = mockPins[3] = LOW;
+  mockPins[4] = HIGH;
+  enc.begin(false);
+  //Fast - 6ms clicks (53 interrupts in 64ms), bouncing twice, with sample() every 250us
+  //and scan() every 1ms
+  for (; clicks < 200; clicks++, t += 6000) {
+    uint8_t from = gray[clicks & 3], to = gray[(clicks + 1) & 3];
+    uint8_t pin = ((from ^ to) & 2) ? 2 : 3, level = (to >> (pin == 2 ? 1 : 0)) & 1;
+    for (unsigned long s = t; s < t + 6000; s += 50) {
+      mockMicros = s;
+      if (s - t <= 400 && s % 100 == 0) mockEdge(pin, (s - t) % 200 ? !level : level, s);
+      if (s % 250 == 0) enc.sample();
+      if (s % 1000 == 0) enc.scan();
+    }
+  }
+  CHECK(enc.polling);
+  CHECK(mockIsr[2] == NULL);
+  CHECK_EQUAL(200, enc.getPosition());
+  //Slowing to 40ms clicks - 3 changes in 64ms would have been 15 interrupts, back on
+  //interrupts, and the button never touched the count
+  mockEdge(4, LOW, t);
+  mockEdge(4, HIGH, t + 30000);
+  for (; clicks < 210; clicks++, t += 40000) {
+    uint8_t from = gray[clicks & 3], to = gray[(clicks + 1) & 3];
+    uint8_t pin = ((from ^ to) & 2) ? 2 : 3, level = (to >> (pin == 2 ? 1 : 0)) & 1;
+    for (unsigned long s = t; s < t + 40000; s += 50) {
+      mockMicros = s;
+      if (s - t <= 400 && s % 100 == 0) mockEdge(pin, (s - t) % 200 ? !level : level, s);
+      if (s % 250 == 0) enc.sample();
+      if (s % 1000 == 0) enc.scan();
+    }
+  }
+  CHECK(!enc.polling);
+  CHECK(mockIsr[2] != NULL);
+  CHECK(mockIsr[3] != NULL);
+  CHECK_EQUAL(210, enc.getPosition());
+}
+
+int main() {
+  RUN(testHybrid);
+  RUN(testBackToInterrupts);
+  printf("HybridModeTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
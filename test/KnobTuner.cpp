@@ -0,0 +1,80 @@
+/*
+  Tunes debounceInterval, longPressInterval and accelDivisor over labeled traces and
+  writes the winner as a Config header (see KnobTuner.hpp)
+
+    KnobTuner [-o header] [-n traces] [-s seed] [-j threads] [capture.vcd:clicks:short:long[:travel]]...
+
+  The corpus is n gestures of the scripted hand (240 from seed 1 by default) and any
+  recorded captures, each a VCD file with wires A, B and SW (the button, down is LOW)
+  and its labels - the clicks turned (clockwise positive), the short and long presses
+  made and the accelerated count meant, if the capture was made against a reference
+  (e.g. the value the user was asked to dial in). accelDivisor is only tuned if some
+  capture has that label - the scripted hand has none. A capture starts with the knob
+  at rest. "make tune" writes KnobTuning.h from the defaults, which is the header
+  KnobTunerTest checks is up to date.
+*/
+#include <string>
+#include <thread>
+#include "KnobTuner.hpp"
+
+//A capture and its labels, path:clicks:short:long[:travel]
+static bool addCapture(std::vector<TunerTrace> &corpus, const char *arg) {
+  const char *labels = strchr(arg, ':');
+  TunerTrace trace;
+
+  if ( labels == NULL || sscanf(labels, ":%ld:%d:%d:%ld", &trace.clicks, &trace.shortPresses,
+                                &trace.longPresses, &trace.travel) < 3 )
+    return(false);
+  std::string path(arg, labels - arg);
+  if (!tunerCapture(path.c_str(), trace)) return(false);
+  corpus.push_back(trace);
+  return(true);
+}
+
+int main(int argc, char **argv) {
+  const char *header = "KnobTuning.h";
+  unsigned traces = tunerTraces, threads = std::thread::hardware_concurrency(), recorded = 0;
+  unsigned long seed = tunerSeed;
+  std::vector<TunerTrace> corpus;
+  char source[100];
+  int i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i += 2) {
+    if (i + 1 >= argc) break;
+    if (!strcmp(argv[i], "-o")) header = argv[i + 1];
+    else if (!strcmp(argv[i], "-n")) traces = atoi(argv[i + 1]);
+    else if (!strcmp(argv[i], "-s")) seed = strtoul(argv[i + 1], NULL, 10);
+    else if (!strcmp(argv[i], "-j")) threads = atoi(argv[i + 1]);
+    else break;
+  }
+  if (i < argc && argv[i][0] == '-') {
+    fprintf(stderr, "usage: KnobTuner [-o header] [-n traces] [-s seed] [-j threads] "
+                    "[capture.vcd:clicks:short:long[:travel]]...\n");
+    return(2);
+  }
+  corpus = tunerCorpus(traces, seed);
+  for (; i < argc; i++, recorded++) {
+    if (!addCapture(corpus, argv[i])) {
+      fprintf(stderr, "KnobTuner - can't read %s\n", argv[i]);
+      return(1);
+    }
+  }
+  if (corpus.empty()) {
+    fprintf(stderr, "KnobTuner - no traces\n");
+    return(2);
+  }
+  if (threads < 1) threads = 1;
+
+  TunerResult best = tunerPick(tunerSweep(corpus, threads), tunerHasTravel(corpus));
+  if (recorded) snprintf(source, sizeof(source), "%u scripted traces, seed %lu, and %u recorded", traces, seed, recorded);
+  else snprintf(source, sizeof(source), "%u scripted traces, seed %lu", traces, seed);
+  printf("KnobTuner - %u configs over %u traces on %u threads: debounceInterval %ld longPressInterval %ld "
+         "accelDivisor %u%s, %ld errors, %.0fus latency\n", tunerGridSize, (unsigned)corpus.size(), threads,
+         best.debounceInterval, best.longPressInterval, best.accelDivisor, best.accelTuned ? "" : " (not tuned)",
+         best.score.errors, best.score.latency);
+  if (!tunerWriteHeader(header, best, source)) {
+    fprintf(stderr, "KnobTuner - can't write %s\n", header);
+    return(1);
+  }
+  return(0);
+}
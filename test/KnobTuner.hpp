@@ -0,0 +1,270 @@
+#ifndef KnobTuner_hpp
+#define KnobTuner_hpp
+/*
+  Offline tuning of debounceInterval, longPressInterval and accelDivisor
+
+  The three are compile time constants of the Config, so each point of a grid of them
+  is a RotaryEncoderConfig of its own (TunerKnob<index>), and each replays a corpus of
+  labeled traces on the stub core. A trace is the edges of one gesture, a turn or a
+  press, with its ground truth: the clicks turned, the presses short and long and,
+  for a turn recorded against a reference, the accelerated count meant. The
+  application takes the events every 1ms (only its turns after an edge are run - the
+  others would find nothing new). A config's errors are the clicks miscounted, the
+  presses missed, extra or misread and how far the accelerated count is off, all
+  against the labels. Its latency is the mean time from the edge that decides a
+  gesture (the click, the release) to the application taking its event. tunerSweep() shares the configs out over threads - the
+  stub core's state is per thread, and a config is only ever on one. The grid is kept
+  to the values either side of what is likely to work, as every point is another copy
+  of the driver to compile.
+
+  tunerPick() takes the fewest errors, then the most room - the grid steps the config
+  can move each way along each parameter before the errors go up, added up - so the
+  debounce ends up in the middle of the range that works rather than at its edge, then
+  the lowest latency. tunerWriteHeader() writes it as a struct TunedKnob :
+  RotaryEncoderConfig. "make tune" runs KnobTuner.cpp, which can add recorded VCD
+  traces to the scripted corpus, and writes KnobTuning.h:
+
+    std::vector<TunerTrace> corpus = tunerCorpus(240, 1);   //240 gestures, seed 1
+    TunerResult best = tunerPick(tunerSweep(corpus, 4), tunerHasTravel(corpus));  //On 4 threads
+    tunerWriteHeader("KnobTuning.h", best, "240 scripted traces, seed 1");
+
+  The scripted hand knows the clicks and presses it made, but not the accelerated
+  count it wanted - any label for that would assume the gain the sweep is meant to
+  find. So accelDivisor is only tuned when some trace has that label, a capture
+  recorded against a reference (see tunerCapture() and KnobTuner.cpp). Otherwise it
+  is left at the default, and the header says so.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "Arduino.h"
+#include "RotaryEncoder.hpp"
+#include "CaptureImport.hpp"
+
+// -- A labeled trace. A is pin 2, B pin 3 and the button pin 4 (down is LOW). Edges in
+// the first 1ms are the pins' levels at the start
+struct TunerTrace {
+  std::vector<CaptureEdge> edges;  //In time order
+  unsigned long due = 0;           //The edge that decides the last gesture - the click, the release
+  long clicks = 0;                 //Detents turned, clockwise positive
+  long travel = 0;                 //ROTATION deltas the hand meant with acceleration, 0 for not labeled
+  int shortPresses = 0, longPresses = 0;
+};
+
+struct TunerScore {
+  long errors = 0;
+  double latency = 0;              //Mean us, deciding edge to the application taking the event
+};
+
+static const unsigned long tunerAppPeriod = 1000;
+static const unsigned tunerTraces = 240;     //The scripted corpus KnobTuning.h is tuned on
+static const unsigned long tunerSeed = 1;
+
+// -- The grid
+static constexpr long tunerDebounce[] = { 500, 1000, 2000, 3000, 4000, 6000, 8000 };
+static constexpr long tunerLongPress[] = { 300000, 500000, 700000, 900000, 1200000 };
+static constexpr uint8_t tunerAccel[] = { 2, 3, 4, 5, 6 };
+static const unsigned tunerDebounces = sizeof(tunerDebounce) / sizeof(tunerDebounce[0]);
+static const unsigned tunerLongPresses = sizeof(tunerLongPress) / sizeof(tunerLongPress[0]);
+static const unsigned tunerAccels = sizeof(tunerAccel) / sizeof(tunerAccel[0]);
+static const unsigned tunerGridSize = tunerDebounces * tunerLongPresses * tunerAccels;
+
+template <unsigned index>
+struct TunerKnob : RotaryEncoderConfig {
+  static const long debounceInterval = tunerDebounce[index / (tunerLongPresses * tunerAccels)];
+  static const long longPressInterval = tunerLongPress[index / tunerAccels % tunerLongPresses];
+  static const uint8_t accelDivisor = tunerAccel[index % tunerAccels];
+};
+
+// -- The scripted hand
+//A pin change at when, then flicking back every 100us for burst us, ending at level
+inline void tunerEdge(std::vector<CaptureEdge> &edges, unsigned long when, uint8_t pin, uint8_t level,
+                      unsigned long burst) {
+  edges.push_back({ when, pin, level });
+  for (unsigned long t = 100; t + 100 <= burst; t += 200) {
+    edges.push_back({ when + t, pin, (uint8_t)!level });
+    edges.push_back({ when + t + 100, pin, level });
+  }
+}
+
+//count gestures of a scripted hand, from seed. Half are turns of 1-16 clicks either way,
+//10-120ms a click, a third of them coming back part way after a 3-60ms stop, every edge
+//bouncing for up to 1ms (more on every edge of a faster turn would be an edge storm to
+//the driver - see Config::stormEdges), with no travel label. Half are presses of 80-450ms (short) or 1-2.5s (long),
+//bouncing both ways
+inline std::vector<TunerTrace> tunerCorpus(unsigned count, unsigned long seed) {
+  std::vector<TunerTrace> corpus(count);
+  uint64_t state = seed;
+  auto between = [&](unsigned long low, unsigned long high) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return(low + (unsigned long)((state >> 33) % (high - low + 1)));
+  };
+
+  for (TunerTrace &trace : corpus) {
+    unsigned long t = 100000, burst = between(200, 1000);
+
+    trace.edges.push_back({ 0, 2, LOW });
+    trace.edges.push_back({ 0, 3, LOW });
+    trace.edges.push_back({ 0, 4, HIGH });
+    if (between(0, 1)) {
+      long clicks = between(1, 16), direction = between(0, 1) ? 1 : -1;
+      long back = between(0, 2) == 0 ? between(1, clicks) : 0;
+      unsigned long period = between(10000, 120000), quarter = period / 4, stop = between(3000, 60000);
+
+      for (long i = 0; i < clicks + back; i++, t += period) {
+        long way = i < clicks ? direction : -direction;
+        uint8_t first = way > 0 ? 2 : 3, second = way > 0 ? 3 : 2;
+
+        if (i == clicks) t += stop;
+        tunerEdge(trace.edges, t, first, HIGH, burst);
+        tunerEdge(trace.edges, t + quarter, second, HIGH, burst);
+        tunerEdge(trace.edges, t + 2 * quarter, first, LOW, burst);
+        tunerEdge(trace.edges, t + 3 * quarter, second, LOW, burst);
+        trace.due = way > 0 ? t : t + quarter;  //A rising counts the click
+      }
+      trace.clicks = (clicks - back) * direction;
+    } else {
+      bool isLong = between(0, 1);
+      unsigned long held = isLong ? between(1000000, 2500000) : between(80000, 450000);
+
+      tunerEdge(trace.edges, t, 4, LOW, burst);
+      tunerEdge(trace.edges, t + held, 4, HIGH, burst);
+      trace.due = t + held;
+      trace.shortPresses = !isLong;
+      trace.longPresses = isLong;
+    }
+  }
+  return(corpus);
+}
+
+//A recorded capture as a trace - a VCD file with wires A, B and SW, the knob at rest at
+//the start. The labels are the caller's. Returns false if the file can't be read
+inline bool tunerCapture(const char *path, TunerTrace &trace) {
+  static const uint8_t pins[3] = { 2, 3, 4 };
+  static const char *const names[3] = { "A", "B", "SW" };
+
+  trace.edges.clear();
+  if ( !vcdImport(path, names, pins, 3, [&](const CaptureEdge &edge) { trace.edges.push_back(edge); })
+       || trace.edges.empty() )
+    return(false);
+  trace.due = trace.edges.back().when;  //Not known, the last edge will do
+  return(true);
+}
+
+// -- Replay and scoring
+template <class Config>
+TunerScore tunerScore(const std::vector<TunerTrace> &corpus) {
+  TunerScore score;
+  RotaryEvent ev;
+
+  for (const TunerTrace &trace : corpus) {
+    RotaryEncoder<2, 3, 4, Config> enc;
+    size_t i = 0, n = trace.edges.size();
+    unsigned long t = 0, taken = trace.due;
+    long travel = 0;
+    int shortPresses = 0, longPresses = 0;
+
+    mockReset();
+    for (; i < n && trace.edges[i].when < tunerAppPeriod; i++) mockPins[trace.edges[i].pin] = trace.edges[i].level;
+    enc.begin(true);
+    while (i < n) {
+      t = (trace.edges[i].when / tunerAppPeriod + 1) * tunerAppPeriod;  //The application's next turn
+      for (; i < n && trace.edges[i].when < t; i++)
+        mockEdge(trace.edges[i].pin, trace.edges[i].level, trace.edges[i].when);
+      mockMicros = t;
+      enc.scan();
+      while (enc.getEvent(ev)) {
+        taken = t;
+        if (ev.type == RotaryEvent::ROTATION) travel += ev.delta;
+        if (ev.type == RotaryEvent::SHORT_PRESS) shortPresses++;
+        if (ev.type == RotaryEvent::LONG_PRESS) longPresses++;
+      }
+    }
+    score.errors += labs(enc.getPosition() - trace.clicks) + abs(shortPresses - trace.shortPresses)
+                    + abs(longPresses - trace.longPresses) + (trace.travel != 0 ? labs(travel - trace.travel) : 0);
+    score.latency += taken > trace.due ? taken - trace.due : 0;
+  }
+  if (!corpus.empty()) score.latency /= corpus.size();
+  return(score);
+}
+
+//The score of every config on the grid, by index, the configs shared out over threads.
+//In KnobTunerGrid.cpp - it instantiates the driver for every config, so it is compiled once
+std::vector<TunerScore> tunerSweep(const std::vector<TunerTrace> &corpus, unsigned threads);
+
+// -- Picking the winner
+struct TunerResult {
+  unsigned index;
+  long debounceInterval, longPressInterval;
+  uint8_t accelDivisor;
+  bool accelTuned;                 //Else accelDivisor is the default
+  TunerScore score;
+  unsigned room;                   //Grid steps each way before the errors go up, added over the parameters
+};
+
+//Does any trace have a travel label to tune accelDivisor on?
+inline bool tunerHasTravel(const std::vector<TunerTrace> &corpus) {
+  for (const TunerTrace &trace : corpus)
+    if (trace.travel != 0) return(true);
+  return(false);
+}
+
+//Steps from index along the parameter with stride in the index and count values, the
+//fewer of up and down, before the errors go up or the grid ends
+inline unsigned tunerRoom(const std::vector<TunerScore> &scores, unsigned index, unsigned stride, unsigned count) {
+  unsigned at = index / stride % count, up = 0, down = 0;
+
+  while (at + up + 1 < count && scores[index + (up + 1) * stride].errors <= scores[index].errors) up++;
+  while (down < at && scores[index - (down + 1) * stride].errors <= scores[index].errors) down++;
+  return(std::min(up, down));
+}
+
+//The winner - with tuneAccel false only the configs with the default accelDivisor, which has to
+//be on the grid, are looked at
+inline TunerResult tunerPick(const std::vector<TunerScore> &scores, bool tuneAccel) {
+  TunerResult best = {}, candidate;
+  bool first = true;
+
+  for (unsigned index = 0; index < scores.size(); index++) {
+    candidate.index = index;
+    candidate.debounceInterval = tunerDebounce[index / (tunerLongPresses * tunerAccels)];
+    candidate.longPressInterval = tunerLongPress[index / tunerAccels % tunerLongPresses];
+    candidate.accelDivisor = tunerAccel[index % tunerAccels];
+    candidate.accelTuned = tuneAccel;
+    if (!tuneAccel && candidate.accelDivisor != RotaryEncoderConfig::accelDivisor) continue;
+    candidate.score = scores[index];
+    candidate.room = tunerRoom(scores, index, tunerLongPresses * tunerAccels, tunerDebounces)
+                     + tunerRoom(scores, index, tunerAccels, tunerLongPresses)
+                     + (tuneAccel ? tunerRoom(scores, index, 1, tunerAccels) : 0);
+    if ( first || candidate.score.errors < best.score.errors
+         || (candidate.score.errors == best.score.errors
+             && (candidate.room > best.room
+                 || (candidate.room == best.room && candidate.score.latency < best.score.latency))) )
+      best = candidate;
+    first = false;
+  }
+  return(best);
+}
+
+//Writes the winner as struct TunedKnob : RotaryEncoderConfig to path, source saying what it
+//was tuned on. Returns false if the file can't be written
+inline bool tunerWriteHeader(const char *path, const TunerResult &best, const char *source) {
+  FILE *file = fopen(path, "w");
+
+  if (file == NULL) return(false);
+  fprintf(file, "// KnobTuning.h - generated by test/KnobTuner from %s, don't edit\n", source);
+  fprintf(file, "// %ld errors against the labels, %.0fus mean latency\n", best.score.errors, best.score.latency);
+  fprintf(file, "#ifndef TunedKnob_h\n#define TunedKnob_h\n\n");
+  fprintf(file, "struct TunedKnob : RotaryEncoderConfig {\n");
+  fprintf(file, "  static const long debounceInterval = %ld;\n", best.debounceInterval);
+  fprintf(file, "  static const long longPressInterval = %ld;\n", best.longPressInterval);
+  if (best.accelTuned) fprintf(file, "  static const uint8_t accelDivisor = %u;\n", best.accelDivisor);
+  else fprintf(file, "  //accelDivisor not tuned - no trace has an accelerated count to go by\n");
+  fprintf(file, "};\n\n#endif\n");
+  return(fclose(file) == 0);
+}
+
+#endif
@@ -0,0 +1,42 @@
+//tunerSweep() and the grid of configs it runs (see KnobTuner.hpp). Every config is an
+//instantiation of the driver, so this is compiled once, at -O0, for KnobTuner and KnobTunerTest
+#include <atomic>
+#include <thread>
+#include "KnobTuner.hpp"
+
+typedef TunerScore (*TunerRun)(const std::vector<TunerTrace> &);
+
+//runs[0..index] = tunerScore<TunerKnob<0..index> >
+template <unsigned index>
+struct TunerGrid {
+  static void fill(TunerRun *runs) {
+    runs[index] = tunerScore<TunerKnob<index> >;
+    TunerGrid<index - 1>::fill(runs);
+  }
+};
+
+template <>
+struct TunerGrid<0> {
+  static void fill(TunerRun *runs) {
+    runs[0] = tunerScore<TunerKnob<0> >;
+  }
+};
+
+std::vector<TunerScore> tunerSweep(const std::vector<TunerTrace> &corpus, unsigned threads) {
+  TunerRun runs[tunerGridSize];
+  std::vector<TunerScore> scores(tunerGridSize);
+  std::vector<std::thread> workers;
+  std::atomic<unsigned> next(0);
+  auto work = [&]() {
+    unsigned index;
+
+    while ((index = next++) < tunerGridSize) scores[index] = runs[index](corpus);
+  };
+  unsigned t;
+
+  TunerGrid<tunerGridSize - 1>::fill(runs);
+  for (t = 1; t < threads; t++) workers.push_back(std::thread(work));
+  work();
+  for (t = 0; t < workers.size(); t++) workers[t].join();
+  return(scores);
+}
@@ -0,0 +1,206 @@
+/*
+  The parameter tuner (KnobTuner.hpp) and the header it generated
+
+  A turn of 6ms clicks and straight back part way, every edge bouncing for 1.2ms, is
+  scored against configs either side of it - too short a debounce counts the bounces,
+  too long takes the first click back, 4.5ms after A fell, for a bounce of A falling
+  (see RotaryGeometry) - and a long press against long press intervals either side of it.
+  Then the scripted corpus is swept on 1 and 4 threads, which have to score every
+  config the same (the stub core is per thread), and the winner has to be inside what
+  the hand was scripted with: a debounce between its 1ms bounces and its quickest
+  turn back, 5.5ms after A fell, a long press between its 450ms short and 1s long presses, with no errors.
+  The hand doesn't label the accelerated count, so accelDivisor must be left alone. KnobTuning.h has to be what
+  KnobTuner writes for the default corpus ("make tune" if not), and TunedKnob to score
+  the same as the grid point it came from. Last, turns written out as VCD and read back
+  with tunerCapture(), labeled by reference dials of two different gains, must each
+  tune accelDivisor to their dial's gain.
+*/
+#include <chrono>
+#include <string>
+#include "KnobTuner.hpp"
+#include "KnobTuning.h"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+typedef std::chrono::steady_clock Clock;
+
+static const char *headerPath = "/tmp/KnobTunerTest.h";
+
+//The grid point with these values
+static constexpr unsigned gridIndex(unsigned debounce, unsigned longPress, unsigned accel) {
+  return((debounce * tunerLongPresses + longPress) * tunerAccels + accel);
+}
+
+static std::string readFile(const char *path) {
+  std::string text;
+  FILE *file = fopen(path, "r");
+  int c;
+
+  if (file == NULL) return(text);
+  while ((c = fgetc(file)) != EOF) text += (char)c;
+  fclose(file);
+  return(text);
+}
+
+//Clockwise clicks 6ms apart and all but one straight back, every edge bouncing for 1.2ms
+static TunerTrace turn(long clicks) {
+  TunerTrace trace;
+
+  trace.edges.push_back({ 0, 2, LOW });
+  trace.edges.push_back({ 0, 3, LOW });
+  trace.edges.push_back({ 0, 4, HIGH });
+  for (long i = 0; i < 2 * clicks - 1; i++) {
+    unsigned long t = 100000 + i * 6000;
+    uint8_t first = i < clicks ? 2 : 3, second = i < clicks ? 3 : 2;
+
+    tunerEdge(trace.edges, t, first, HIGH, 1200);
+    tunerEdge(trace.edges, t + 1500, second, HIGH, 1200);
+    tunerEdge(trace.edges, t + 3000, first, LOW, 1200);
+    tunerEdge(trace.edges, t + 4500, second, LOW, 1200);
+    trace.due = i < clicks ? t : t + 1500;
+  }
+  trace.clicks = 1;
+  return(trace);
+}
+
+void testScore() {
+  std::vector<TunerTrace> corpus(1, turn(3));
+  TunerTrace press;
+
+  CHECK(tunerScore<TunerKnob<gridIndex(1, 0, 0)> >(corpus).errors > 0);      //1ms debounce
+  CHECK_EQUAL(0, tunerScore<TunerKnob<gridIndex(2, 0, 0)> >(corpus).errors); //2ms
+  CHECK_EQUAL(0, tunerScore<TunerKnob<gridIndex(4, 0, 0)> >(corpus).errors); //4ms
+  CHECK(tunerScore<TunerKnob<gridIndex(5, 0, 0)> >(corpus).errors > 0);      //6ms, longer than the way back
+  //Taken at the application's first turn after the click
+  CHECK(tunerScore<TunerKnob<gridIndex(2, 0, 0)> >(corpus).latency <= tunerAppPeriod);
+
+  //A 600ms press is long to a 500ms long press and short to 700ms
+  press.edges.push_back({ 0, 2, LOW });
+  press.edges.push_back({ 0, 3, LOW });
+  press.edges.push_back({ 0, 4, HIGH });
+  tunerEdge(press.edges, 100000, 4, LOW, 1000);
+  tunerEdge(press.edges, 700000, 4, HIGH, 1000);
+  press.due = 700000;
+  press.longPresses = 1;
+  corpus.assign(1, press);
+  CHECK_EQUAL(0, tunerScore<TunerKnob<gridIndex(3, 1, 0)> >(corpus).errors);
+  CHECK_EQUAL(2, tunerScore<TunerKnob<gridIndex(3, 2, 0)> >(corpus).errors);  //A short press and no long
+}
+
+void testSweep() {
+  std::vector<TunerTrace> corpus = tunerCorpus(tunerTraces, tunerSeed);
+  std::vector<TunerScore> single, parallel;
+  Clock::time_point start = Clock::now();
+  double seconds;
+
+  single = tunerSweep(corpus, 1);
+  seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  parallel = tunerSweep(corpus, 4);
+  for (unsigned i = 0; i < tunerGridSize; i++) {
+    CHECK_EQUAL(single[i].errors, parallel[i].errors);
+    CHECK(single[i].latency == parallel[i].latency);
+  }
+
+  CHECK(!tunerHasTravel(corpus));
+  TunerResult best = tunerPick(single, false);
+  printf("KnobTunerTest - %u configs over %u traces in %.2fs: debounceInterval %ld longPressInterval %ld "
+         "accelDivisor %u, %ld errors, %.0fus latency\n", tunerGridSize, tunerTraces, seconds,
+         best.debounceInterval, best.longPressInterval, best.accelDivisor, best.score.errors, best.score.latency);
+  CHECK(best.debounceInterval > 1000 && best.debounceInterval < 5500);
+  CHECK(best.longPressInterval > 450000 && best.longPressInterval < 1000000);
+  CHECK(!best.accelTuned);  //Nothing to go by
+  CHECK_EQUAL(RotaryEncoderConfig::accelDivisor, best.accelDivisor);
+  CHECK(best.room >= 2);  //Not at the edge of the debounce or long press ranges that work
+  CHECK_EQUAL(0, best.score.errors);
+  CHECK(best.score.latency <= tunerAppPeriod);
+
+  //The header is what KnobTuner writes, and the config in it is the winner
+  CHECK(tunerWriteHeader(headerPath, best, "240 scripted traces, seed 1"));
+  CHECK(readFile(headerPath) == readFile("KnobTuning.h"));
+  CHECK(readFile(headerPath).find("accelDivisor not tuned") != std::string::npos);
+  unlink(headerPath);
+  CHECK_EQUAL(best.debounceInterval, TunedKnob::debounceInterval);
+  CHECK_EQUAL(best.longPressInterval, TunedKnob::longPressInterval);
+  CHECK_EQUAL(RotaryEncoderConfig::accelDivisor, TunedKnob::accelDivisor);
+  CHECK_EQUAL(best.score.errors, tunerScore<TunedKnob>(corpus).errors);
+}
+
+//What a reference dial with this gain reads for a turn - one a click, and on every second
+//click the extra 1 second / (gain * click period) of the acceleration. It stands in for the
+//value the user was asked to dial in when the capture was made
+static long referenceTravel(long clicks, unsigned long period, unsigned gain) {
+  long travel = 0;
+
+  for (long i = 1; i <= labs(clicks); i++)
+    travel += (i & 1) ? 1 : 1 + 1000000 / (gain * period);
+  return(clicks < 0 ? -travel : travel);
+}
+
+//trace's edges as a VCD file, 1us timescale
+static bool writeVcd(const char *path, const TunerTrace &trace) {
+  static const char ids[] = { 0, 0, '!', '"', '#' };
+  FILE *file = fopen(path, "w");
+  unsigned long last = ~0UL;
+
+  if (file == NULL) return(false);
+  fprintf(file, "$timescale 1us $end\n$scope module knob $end\n");
+  fprintf(file, "$var wire 1 ! A $end\n$var wire 1 \" B $end\n$var wire 1 # SW $end\n");
+  fprintf(file, "$upscope $end\n$enddefinitions $end\n");
+  for (const CaptureEdge &edge : trace.edges) {
+    if (edge.when != last) fprintf(file, "#%lu\n", edge.when);
+    last = edge.when;
+    fprintf(file, "%u%c\n", edge.level, ids[edge.pin]);
+  }
+  return(fclose(file) == 0);
+}
+
+//Turns recorded against a reference dial of gain, through the VCD import. The sweep has
+//to find the gain from the labels, whichever it is
+void testRecorded() {
+  static const unsigned gains[] = { 2, 5 };
+  static const char *vcdPath = "/tmp/KnobTunerTest.vcd";
+
+  for (unsigned gain : gains) {
+    std::vector<TunerTrace> corpus;
+
+    for (int i = 0; i < 12; i++) {
+      TunerTrace made, recorded;
+      unsigned long period = 10000 + 5000 * i, quarter = period / 4, t = 100000;
+      long clicks = 6 + i % 5, direction = (i & 1) ? -1 : 1;
+      uint8_t first = direction > 0 ? 2 : 3, second = direction > 0 ? 3 : 2;
+
+      made.edges.push_back({ 0, 2, LOW });
+      made.edges.push_back({ 0, 3, LOW });
+      made.edges.push_back({ 0, 4, HIGH });
+      for (long c = 0; c < clicks; c++, t += period) {
+        tunerEdge(made.edges, t, first, HIGH, 600);
+        tunerEdge(made.edges, t + quarter, second, HIGH, 600);
+        tunerEdge(made.edges, t + 2 * quarter, first, LOW, 600);
+        tunerEdge(made.edges, t + 3 * quarter, second, LOW, 600);
+      }
+      CHECK(writeVcd(vcdPath, made));
+      CHECK(tunerCapture(vcdPath, recorded));
+      CHECK_EQUAL(made.edges.size(), recorded.edges.size());
+      recorded.clicks = clicks * direction;
+      recorded.travel = referenceTravel(recorded.clicks, period, gain);
+      corpus.push_back(recorded);
+    }
+    unlink(vcdPath);
+
+    CHECK(tunerHasTravel(corpus));
+    TunerResult best = tunerPick(tunerSweep(corpus, 2), true);
+    printf("KnobTunerTest - turns recorded against a gain of %u: accelDivisor %u, %ld errors\n", gain,
+           best.accelDivisor, best.score.errors);
+    CHECK(best.accelTuned);
+    CHECK_EQUAL(gain, best.accelDivisor);
+  }
+}
+
+int main() {
+  RUN(testScore);
+  RUN(testSweep);
+  RUN(testRecorded);
+  printf("KnobTunerTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
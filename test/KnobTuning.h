@@ -0,0 +1,12 @@
+// KnobTuning.h - generated by test/KnobTuner from 240 scripted traces, seed 1, don't edit
+// 0 errors against the labels, 509us mean latency
+#ifndef TunedKnob_h
+#define TunedKnob_h
+
+struct TunedKnob : RotaryEncoderConfig {
+  static const long debounceInterval = 3000;
+  static const long longPressInterval = 700000;
+  //accelDivisor not tuned - no trace has an accelerated count to go by
+};
+
+#endif
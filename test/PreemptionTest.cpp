@@ -0,0 +1,242 @@
+/*
+  An interrupt at every preemption point of scan() and getPulseCount()
+
+  ROTARY_PREEMPTION_POINT() and ROTARY_MASKED_POINT() are defined here to count the
+  points a call passes, and to run an edge at the n'th - the encoder's handler, via
+  mockEdge(), 7us after the clock was last read. At a masked point interrupts are off
+  (the stub core tracks noInterrupts()), so the edge is held until interrupts(), as
+  the hardware would hold it.
+
+  Each trial sets up a state (idle after a click, in a click's debounce, idle, the
+  button held nearly long enough to be stuck), makes the call with one of the edges
+  (a click, a bounce, a press, a release) at one point, then plays the rest of the
+  gesture with scan() every 1ms. The outcome - position, pulses, presses, faults,
+  isActive() just after the call, a debounce still running at the end - has to be
+  the same as with the edge arriving just before the call, for every point and
+  config, and that outcome has to be right: the click counted once, the bounce not
+  at all, one press, no fault. The calls are made just before the clock's 1024us
+  tick rolls over, so the edge lands in the next tick.
+
+  This is the regression test for two races: getPulseCount() reading pulseCount and
+  clearing it as two steps (a click in between was lost), and scan() ending a
+  debounce an ISR had started after scan() read the clock (the edge time was later
+  than scan()'s now, and the unsigned difference wrapped to a long time ago).
+*/
+#include <stdlib.h>
+#include "Arduino.h"
+
+static int pointTarget = -1, pointsPassed = 0;
+static bool pointHeld = false;
+static void (*pointAction)() = NULL;
+
+static void firePoint() {
+  void (*action)() = pointAction;
+
+  pointAction = NULL;
+  if (action != NULL) action();
+}
+
+static void preemptionPoint() {
+  if (pointsPassed++ != pointTarget) return;
+  if (mockInterruptsOff) pointHeld = true;
+  else firePoint();
+}
+
+static void interruptsOn() {
+  if (!pointHeld) return;
+  pointHeld = false;
+  firePoint();
+}
+
+#define ROTARY_PREEMPTION_POINT() preemptionPoint()
+#define ROTARY_MASKED_POINT() preemptionPoint()
+#include "RotaryEncoder.hpp"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+struct OneState : RotaryEncoderConfig {
+  static const uint8_t statesPerDetent = 1;
+};
+
+struct Masked : RotaryEncoderConfig {
+  static const bool maskDuringDebounce = true;
+};
+
+enum Edge { CLICK, BOUNCE, PRESS, RELEASE };
+static const char *edgeNames[] = { "click", "bounce", "press", "release" };
+
+struct Outcome {
+  long position;
+  int pulses, shortPresses, longPresses, faults, stateMachine;
+  bool activeAfter, debounceLeft;
+
+  bool operator==(const Outcome &o) const {
+    return(position == o.position && pulses == o.pulses && shortPresses == o.shortPresses
+           && longPresses == o.longPresses && faults == o.faults && stateMachine == o.stateMachine
+           && activeAfter == o.activeAfter && debounceLeft == o.debounceLeft);
+  }
+};
+
+//The edge, 7us after the call read the clock. A click on A (rising - the click edge with 4
+//states, a step with 1), a bounce back and forth on A, the button going down or up
+static Edge edge;
+static void fireEdge() {
+  unsigned long when = mockMicros + 7;
+
+  switch (edge) {
+    case CLICK: mockEdge(2, HIGH, when); break;
+    case BOUNCE: mockEdge(2, LOW, when); mockEdge(2, HIGH, when + 2); break;
+    case PRESS: mockEdge(4, LOW, when); break;
+    case RELEASE: mockEdge(4, HIGH, when); break;
+  }
+}
+
+//scan() every 1ms from from to to
+template <class Encoder>
+static void scanning(Encoder &enc, unsigned long from, unsigned long to) {
+  for (unsigned long t = from; t <= to; t += 1000) {
+    mockMicros = t;
+    enc.scan();
+  }
+}
+
+//One trial - the edge at point (-1 for just before the call) of scan(), or of getPulseCount() if
+//pulseCall. Returns false if the call has fewer points
+template <class Config>
+static bool trial(Edge _edge, bool pulseCall, int point, Outcome &out) {
+  RotaryEncoder<2, 3, 4, Config> enc;
+  RotaryEvent ev;
+  unsigned long t = 1024 * 1000 - 3;  //Just before a tick
+  int pulses = 0;
+
+  mockReset();
+  mockInterruptsOn = interruptsOn;
+  mockPins[2] = mockPins[3] = LOW;
+  enc.begin(false);
+  out = Outcome();
+
+  //The state before the call - a full clockwise cycle 100ms ago (A rising is its click), then
+  //for a bounce the next click 2ms ago, or the button held for all but 2ms of stuckButtonInterval
+  mockEdge(2, HIGH, t - 100000);
+  mockEdge(3, HIGH, t - 90000);
+  mockEdge(2, LOW, t - 80000);
+  mockEdge(3, LOW, t - 70000);
+  scanning(enc, t - 69000, t - 10000);
+  if (_edge == BOUNCE) {
+    mockEdge(2, HIGH, t - 2000);
+    mockEdge(2, LOW, t - 1900);  //Bounces back and forth after the click
+    mockEdge(2, HIGH, t - 1800);
+  }
+  if (_edge == RELEASE) {
+    mockEdge(4, LOW, t - Config::stuckButtonInterval + 2000);
+    for (unsigned long s = t - Config::stuckButtonInterval + 52000; s < t; s += 50000) {
+      mockMicros = s;
+      enc.scan();
+    }
+  }
+  pulses += enc.getPulseCount();
+
+  //The call, with the edge at the point
+  edge = _edge;
+  pointAction = fireEdge;
+  pointTarget = point;
+  pointsPassed = 0;
+  pointHeld = false;
+  mockMicros = t;
+  if (point < 0) firePoint();
+  if (pulseCall) pulses += enc.getPulseCount();
+  else enc.scan();
+  pointTarget = -1;
+  if (pointAction != NULL) return(false);  //Not that many points
+  out.activeAfter = enc.isActive();
+
+  //The rest of the gesture - a bounce 1ms after a click or press, which must be ignored,
+  //and the button let go after 100ms
+  if (_edge == CLICK || _edge == BOUNCE) {
+    mockEdge(2, LOW, t + 1000);
+    mockEdge(2, HIGH, t + 1100);
+  }
+  if (_edge == PRESS) {
+    mockEdge(4, HIGH, t + 1000);
+    mockEdge(4, LOW, t + 1100);
+    mockEdge(4, HIGH, t + 100000);
+    mockEdge(4, LOW, t + 100100);
+    mockEdge(4, HIGH, t + 100200);
+  }
+  scanning(enc, t + 1000, t + 200000);
+
+  pulses += enc.getPulseCount();
+  out.position = enc.getPosition();
+  out.pulses = pulses;
+  while (enc.getEvent(ev)) {
+    if (ev.type == RotaryEvent::SHORT_PRESS) out.shortPresses++;
+    if (ev.type == RotaryEvent::LONG_PRESS) out.longPresses++;
+    if (ev.type == RotaryEvent::FAULT) out.faults++;
+  }
+  out.stateMachine = eventQueue.count;
+  out.debounceLeft = enc.flags & (enc.ROTARY_DEBOUNCE | enc.BUTTON_DEBOUNCE);
+  return(true);
+}
+
+//What the edge must come to when it arrives before the call. The full cycle before
+//counts one click, with 1 state per click four
+template <class Config>
+static bool expected(Edge edge, const Outcome &out) {
+  long before = Config::statesPerDetent == 1 ? 4 : 1;
+  long clicks = before + (edge == CLICK || edge == BOUNCE);
+
+  return(labs(out.position) == clicks && out.pulses == out.position && out.faults == 0
+         && out.shortPresses == (edge == PRESS) && out.longPresses == (edge == RELEASE)
+         && out.stateMachine == out.shortPresses + out.longPresses && out.activeAfter && !out.debounceLeft);
+}
+
+//Every edge at every point of the call, against the edge just before it
+template <class Config>
+static int check(const char *config, bool pulseCall) {
+  Outcome reference, out;
+  int points = 0, point;
+
+  for (int e = CLICK; e <= RELEASE; e++) {
+    if (pulseCall && e != CLICK) continue;
+    trial<Config>((Edge)e, pulseCall, -1, reference);
+    if (!expected<Config>((Edge)e, reference)) {
+      printf("%s %s before %s - position %ld pulses %d presses %d/%d faults %d active %d debounce %d\n", config,
+             edgeNames[e], pulseCall ? "getPulseCount()" : "scan()", reference.position, reference.pulses,
+             reference.shortPresses, reference.longPresses, reference.faults, reference.activeAfter,
+             reference.debounceLeft);
+      rotaryTestFailures++;
+    }
+    for (point = 0; trial<Config>((Edge)e, pulseCall, point, out); point++) {
+      if (!(out == reference)) {
+        printf("%s %s at point %d of %s - position %ld pulses %d presses %d/%d faults %d active %d debounce %d\n",
+               config, edgeNames[e], point, pulseCall ? "getPulseCount()" : "scan()", out.position, out.pulses,
+               out.shortPresses, out.longPresses, out.faults, out.activeAfter, out.debounceLeft);
+        rotaryTestFailures++;
+      }
+    }
+    points += point;
+  }
+  return(points);
+}
+
+void testScan() {
+  int points = check<RotaryEncoderConfig>("default", false);
+
+  printf("PreemptionTest - %d trials in scan(), %d points a call\n", points, points / 4);
+  CHECK(points / 4 >= 7);  //5 between the steps, 2 in its critical section
+  check<OneState>("1 state", false);
+  check<Masked>("masked", false);
+}
+
+void testGetPulseCount() {
+  CHECK_EQUAL(3, check<RotaryEncoderConfig>("default", true));
+  check<OneState>("1 state", true);
+}
+
+int main() {
+  RUN(testScan);
+  RUN(testGetPulseCount);
+  printf("PreemptionTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
@@ -0,0 +1,982 @@
+/*
+  Host tests for RotaryEncoder with the stub Arduino core
+  
+  Pins 2 and 3 are the rotary A and B, pin 4 the button (low when pressed). The
+  encoder rests with A and B low, and the tests drive the pins through the
+  quadrature sequence, calling the attached interrupt handlers as the hardware would.
+*/
+#include <stdlib.h>
+#include "Arduino.h"
+#include "RotaryEncoder.hpp"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+typedef RotaryEncoder<2, 3, 4> Encoder;
+
+// -- Helpers
+//A and B low at rest, button up
+static void restingPins() {
+  mockPins[2] = mockPins[3] = LOW;
+  mockPins[4] = HIGH;
+}
+
+//One click starting at when, each quarter of the quadrature cycle lasting quarter us
+//Clockwise 00 -> 10 -> 11 -> 01 -> 00, anticlockwise 00 -> 01 -> 11 -> 10 -> 00
+static void click(int direction, unsigned long when, unsigned long quarter = 10000) {
+  uint8_t first = direction > 0 ? 2 : 3, second = direction > 0 ? 3 : 2;
+
+  mockEdge(first, HIGH, when);
+  mockEdge(second, HIGH, when + quarter);
+  mockEdge(first, LOW, when + 2 * quarter);
+  mockEdge(second, LOW, when + 3 * quarter);
+}
+
+//Call scan() every period us up to until, as a main loop would
+static void scanUntil(Encoder &enc, unsigned long until, unsigned long period = 2000) {
+  while (mockMicros + period <= until) {
+    mockMicros += period;
+    enc.scan();
+  }
+}
+
+static void press(Encoder &enc, unsigned long when, unsigned long held) {
+  mockEdge(4, LOW, when);
+  scanUntil(enc, when + held);
+  mockEdge(4, HIGH, when + held);
+  scanUntil(enc, when + held + 50000);
+}
+
+// -- Tests
+void testBegin() {
+  Encoder enc;
+
+  restingPins();
+  enc.begin();
+  CHECK(mockIsr[2] != NULL);
+  CHECK_EQUAL(CHANGE, mockIsrMode[2]);   //4 states per click - A rising counts, A falling is debounced
+  CHECK(mockIsr[3] == NULL);
+  CHECK(mockIsr[4] != NULL);
+  CHECK_EQUAL(CHANGE, mockIsrMode[4]);
+  CHECK(!enc.isActive());
+  CHECK(!enc.isFaulted());
+  CHECK(!enc.eventPending());
+  CHECK_EQUAL(0, enc.getPulseCount());
+}
+
+void testClockwise() {
+  Encoder enc;
+  RotaryEvent ev = {};
+
+  restingPins();
+  enc.begin();
+  for (int i = 0; i < 3; i++) click(1, 100000 + i * 500000L);
+  CHECK_EQUAL(3, enc.getPulseCount());
+  CHECK_EQUAL(0, enc.getPulseCount());  //Cleared by the read
+  CHECK_EQUAL(3, enc.getPosition());
+  CHECK(enc.isActive());
+  for (int i = 0; i < 3; i++) {
+    CHECK(enc.getEvent(ev));
+    CHECK_EQUAL(RotaryEvent::ROTATION, ev.type);
+    CHECK_EQUAL(1, ev.delta);
+  }
+  CHECK(!enc.getEvent(ev));
+}
+
+void testAnticlockwise() {
+  Encoder enc;
+  RotaryEvent ev = {};
+
+  restingPins();
+  enc.begin();
+  for (int i = 0; i < 4; i++) click(1, 100000 + i * 500000L);
+  for (int i = 0; i < 2; i++) click(-1, 2100000 + i * 500000L);
+  CHECK_EQUAL(2, enc.getPulseCount());
+  CHECK_EQUAL(2, enc.getPosition());
+  for (int i = 0; i < 4; i++) enc.getEvent(ev);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(-1, ev.delta);
+}
+
+void testPulseCountClamp() {
+  Encoder enc;
+
+  restingPins();
+  enc.begin();
+  click(1, 100000);
+  for (int i = 0; i < 3; i++) click(-1, 600000 + i * 500000L);
+  CHECK_EQUAL(0, enc.getPulseCount());  //Stops at zero
+  CHECK_EQUAL(-2, enc.getPosition());   //The raw position doesn't
+  click(1, 2100000);
+  CHECK_EQUAL(1, enc.getPulseCount());
+}
+
+//Every second click ends a pulse, which adds 1 second / (accelDivisor * pulse time) extra
+void testAcceleration() {
+  Encoder enc;
+  long extra = 1000000L / (RotaryEncoderConfig::accelDivisor * 1024L) / (100000 / 1024);
+
+  restingPins();
+  enc.begin();
+  for (int i = 0; i < 4; i++) click(1, 100000 + i * 100000L, 5000);
+  CHECK_EQUAL(4 + 2 * extra, enc.getPulseCount());
+  CHECK_EQUAL(4, enc.getPosition());
+
+  //Turned slowly there is next to none
+  for (int i = 0; i < 4; i++) click(1, 1000000 + i * 500000L);
+  CHECK_EQUAL(4, enc.getPulseCount());
+}
+
+void testNoAcceleration() {
+  Encoder enc;
+
+  restingPins();
+  enc.begin(false);
+  for (int i = 0; i < 4; i++) click(1, 100000 + i * 100000L, 5000);
+  CHECK_EQUAL(4, enc.getPulseCount());
+}
+
+//A reversal restarts the acceleration - the click back isn't the end of a pulse
+void testReversalAcceleration() {
+  Encoder enc;
+  RotaryEvent ev = {};
+
+  restingPins();
+  enc.begin();
+  click(1, 100000, 5000);
+  click(-1, 130000, 5000);
+  CHECK_EQUAL(0, enc.getPosition());
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(1, ev.delta);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(-1, ev.delta);
+  CHECK(!enc.getEvent(ev));
+
+  //Carrying on the same way is a pulse again
+  click(-1, 160000, 5000);
+  CHECK(enc.getEvent(ev));
+  CHECK(ev.delta < -1);
+}
+
+//Walks RotaryHysteresis<clicks> through directions (+1/-1), returning what was counted
+template <uint8_t clicks>
+static int hysteresisWalk(const int *directions, int n, int *counted, int *reversals) {
+  typedef RotaryHysteresis<clicks> Hysteresis;
+  uint8_t state = Hysteresis::IDLE, next;
+  int total = 0;
+
+  *reversals = 0;
+  for (int i = 0; i < n; i++) {
+    next = Hysteresis::table[(state << 1) | (directions[i] > 0)];
+    state = next >> 3;
+    counted[i] = (next & Hysteresis::CW) ? 1 : (next & Hysteresis::CCW) ? -1 : 0;
+    total += counted[i];
+    if (next & Hysteresis::REVERSED) (*reversals)++;
+  }
+  return(total);
+}
+
+void testHysteresisTable() {
+  static const int turns[] = { 1, 1, -1, 1, -1, -1, -1, 1, 1, 1, 1 };
+  static const int none[] = { 1, 1, -1, 1, -1, -1, -1, 1, 1, 1, 1 };
+  static const int two[] = { 1, 1, 0, 0, 0, 0, -1, 0, 0, 1, 1 };
+  const int n = sizeof(turns) / sizeof(turns[0]);
+  int counted[n], reversals;
+
+  //No hysteresis counts every click, either way from IDLE
+  CHECK_EQUAL(3, hysteresisWalk<0>(turns, n, counted, &reversals));
+  CHECK(memcmp(counted, none, sizeof(none)) == 0);
+  CHECK_EQUAL(4, reversals);
+  CHECK_EQUAL(-1, hysteresisWalk<0>(turns + 2, 1, counted, &reversals));
+  CHECK_EQUAL(0, reversals);
+
+  //2 clicks of hysteresis - the third click back counts, jitter in between doesn't
+  CHECK_EQUAL(3, hysteresisWalk<2>(turns, n, counted, &reversals));
+  CHECK(memcmp(counted, two, sizeof(two)) == 0);
+  CHECK_EQUAL(2, reversals);
+
+  //6 is the most the state holds
+  static const int back[] = { 1, -1, -1, -1, -1, -1, -1, -1 };
+  CHECK_EQUAL(0, hysteresisWalk<6>(back, 8, counted, &reversals));
+  CHECK_EQUAL(-1, counted[7]);
+  CHECK_EQUAL(0, counted[6]);
+}
+
+struct HysteresisConfig : RotaryEncoderConfig {
+  static const uint8_t reversalHysteresis = 2;
+};
+
+void testHysteresis() {
+  RotaryEncoder<2, 3, 4, HysteresisConfig> enc;
+  static const int turns[] = { 1, 1, 1, -1, -1, 1, -1, -1, -1, 1 };
+  long t = 100000;
+
+  restingPins();
+  enc.begin();
+  for (int i = 0; i < 3; i++, t += 500000) click(turns[i], t);
+  CHECK_EQUAL(3, enc.getPosition());
+  for (int i = 3; i < 7; i++, t += 500000) click(turns[i], t);
+  CHECK_EQUAL(3, enc.getPosition());  //Jittering on the boundary counts nothing
+  click(turns[7], t);
+  CHECK_EQUAL(2, enc.getPosition());  //The third click back counts
+  click(turns[8], t + 500000);
+  CHECK_EQUAL(1, enc.getPosition());  //And the next one the same way
+  click(turns[9], t + 1000000);
+  CHECK_EQUAL(1, enc.getPosition());  //Back again is held
+}
+
+//The acceleration restarts at the reversal the table counts (REVERSED), not at jitter it holds
+//back. Clicks 60ms apart, so each is an event of its own
+void testHysteresisAccel() {
+  RotaryEncoder<2, 3, 4, HysteresisConfig> enc;
+  static const int turns[] = { 1, -1, 1, 1, -1, -1, -1, -1 };
+  RotaryEvent ev;
+  long t = 100000;
+
+  restingPins();
+  enc.begin();
+  for (int i = 0; i < 8; i++, t += 60000) click(turns[i], t);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(1, ev.delta);   //A pulse starts
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(2, ev.delta);   //and ends 180ms on, across the jitter - 1 + 1s / (3 * 175 ticks)
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(-1, ev.delta);  //The third click back counts, and starts a pulse again
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(-6, ev.delta);  //60ms on
+  CHECK(!enc.getEvent(ev));
+  CHECK_EQUAL(0, enc.getPosition());
+}
+
+void testDebounce() {
+  Encoder enc;
+
+  restingPins();
+  enc.begin(false);  //Clicks this close together would accelerate
+  //A bounces for 1ms as it rises - one click
+  mockEdge(2, HIGH, 100000);
+  for (int i = 1; i <= 3; i++) {
+    mockEdge(2, LOW, 100000 + i * 300 - 150);
+    mockEdge(2, HIGH, 100000 + i * 300);
+  }
+  scanUntil(enc, 110000);
+  mockEdge(3, HIGH, 110000);
+  mockEdge(2, LOW, 120000);
+  mockEdge(3, LOW, 130000);
+  CHECK_EQUAL(1, enc.getPulseCount());
+
+  //A second rising edge inside debounceInterval is ignored, even with no scan() in between
+  mockEdge(2, HIGH, 200000);
+  mockEdge(2, LOW, 202000);
+  mockEdge(2, HIGH, 204000);
+  mockEdge(3, HIGH, 205000);
+  mockEdge(2, LOW, 206000);
+  mockEdge(3, LOW, 207000);
+  CHECK_EQUAL(1, enc.getPulseCount());
+  //and one after it counts
+  click(1, 300000, 1000);
+  click(1, 300000 + 6000, 1000);
+  CHECK_EQUAL(2, enc.getPulseCount());
+  //as does one inside it after a full cycle - B has moved twice, so the knob turned on
+  click(1, 400000, 1000);
+  click(1, 400000 + 4000, 1000);
+  CHECK_EQUAL(2, enc.getPulseCount());
+}
+
+//An edge followed by count bounces back and forth, 100us apart
+static void bouncyEdge(uint8_t pin, uint8_t level, unsigned long when, int count) {
+  mockEdge(pin, level, when);
+  for (int i = 1; i <= count; i++) {
+    mockEdge(pin, !level, when + i * 200 - 100);
+    mockEdge(pin, level, when + i * 200);
+  }
+}
+
+//With 4 states per click A rising counts, and a bounce back up off A falling (part way
+//through the click) would read as the rising edge of a click back
+void testFallingBounce() {
+  Encoder enc;
+
+  restingPins();
+  enc.begin(false);
+  //One click clockwise, 20ms a quarter, A bouncing once as it falls
+  mockEdge(2, HIGH, 100000);
+  mockEdge(3, HIGH, 120000);
+  bouncyEdge(2, LOW, 140000, 1);
+  mockEdge(3, LOW, 160000);
+  scanUntil(enc, 200000);
+  CHECK_EQUAL(1, enc.getPosition());
+
+  //Anticlockwise A falls at the end of the click
+  mockEdge(3, HIGH, 300000);
+  mockEdge(2, HIGH, 320000);
+  mockEdge(3, LOW, 340000);
+  bouncyEdge(2, LOW, 360000, 1);
+  scanUntil(enc, 400000);
+  CHECK_EQUAL(0, enc.getPosition());
+
+  //Every edge of both pins bouncing for 1.2ms, 3 clicks each way
+  for (int i = 0; i < 6; i++) {
+    unsigned long when = 500000 + i * 80000;
+    uint8_t first = i < 3 ? 2 : 3, second = i < 3 ? 3 : 2;
+
+    bouncyEdge(first, HIGH, when, 6);
+    bouncyEdge(second, HIGH, when + 20000, 6);
+    bouncyEdge(first, LOW, when + 40000, 6);
+    bouncyEdge(second, LOW, when + 60000, 6);
+    scanUntil(enc, when + 80000);
+    CHECK_EQUAL(i < 3 ? i + 1 : 5 - i, enc.getPosition());
+  }
+
+  //Turning back just before the detent is a click back, once A falling's debounce is over
+  mockEdge(2, HIGH, 1100000);
+  mockEdge(3, HIGH, 1120000);
+  mockEdge(2, LOW, 1140000);
+  mockEdge(2, HIGH, 1160000);
+  mockEdge(3, LOW, 1180000);
+  mockEdge(2, LOW, 1200000);
+  scanUntil(enc, 1300000);
+  CHECK_EQUAL(0, enc.getPosition());
+
+  //A fast spin isn't held up - the next click counts inside A falling's debounce
+  for (int i = 0; i < 4; i++) click(1, 1400000 + i * 6000, 1500);
+  scanUntil(enc, 1500000);
+  CHECK_EQUAL(4, enc.getPosition());
+}
+
+//Each channel has its own debounce, so a press just after a click (or a click just
+//after a press) isn't taken for a bounce and lost
+void testDebounceChannels() {
+  Encoder enc;
+  RotaryEvent ev = {};
+
+  restingPins();
+  enc.begin(false);
+  click(1, 100000, 1000);
+  press(enc, 102000, 300000);            //2ms into the rotary debounce
+  CHECK_EQUAL(1, eventQueue.count);
+  CHECK_EQUAL(SHORTPRESS, eventQueue.last);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(RotaryEvent::ROTATION, ev.type);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(RotaryEvent::SHORT_PRESS, ev.type);
+
+  mockEdge(4, LOW, 600000);
+  click(1, 602000, 1000);                //2ms into the button debounce
+  scanUntil(enc, 700000);
+  mockEdge(4, HIGH, 700000);
+  scanUntil(enc, 750000);
+  CHECK_EQUAL(2, enc.getPulseCount());
+  CHECK_EQUAL(2, eventQueue.count);
+}
+
+void testShortPress() {
+  Encoder enc;
+  RotaryEvent ev = {};
+
+  restingPins();
+  enc.begin();
+  mockEdge(4, LOW, 100000);
+  mockEdge(4, HIGH, 100300);  //Bounces inside the debounce are ignored
+  mockEdge(4, LOW, 100600);
+  scanUntil(enc, 300000);
+  CHECK(enc.isActive());      //Held down
+  CHECK_EQUAL(0, eventQueue.count);
+  mockEdge(4, HIGH, 300000);
+  mockEdge(4, LOW, 300300);
+  mockEdge(4, HIGH, 300600);
+  scanUntil(enc, 350000);
+  CHECK_EQUAL(1, eventQueue.count);
+  CHECK_EQUAL(SHORTPRESS, eventQueue.last);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(RotaryEvent::SHORT_PRESS, ev.type);
+  CHECK(!enc.getEvent(ev));
+  CHECK_EQUAL(0, enc.getPulseCount());
+}
+
+void testLongPress() {
+  Encoder enc;
+  RotaryEvent ev = {};
+
+  restingPins();
+  enc.begin();
+  press(enc, 100000, RotaryEncoderConfig::longPressInterval + 100000);
+  CHECK_EQUAL(1, eventQueue.count);
+  CHECK_EQUAL(LONGPRESS, eventQueue.last);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(RotaryEvent::LONG_PRESS, ev.type);
+
+  //Just under the long press interval is still short
+  press(enc, 4000000, RotaryEncoderConfig::longPressInterval - 100000);
+  CHECK_EQUAL(2, eventQueue.count);
+  CHECK_EQUAL(SHORTPRESS, eventQueue.last);
+}
+
+void testActivityTimeout() {
+  Encoder enc;
+
+  restingPins();
+  enc.begin();
+  click(1, 100000);
+  CHECK(enc.isActive());
+  scanUntil(enc, 100000 + RotaryEncoderConfig::activityTimeout - 500000, 50000);
+  CHECK(enc.isActive());
+  scanUntil(enc, 100000 + RotaryEncoderConfig::activityTimeout + 500000, 50000);
+  CHECK(!enc.isActive());
+
+  //A held button keeps it active past the timeout
+  mockEdge(4, LOW, 11000000);
+  scanUntil(enc, 11000000 + RotaryEncoderConfig::activityTimeout + 2000000, 50000);
+  CHECK(enc.isActive());
+  mockEdge(4, HIGH, mockMicros);
+  scanUntil(enc, mockMicros + RotaryEncoderConfig::activityTimeout + 500000, 50000);
+  CHECK(!enc.isActive());
+}
+
+void testDumpState() {
+  Encoder enc;
+
+  restingPins();
+  enc.begin();
+  enc.dumpState();
+  CHECK(strstr(mockSerial, "active: 0,") != NULL);
+  CHECK(strstr(mockSerial, "inDebounceDelay: 0,") != NULL);
+  mockSerial[0] = 0;
+  mockEdge(4, LOW, 100000);
+  enc.dumpState();
+  CHECK(strstr(mockSerial, "active: 1,") != NULL);
+  CHECK(strstr(mockSerial, "inDebounceDelay: 1,") != NULL);
+  CHECK(strstr(mockSerial, "buttonDown: 1,") != NULL);
+  CHECK(strstr(mockSerial, "pendingPress: 0") != NULL);
+  CHECK(strchr(mockSerial, '\n') != NULL);
+}
+
+//Clicks at a steady rate for a few seconds, scan() every tick. The estimates ripple
+//within each click so they are averaged over the last second. Velocity is per second
+//and the prediction is "ahead" micros on, whatever units the filter keeps internally
+static void steadySpin(Encoder &enc, int direction, long interval, long ahead, long &velocity, long &predicted) {
+  unsigned long next = mockMicros, until = mockMicros + 3000000;
+  long n = 0;
+
+  velocity = predicted = 0;
+  while (mockMicros < until) {
+    if (mockMicros >= next) {
+      enc.injectClick(direction, mockMicros);
+      next += interval;
+    }
+    mockMicros += 1024;
+    enc.scan();
+    if (mockMicros + 1000000 >= until) {
+      velocity += enc.getVelocity();
+      predicted += enc.getPredictedPosition(ahead) - enc.getSmoothedPosition();
+      n++;
+    }
+  }
+  velocity /= n;
+  predicted /= n;
+}
+
+void testFilter() {
+  Encoder enc;
+  long velocity, ahead;
+
+  restingPins();
+  enc.begin(false);
+  mockMicros = 100000;
+  steadySpin(enc, 1, 10000, 100000, velocity, ahead);   //100 clicks a second
+  CHECK(velocity > 100 * 256 * 9 / 10 && velocity < 100 * 256 * 11 / 10);
+  CHECK(ahead > 10 * 256 * 9 / 10 && ahead < 10 * 256 * 11 / 10);  //10 clicks in 100ms
+  CHECK(labs(enc.getSmoothedPosition() - enc.getPosition() * 256) < 2 * 256);
+
+  steadySpin(enc, -1, 20000, 200000, velocity, ahead);  //50 a second back, the residual goes negative
+  CHECK(velocity < -50 * 256 * 9 / 10 && velocity > -50 * 256 * 11 / 10);
+  CHECK(ahead < -10 * 256 * 9 / 10 && ahead > -10 * 256 * 11 / 10);
+
+  scanUntil(enc, mockMicros + 200000, 1024);           //Stopped - settles on the position, exactly
+  CHECK_EQUAL(0, enc.getVelocity());
+  CHECK_EQUAL(enc.getPosition() * 256, enc.getSmoothedPosition());
+
+  enc.filterVel = 65536;                                //Gone inactive mid-spin - the filter isn't run
+  mockMicros += RotaryEncoderConfig::activityTimeout + 2048;  //while inactive, so it is reset
+  enc.scan();
+  CHECK(!enc.isActive());
+  CHECK_EQUAL(0, enc.getVelocity());
+  CHECK_EQUAL(enc.getPosition() * 256, enc.getSmoothedPosition());
+
+  enc.filterVel = 65536;                                //1 click a tick of 1024us, exactly
+  CHECK_EQUAL(250000, enc.getVelocity());               //976.5625 clicks a second
+  CHECK_EQUAL(256000, enc.getPredictedPosition(1024000) - enc.getSmoothedPosition());
+  enc.filterVel = -65536;
+  CHECK_EQUAL(-250000, enc.getVelocity());
+}
+
+//Latency histograms on, for a knob on its own pins
+struct LatencyConfig : RotaryEncoderConfig {
+  static const bool latencyStats = true;
+  static const uint16_t ramBudget = 220;
+};
+
+//A wait of 65ms or more must land in the last bucket, not wrap round the 16 bit micros
+void testLatencyStats() {
+  RotaryEncoder<8, 9, 10, LatencyConfig> enc;
+  const uint16_t *consume, *forward;
+  RotaryEvent ev[4] = {};
+
+  mockPins[8] = mockPins[9] = LOW;
+  enc.begin(false);
+  consume = enc.getLatencyHistogram(enc.EDGE_TO_CONSUME);
+  forward = enc.getLatencyHistogram(enc.EDGE_TO_FORWARD);
+
+  enc.injectClick(1, 100000);
+  mockMicros = 105000;                   //5ms - bucket 13 is 4096-8191us
+  CHECK(enc.getEvent(ev[0]));
+  CHECK_EQUAL(1, consume[13]);
+  enc.injectClick(1, 200000);
+  mockMicros = 270000;                   //70ms, 4464us once wrapped
+  CHECK(enc.getEvent(ev[0]));
+  CHECK_EQUAL(1, consume[13]);
+  CHECK_EQUAL(1, consume[15]);
+
+  enc.injectClick(1, 1000000);           //drain() - a click 200ms old and a press released 1us ago
+  enc.injectButton(true, 1100000);
+  enc.injectButton(false, 1200000);
+  mockMicros = 1200001;
+  CHECK_EQUAL(2, enc.drain(ev, 4));
+  CHECK_EQUAL(2, consume[15]);
+  CHECK_EQUAL(1, consume[1]);
+
+  mockMicros = 1270000;                  //Release forwarded 70ms late
+  enc.scan();
+  CHECK_EQUAL(1, eventQueue.count);
+  CHECK_EQUAL(1, forward[15]);
+  CHECK_EQUAL(0, forward[13]);
+}
+
+//A queue that needs more than 255 bytes of ramBudget
+struct BigQueue : RotaryEncoderConfig {
+  static const uint8_t eventQueueSize = 32;
+  static const uint16_t ramBudget = 320;
+};
+
+void testLargeQueue() {
+  RotaryEncoder<5, 6, 7, BigQueue> enc;
+  RotaryEvent ev = {};
+  int i;
+
+  enc.begin(false);
+  CHECK(sizeof(enc) > 255);
+  for (i = 0; i < 40; i++) enc.injectClick(i & 1 ? 1 : -1, 100000L * (i + 1));
+  for (i = 0; enc.getEvent(ev); i++);
+  CHECK_EQUAL(32, i);
+}
+
+//Steps in the same direction within coalesceInterval of the event's first step are merged
+//into it, until a change of direction, a button event or the application taking it
+void testCoalesce() {
+  Encoder enc;
+  RotaryEvent ev = {};
+
+  restingPins();
+  enc.begin(false);
+  enc.injectClick(1, 100000);
+  enc.injectClick(1, 110000);
+  enc.injectClick(1, 120000);
+  enc.injectClick(-1, 130000);           //Reversed - a new event
+  enc.injectClick(-1, 140000);
+  enc.injectButton(true, 150000);
+  enc.injectButton(false, 160000);
+  enc.injectClick(-1, 170000);           //Not merged back across the press
+  enc.injectClick(-1, 220000);           //50ms after the event started - a new one
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(RotaryEvent::ROTATION, ev.type);
+  CHECK_EQUAL(3, ev.delta);
+  CHECK_EQUAL((uint16_t)100000, ev.start);
+  CHECK_EQUAL(20000, ev.duration);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(-2, ev.delta);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(RotaryEvent::SHORT_PRESS, ev.type);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(-1, ev.delta);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(-1, ev.delta);
+  CHECK(!enc.getEvent(ev));
+
+  enc.injectClick(1, 300000);            //Taken before the next step - nothing to merge into
+  CHECK(enc.getEvent(ev));
+  enc.injectClick(1, 305000);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(1, ev.delta);
+  CHECK_EQUAL(0, ev.duration);
+}
+
+//The event start is 16 bits of micros() and wraps every 65.5ms, so a step that lands
+//inside the window once wrapped must not be merged
+void testCoalesceWrap() {
+  Encoder enc;
+  RotaryEvent ev = {};
+
+  restingPins();
+  enc.begin(false);
+  enc.injectClick(1, 100000);
+  enc.injectClick(1, 100000 + 65536 + 1000);  //1ms once wrapped, 65 ticks after the last step
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(1, ev.delta);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(1, ev.delta);
+
+  enc.injectClick(1, 400000);
+  enc.injectClick(1, 440000);                 //Merged, 40ms long
+  enc.injectClick(1, 400000 + 65536 + 20000); //45 ticks on, but 20ms once wrapped - before the last step
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(2, ev.delta);
+  CHECK_EQUAL(40000, ev.duration);
+  CHECK(enc.getEvent(ev));
+  CHECK_EQUAL(1, ev.delta);
+  CHECK(!enc.getEvent(ev));
+}
+
+struct NoCoalesce : RotaryEncoderConfig {
+  static const long coalesceInterval = 0;
+};
+
+//Events an application polling every period us takes from a spin of clicks interval us apart
+template <class Config>
+static int spinEvents(int clicks, unsigned long interval, unsigned long period) {
+  RotaryEncoder<2, 3, 4, Config> enc;
+  RotaryEvent ev[8] = {};
+  unsigned long t, next = interval;
+  int events = 0, delta = 0, n;
+
+  restingPins();
+  enc.begin(false);
+  for (t = 0; t <= clicks * interval + period; t += 1000) {
+    if (t == next && t <= clicks * interval) {
+      enc.injectClick(1, 100000 + t);
+      next += interval;
+    }
+    if (t % period == 0)
+      for (mockMicros = 100000 + t; (n = enc.drain(ev, 8)) > 0; events += n)
+        for (int i = 0; i < n; i++) delta += ev[i].delta;
+  }
+  CHECK_EQUAL(clicks, delta);
+  CHECK_EQUAL(0, enc.getDroppedEvents());
+  return(events);
+}
+
+//A fast spin wakes the application once per poll rather than once per click
+void testCoalesceWakeups() {
+  int merged = spinEvents<RotaryEncoderConfig>(40, 5000, 25000);
+  int single = spinEvents<NoCoalesce>(40, 5000, 25000);
+
+  printf("RotaryEncoderTest - 40 clicks 5ms apart, polled every 25ms: %d events merged, %d not\n",
+         merged, single);
+  CHECK_EQUAL(40, single);
+  CHECK_EQUAL(8, merged);
+}
+
+//A full queue drops the newest event and says so - the clicks are still counted
+void testQueueFull() {
+  Encoder enc;
+  RotaryEvent ev = {};
+  int i;
+
+  restingPins();
+  enc.begin(false);
+  for (i = 0; i < 10; i++) enc.injectClick(1, 100000 + 100000L * i);  //Too far apart to merge
+  CHECK_EQUAL(2, enc.getDroppedEvents());
+  CHECK_EQUAL(0, enc.getDroppedEvents());  //Cleared by the read
+  CHECK_EQUAL(10, enc.getPulseCount());
+  CHECK_EQUAL(10, enc.getPosition());
+  for (i = 0; enc.getEvent(ev); i++);
+  CHECK_EQUAL(RotaryEncoderConfig::eventQueueSize, i);
+  enc.injectClick(1, 2000000);
+  CHECK_EQUAL(0, enc.getDroppedEvents());
+}
+
+// -- Health monitor
+//Toggle pin every 50us from when, leaving it at its resting level
+static void chatter(uint8_t pin, unsigned long when, int edges, uint8_t rest) {
+  for (int i = 0; i < edges; i++) mockEdge(pin, (i & 1) ? rest : !rest, when + 50 * i);
+  mockEdge(pin, rest, when + 50 * edges);
+}
+
+//One click with scan() running between the edges, as it would while polling
+static void polledClick(Encoder &enc, int direction, unsigned long when, unsigned long quarter = 10000) {
+  uint8_t first = direction > 0 ? 2 : 3, second = direction > 0 ? 3 : 2;
+
+  scanUntil(enc, when);
+  mockEdge(first, HIGH, when);
+  scanUntil(enc, when + quarter);
+  mockEdge(second, HIGH, when + quarter);
+  scanUntil(enc, when + 2 * quarter);
+  mockEdge(first, LOW, when + 2 * quarter);
+  scanUntil(enc, when + 3 * quarter);
+  mockEdge(second, LOW, when + 3 * quarter);
+  scanUntil(enc, when + 4 * quarter);
+}
+
+template <class Knob>
+static bool nextFault(Knob &enc, int code) {
+  RotaryEvent ev = {};
+
+  while (enc.getEvent(ev))
+    if (ev.type == RotaryEvent::FAULT) return(ev.delta == code);
+  return(false);
+}
+
+//More than stormEdges interrupts in 64ms detaches them all
+void testStormFault() {
+  Encoder enc;
+
+  restingPins();
+  enc.begin();
+  chatter(2, 100000, 600, LOW);  //600 interrupts in 30ms
+  CHECK(enc.isFaulted());
+  CHECK(enc.isActive());
+  CHECK(mockIsr[2] == NULL);
+  CHECK(mockIsr[4] == NULL);
+  CHECK(nextFault(enc, RotaryEvent::EDGE_STORM));
+  CHECK(!enc.eventPending());       //Just the one
+
+  //Button chatter is a storm too
+  RotaryEncoder<5, 6, 7> other;
+  mockPins[5] = mockPins[6] = LOW;
+  mockPins[7] = HIGH;
+  other.begin();
+  chatter(7, 300000, 250, HIGH);
+  CHECK(other.isFaulted());
+  CHECK(mockIsr[7] == NULL);
+  CHECK(nextFault(other, RotaryEvent::EDGE_STORM));
+  CHECK_EQUAL(0, eventQueue.count); //No press from a faulty button
+
+  //Just under the threshold, with the window restarting every 64ms, isn't
+  RotaryEncoder<8, 9, 10> steady;
+  mockPins[8] = mockPins[9] = LOW;
+  mockPins[10] = HIGH;
+  steady.begin();
+  for (int window = 0; window < 4; window++) chatter(8, 1000000 + window * 70000L, 190, LOW);
+  CHECK(!steady.isFaulted());
+  CHECK(mockIsr[8] != NULL);
+}
+
+//While faulted scan() counts clicks and presses itself, then re-arms once the lines are still
+void testPollWhileFaulted() {
+  Encoder enc;
+  RotaryEvent ev = {};
+  long position;
+
+  restingPins();
+  enc.begin();
+  chatter(2, 100000, 600, LOW);
+  CHECK(nextFault(enc, RotaryEvent::EDGE_STORM));
+  position = enc.getPosition();       //The storm counted as a few clicks before it tripped
+
+  for (int i = 0; i < 3; i++) polledClick(enc, 1, 200000 + i * 100000L);
+  polledClick(enc, -1, 500000);
+  CHECK_EQUAL(position + 2, enc.getPosition());
+  CHECK(enc.isFaulted());             //Still moving within rearmInterval
+  mockEdge(4, LOW, 600000);
+  scanUntil(enc, 700000);
+  mockEdge(4, HIGH, 700000);
+  scanUntil(enc, 710000);
+  CHECK_EQUAL(1, eventQueue.count);
+  CHECK_EQUAL(SHORTPRESS, eventQueue.last);
+
+  //Still for rearmInterval - the interrupts are back
+  scanUntil(enc, 700000 + RotaryEncoderConfig::rearmInterval - 10000);
+  CHECK(enc.isFaulted());
+  CHECK(mockIsr[2] == NULL);
+  scanUntil(enc, 700000 + RotaryEncoderConfig::rearmInterval + 10000);
+  CHECK(!enc.isFaulted());
+  CHECK(mockIsr[2] != NULL);
+  CHECK(mockIsr[4] != NULL);
+  for (int i = 0; i < 4; i++) CHECK(enc.getEvent(ev) && ev.type == RotaryEvent::ROTATION);
+  CHECK(enc.getEvent(ev) && ev.type == RotaryEvent::SHORT_PRESS);
+  CHECK(nextFault(enc, RotaryEvent::FAULT_CLEARED));
+
+  click(1, 2000000);                  //Counted by the interrupt handler again
+  CHECK_EQUAL(position + 3, enc.getPosition());
+}
+
+//A chattering line that never settles stays faulted, and polling ignores the noise
+void testNoisyFault() {
+  Encoder enc;
+  long position;
+
+  restingPins();
+  enc.begin();
+  chatter(2, 100000, 600, LOW);
+  position = enc.getPosition();
+  for (unsigned long t = 200000; t < 2000000; t += 1500) {
+    mockEdge(2, (t / 1500) & 1, t);   //Changes between every scan
+    scanUntil(enc, t + 1000, 1000);
+  }
+  mockEdge(2, LOW, 2000000);
+  CHECK(enc.isFaulted());
+  CHECK_EQUAL(position, enc.getPosition());
+}
+
+//Held for 35s with scan() only called while isActive(), as a sketch that sleeps would:
+//STUCK_BUTTON after 30s, no press on release, then re-armed and idle as normal
+void testStuckButton() {
+  Encoder enc;
+  unsigned long t, faultedAt = 0, clearedAt = 0;
+
+  restingPins();
+  enc.begin();
+  mockEdge(4, LOW, 100000);
+  for (t = 110000; t < 50000000; t += 10000) {
+    if (t == 35100000) mockEdge(4, HIGH, t);
+    mockMicros = t;
+    if (enc.isActive()) enc.scan();
+    if (!faultedAt && enc.isFaulted()) faultedAt = t;
+    if (faultedAt && !clearedAt && !enc.isFaulted()) clearedAt = t;
+  }
+  CHECK(faultedAt >= 100000 + RotaryEncoderConfig::stuckButtonInterval);
+  CHECK(faultedAt < 100000 + RotaryEncoderConfig::stuckButtonInterval + 100000);
+  CHECK(clearedAt >= 35100000 + RotaryEncoderConfig::rearmInterval);
+  CHECK(clearedAt < 35100000 + RotaryEncoderConfig::rearmInterval + 100000);
+  CHECK(nextFault(enc, RotaryEvent::STUCK_BUTTON));
+  CHECK(nextFault(enc, RotaryEvent::FAULT_CLEARED));
+  CHECK(!enc.eventPending());
+  CHECK_EQUAL(0, eventQueue.count);   //Not a long press
+  CHECK(mockIsr[2] != NULL);
+  CHECK(mockIsr[4] != NULL);
+  CHECK(!enc.isActive());             //Timed out after the re-arm
+
+  press(enc, 50000000, 200000);       //And the button works again
+  CHECK_EQUAL(SHORTPRESS, eventQueue.last);
+}
+
+// -- Masking the interrupts for the debounce
+struct Masked : RotaryEncoderConfig {
+  static const bool maskDuringDebounce = true;
+};
+
+struct OneState : RotaryEncoderConfig {
+  static const uint8_t statesPerDetent = 1;
+};
+
+struct OneStateMasked : OneState {
+  static const bool maskDuringDebounce = true;
+};
+
+struct MaskResult {
+  long interrupts, position;
+  RotaryEvent events[8];
+  size_t count;
+  long presses;
+};
+
+//Quadrature cycles 40ms long (each state 10ms, over the debounce even with 1 state per
+//click) then 4 presses, every edge followed by 3 bounce pairs 100us apart and scan()
+//every 1ms. Counts the handler calls the stub core makes
+template <class Config>
+static MaskResult bounceTrace(int cycles) {
+  static const uint8_t gray[4] = { 0, 2, 3, 1 };
+  RotaryEncoder<2, 3, 4, Config> enc;
+  MaskResult result = {};
+  unsigned long t = 100000;
+  uint8_t pin, level, mode;
+
+  mockReset();
+  restingPins();
+  enc.begin();
+  for (int edge = 0; edge < cycles * 4 + 8; edge++, t += 10000) {
+    if (edge < cycles * 4) {
+      uint8_t from = gray[edge & 3], to = gray[(edge + 1) & 3];
+      pin = ((from ^ to) & 2) ? 2 : 3;
+      level = ((to >> (pin == 2 ? 1 : 0)) & 1);
+    } else {
+      pin = 4;
+      level = edge & 1;
+    }
+    for (int i = 0; i < 7; i++) {  //The edge, then bounces back and forth ending at level
+      uint8_t now = (i & 1) ? !level : level;
+      mode = mockIsrMode[pin];
+      if ( mockIsr[pin] != NULL && mockPins[pin] != now
+           && (mode == CHANGE || (mode == RISING && now) || (mode == FALLING && !now)) )
+        result.interrupts++;
+      mockEdge(pin, now, t + i * 100);
+    }
+    while (mockMicros + 1000 <= t + 10000) {
+      mockMicros += 1000;
+      enc.scan();
+    }
+  }
+  result.position = enc.getPosition();
+  result.count = enc.drain(result.events, 8);
+  result.presses = eventQueue.count;
+  return(result);
+}
+
+static bool sameEvents(const MaskResult &a, const MaskResult &b) {
+  if (a.count != b.count) return(false);
+  for (size_t i = 0; i < a.count; i++)
+    if (a.events[i].type != b.events[i].type || a.events[i].delta != b.events[i].delta) return(false);
+  return(true);
+}
+
+//One interrupt per bouncy edge that ends a click (or per button edge), the same result
+void testMaskDuringDebounce() {
+  const int cycles = 50;
+  MaskResult plain = bounceTrace<RotaryEncoderConfig>(cycles), masked = bounceTrace<Masked>(cycles);
+  MaskResult plain1 = bounceTrace<OneState>(cycles), masked1 = bounceTrace<OneStateMasked>(cycles);
+
+  //4 states per click: all 7 changes of both edges of A (A falling starts a debounce too),
+  //against one each. The 8 button edges take all 7 changes each unmasked, 1 masked
+  CHECK_EQUAL(cycles * 14 + 8 * 7, plain.interrupts);
+  CHECK_EQUAL(cycles * 2 + 8, masked.interrupts);
+  CHECK_EQUAL(plain.position, masked.position);
+  CHECK_EQUAL(cycles, masked.position);
+  CHECK(sameEvents(plain, masked));
+  CHECK_EQUAL(plain.presses, masked.presses);
+  CHECK_EQUAL(4, masked.presses);
+
+  //1 state per click: all 7 changes of every edge, against one per click
+  CHECK_EQUAL(cycles * 28 + 8 * 7, plain1.interrupts);
+  CHECK_EQUAL(cycles * 4 + 8, masked1.interrupts);
+  CHECK_EQUAL(plain1.position, masked1.position);
+  CHECK_EQUAL(cycles * 4, masked1.position);
+  CHECK(sameEvents(plain1, masked1));
+  CHECK_EQUAL(4, masked1.presses);
+  printf("RotaryEncoderTest - interrupts per bouncy quadrature cycle: 4 states per click %.1f, masked %.1f;"
+         " 1 state per click %.1f, masked %.1f\n", (plain.interrupts - 56) / (double)cycles,
+         (masked.interrupts - 8) / (double)cycles, (plain1.interrupts - 56) / (double)cycles,
+         (masked1.interrupts - 8) / (double)cycles);
+}
+
+int main() {
+  RUN(testBegin);
+  RUN(testClockwise);
+  RUN(testAnticlockwise);
+  RUN(testPulseCountClamp);
+  RUN(testAcceleration);
+  RUN(testNoAcceleration);
+  RUN(testReversalAcceleration);
+  RUN(testHysteresisTable);
+  RUN(testHysteresis);
+  RUN(testHysteresisAccel);
+  RUN(testDebounce);
+  RUN(testFallingBounce);
+  RUN(testDebounceChannels);
+  RUN(testShortPress);
+  RUN(testLongPress);
+  RUN(testActivityTimeout);
+  RUN(testDumpState);
+  RUN(testFilter);
+  RUN(testLatencyStats);
+  RUN(testLargeQueue);
+  RUN(testCoalesce);
+  RUN(testCoalesceWrap);
+  RUN(testCoalesceWakeups);
+  RUN(testQueueFull);
+  RUN(testStormFault);
+  RUN(testPollWhileFaulted);
+  RUN(testNoisyFault);
+  RUN(testStuckButton);
+  RUN(testMaskDuringDebounce);
+  printf("RotaryEncoderTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
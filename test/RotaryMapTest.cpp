@@ -0,0 +1,127 @@
+/*
+  Host tests for the control curves in RotaryMap.hpp
+
+  The compile time exp() and ln() are checked against <cmath> over the range the
+  tables use, and every point of a few tables must be within 0.5 of the exact curve
+  (the rounding to an integer). rotaryInterpolate() must hit the table points
+  exactly, clamp outside 0..inputMax, stay between neighbouring points, never go
+  backwards on a rising curve and not overflow its 32 bit arithmetic at the largest
+  inputMax and range. The tables are read through rotaryReadPoint(), as on AVR where
+  they are in PROGMEM.
+*/
+#include <math.h>
+#include "Arduino.h"
+#include "RotaryMap.hpp"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+typedef RotaryExpMap<100, 20, 20000> Frequency;
+typedef RotaryLogMap<64, 0, 255, 50> Brightness;
+typedef RotaryExpMap<1000, 1, 65535, 64> Wide;
+typedef RotaryPointMap<40, 0, 10, 30, 100, 1000> Custom;
+typedef RotaryPointMap<32767, 0, 65535> Full;
+
+// -- Helpers
+static bool within(double expected, double actual, double tolerance) {
+  return(fabs(expected - actual) <= tolerance);
+}
+
+//Every point of a table against the exact curve
+template <size_t n>
+static void checkPoints(const uint16_t (&table)[n], double (*exact)(unsigned, unsigned), const char *name) {
+  for (unsigned i = 0; i < n; i++)
+    if (!within(exact(i, n - 1), rotaryReadPoint(&table[i]), 0.5)) {
+      printf("%s point %u is %u, exact %f\n", name, i, rotaryReadPoint(&table[i]), exact(i, n - 1));
+      rotaryTestFailures++;
+    }
+}
+
+static double frequency(unsigned i, unsigned n) {
+  return(20 * pow(20000.0 / 20, (double)i / n));
+}
+
+static double brightness(unsigned i, unsigned n) {
+  return(255 * log(1 + 49.0 * i / n) / log(50.0));
+}
+
+static double wide(unsigned i, unsigned n) {
+  return(pow(65535.0, (double)i / n));
+}
+
+// -- Tests
+void testMaths() {
+  for (double x = -12; x <= 12; x += 0.37)
+    CHECK(within(exp(x), rotaryExp(x), exp(x) * 1e-12));
+  for (double y = 1e-4; y < 70000; y *= 1.7)
+    CHECK(within(log(y), rotaryLn(y), 1e-12));
+  CHECK_EQUAL(0, rotaryRound(-3));
+  CHECK_EQUAL(65535, rotaryRound(1e9));
+  CHECK_EQUAL(3, rotaryRound(2.5));
+}
+
+void testPoints() {
+  checkPoints(Frequency::table, frequency, "Frequency");
+  checkPoints(Brightness::table, brightness, "Brightness");
+  checkPoints(Wide::table, wide, "Wide");
+  CHECK_EQUAL(17, sizeof(Frequency::table) / sizeof(uint16_t));
+  CHECK_EQUAL(65, sizeof(Wide::table) / sizeof(uint16_t));
+}
+
+void testEnds() {
+  CHECK_EQUAL(20, Frequency::map(0));
+  CHECK_EQUAL(20000, Frequency::map(100));
+  CHECK_EQUAL(20, Frequency::map(-1));        //Clamped
+  CHECK_EQUAL(20, Frequency::map(-100000));
+  CHECK_EQUAL(20000, Frequency::map(101));
+  CHECK_EQUAL(20000, Frequency::map(1L << 30));
+  CHECK_EQUAL(0, Brightness::map(0));
+  CHECK_EQUAL(255, Brightness::map(64));
+  CHECK_EQUAL(1000, Custom::map(40));
+  CHECK_EQUAL(0, Custom::map(-5));
+}
+
+//Custom has points every 10 positions - exact there, straight lines between
+void testInterpolation() {
+  static const uint16_t points[5] = { 0, 10, 30, 100, 1000 };
+  long position;
+
+  for (int i = 0; i < 5; i++) CHECK_EQUAL(points[i], Custom::map(i * 10));
+  CHECK_EQUAL(5, Custom::map(5));
+  CHECK_EQUAL(20, Custom::map(15));
+  CHECK_EQUAL(37, Custom::map(21));            //30 + 70 * 1 / 10
+  CHECK_EQUAL(910, Custom::map(39));           //100 + 900 * 9 / 10
+  for (position = 0; position < 40; position++) {
+    uint16_t lo = points[position / 10], hi = points[position / 10 + 1];
+    CHECK(Custom::map(position) >= lo && Custom::map(position) <= hi);
+    CHECK(Custom::map(position + 1) >= Custom::map(position));
+  }
+
+  //Points that don't divide inputMax evenly - 16 segments over 100 positions. Between
+  //points the chord of a 1.54:1 segment is up to 2.4% off the curve
+  for (position = 0; position < 100; position++)
+    CHECK(Frequency::map(position + 1) >= Frequency::map(position));
+  for (position = 0; position <= 100; position++)
+    CHECK(within(frequency(position, 100), Frequency::map(position), frequency(position, 100) * 0.025 + 1));
+  for (position = 0; position < 64; position++)
+    CHECK(Brightness::map(position + 1) >= Brightness::map(position));
+}
+
+//The largest span times the largest offset only just fits in 32 bits (as long is on AVR).
+//The division truncates, so 65535 * 32766 / 32767 = 65532.99 is 65532
+void testOverflow() {
+  CHECK_EQUAL(65532, Full::map(32766));
+  CHECK_EQUAL(32766, Full::map(16383));
+  CHECK_EQUAL(2, Full::map(1));
+  CHECK((int64_t)65535 * 32766 <= INT32_MAX);
+}
+
+int main() {
+  RUN(testMaths);
+  RUN(testPoints);
+  RUN(testEnds);
+  RUN(testInterpolation);
+  RUN(testOverflow);
+  printf("RotaryMapTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
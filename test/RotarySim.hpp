@@ -0,0 +1,355 @@
+#ifndef RotarySim_hpp
+#define RotarySim_hpp
+/*
+  Discrete event simulator of several encoders sharing one MCU, in virtual time
+
+  Each encoder is a real RotaryEncoder on its own pins of the stub core, turned and
+  pressed by a scripted hand: idle spells, turns of a few clicks at varying speed and
+  presses short and long, every edge of the knob and the button bouncing. The hand keeps the ground truth - the
+  clicks turned and the presses made - to check what the application got against.
+
+  The MCU is modelled as the main loop, a TaskScheduler style runner going through
+  its tasks (a scan() task per encoder, the application draining the event queues,
+  and any others, e.g. a display refresh with interrupts off), and the interrupts.
+  A pin change that matches the attached mode sets the pin's interrupt pending, as
+  the hardware flag would - a second change before the handler runs is not a second
+  interrupt, and the handler reads the pins as they are when it runs. It runs
+  isrLatency after the change, once interrupts are on (not in another handler or a
+  task that turns them off), takes isrCost of CPU and holds up the task it
+  preempted by as much. Tasks take their cost from when they start. The code itself
+  runs at the start of each handler or task with mockMicros set to that time, so a
+  task's code doesn't see the handlers that preempt it (see ROTARY_PREEMPTION_POINT()
+  for handlers landing inside scan()).
+
+  Nothing is kept per edge, so hours of simulated knob twiddling run in seconds:
+
+    RotarySim sim(RotarySimCosts(), 1);       //Default costs, seed 1
+    sim.addEncoders<RotaryEncoderConfig>(4, 10000);  //4 encoders, scan() every 10ms
+    sim.addTask(100000, 3000, true);          //A 3ms display refresh with interrupts off every 100ms
+    RotarySimReport report = sim.run(3600000000UL);  //An hour
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <queue>
+#include <vector>
+#include <chrono>
+#include "Arduino.h"
+#include "RotaryEncoder.hpp"
+
+// -- What the MCU spends, in microseconds (the defaults are about an ATmega328P at 16MHz)
+struct RotarySimCosts {
+  unsigned long isrLatency = 4;   //Pin change to the handler's first line
+  unsigned long isrCost = 8;      //A handler entry, either pin
+  unsigned long scanCost = 12;    //A scan() call
+  unsigned long appPeriod = 20000, appCost = 10;  //The application draining the event queues
+};
+
+// -- Results of a run. Losses are against the hand's ground truth
+struct RotarySimReport {
+  unsigned long simulated = 0;    //us
+  double wall = 0;                //Host seconds the run took
+  double cpu = 0, isrCpu = 0;     //Fraction of the time busy, and in handlers
+  unsigned long interrupts = 0, edges = 0, clicks = 0, presses = 0;
+  unsigned long maxIsrLatency = 0, maxTaskLate = 0;  //us - change to handler, task due to run
+  double meanIsrLatency = 0;
+  long lostClicks = 0;            //Sum over the encoders of |turned - getPosition()|
+  long missedPresses = 0;         //Presses made and not received as events, or received wrongly
+  unsigned long droppedEvents = 0;
+  long eventClicks = 0;           //Sum of |turned - ROTATION deltas received|, dropped events included
+};
+
+// -- An encoder under simulation, whatever its pins and Config
+class RotarySimKnob {
+   public:
+     virtual ~RotarySimKnob() {}
+     virtual void begin() = 0;
+     virtual void scan() = 0;
+     virtual bool getEvent(RotaryEvent &ev) = 0;
+     virtual uint8_t getDroppedEvents() = 0;
+     virtual long getPosition() = 0;
+
+     uint8_t pinA, pinB, pinC;
+     //Ground truth, and what the application received
+     long turned = 0, rotation = 0;
+     unsigned long shortPresses = 0, longPresses = 0, gotShort = 0, gotLong = 0;
+     uint8_t phase = 0;           //Quadrature state of the hand's last edge, 0-3
+     unsigned long nextGesture = 0;
+};
+
+template <uint8_t a, uint8_t b, uint8_t c, class Config>
+class RotarySimEncoder : public RotarySimKnob {
+   public:
+     RotarySimEncoder() {
+       pinA = a;
+       pinB = b;
+       pinC = c;
+     }
+     void begin() { enc.begin(false); }  //No acceleration, so the clicks can be checked
+     void scan() { enc.scan(); }
+     bool getEvent(RotaryEvent &ev) { return(enc.getEvent(ev)); }
+     uint8_t getDroppedEvents() { return(enc.getDroppedEvents()); }
+     long getPosition() { return(enc.getPosition()); }
+
+   private:
+     RotaryEncoder<a, b, c, Config> enc;
+};
+
+// -- The simulator
+class RotarySim {
+   public:
+     RotarySim(const RotarySimCosts &_costs, unsigned long _seed) : costs(_costs), seed(_seed) {}
+
+     ~RotarySim() {
+       for (size_t i = 0; i < knobs.size(); i++) delete knobs[i];
+     }
+
+     //Adds count encoders (up to 8 in all) of one Config, each with a scan() task every period
+     template <class Config>
+     void addEncoders(unsigned count, unsigned long period) {
+       while (count-- > 0 && knobs.size() < 8) {
+         RotarySimKnob *knob = newKnob<Config>(knobs.size());
+         knobs.push_back(knob);
+         addTask(period, costs.scanCost, false, knob);
+       }
+     }
+
+     //A task of the application's own, run every period for cost us, with interrupts off if blocking
+     void addTask(unsigned long period, unsigned long cost, bool blocking, RotarySimKnob *knob = NULL) {
+       Task task = { period, cost, period, blocking, false, knob };
+       tasks.push_back(task);
+     }
+
+     //Run for the given simulated time, once per RotarySim
+     RotarySimReport run(unsigned long duration) {
+       std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+       unsigned long busy = 0, latencySum = 0;
+       Event ev;
+
+       mockReset();
+       report = RotarySimReport();
+       stopAt = duration > 6000000 ? duration - 6000000 : 0;  //Time for the last gesture to finish
+       addTask(costs.appPeriod, costs.appCost, false);  //The application
+       tasks.back().app = true;
+       for (size_t i = 0; i < knobs.size(); i++) {
+         knobs[i]->begin();
+         knobs[i]->nextGesture = 50000 + nextRandom(100000);
+         push(knobs[i]->nextGesture, HAND, i);
+       }
+       push(0, MAIN, 0);
+       while (!queue.empty() && queue.top().when <= duration) {
+         ev = queue.top();
+         queue.pop();
+         mockMicros = ev.when;
+         switch (ev.kind) {
+           case HAND:
+             gesture(ev.index);
+             break;
+           case PIN:
+             pinChange(ev.when, ev.index, ev.level);
+             break;
+           case ISR:
+             if (ev.when < irqFreeAt) {  //Still in a handler, or interrupts off
+               push(irqFreeAt, ISR, ev.index);
+               break;
+             }
+             pending[ev.index] = false;
+             report.interrupts++;
+             latencySum += ev.when - requested[ev.index];
+             if (ev.when - requested[ev.index] > report.maxIsrLatency) report.maxIsrLatency = ev.when - requested[ev.index];
+             if (mockIsr[ev.index] != NULL) mockIsr[ev.index]();
+             irqFreeAt = ev.when + costs.isrCost;
+             isrBusy += costs.isrCost;
+             if (mainFreeAt > ev.when) {  //Holds up the task it preempted
+               mainFreeAt += costs.isrCost;
+               push(mainFreeAt, MAIN, ++mainGeneration);
+             }
+             break;
+           case MAIN:
+             if (ev.index == mainGeneration) runTask(ev.when, busy);
+             break;
+         }
+       }
+       finish();
+       report.simulated = duration;
+       report.cpu = (double)(busy + isrBusy) / duration;
+       report.isrCpu = (double)isrBusy / duration;
+       report.meanIsrLatency = report.interrupts ? (double)latencySum / report.interrupts : 0;
+       report.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+       return(report);
+     }
+
+     std::vector<RotarySimKnob *> knobs;
+
+   private:
+     enum Kind : uint8_t { HAND, PIN, ISR, MAIN };
+
+     struct Event {
+       unsigned long when, sequence;
+       Kind kind;
+       uint8_t level;
+       unsigned long index;       //Knob for HAND, pin for PIN and ISR, generation for MAIN
+       bool operator<(const Event &other) const {  //Reversed for the priority queue - earliest first
+         return(when != other.when ? when > other.when : sequence > other.sequence);
+       }
+     };
+
+     struct Task {
+       unsigned long period, cost, due;
+       bool blocking, app;        //Interrupts off while it runs, the application's task
+       RotarySimKnob *knob;       //scan() this one, or NULL
+     };
+
+     template <class Config>
+     static RotarySimKnob *newKnob(size_t n) {
+       switch (n) {
+         case 0: return(new RotarySimEncoder<2, 3, 4, Config>());
+         case 1: return(new RotarySimEncoder<5, 6, 7, Config>());
+         case 2: return(new RotarySimEncoder<8, 9, 10, Config>());
+         case 3: return(new RotarySimEncoder<11, 12, 13, Config>());
+         case 4: return(new RotarySimEncoder<14, 15, 16, Config>());
+         case 5: return(new RotarySimEncoder<17, 18, 19, Config>());
+         case 6: return(new RotarySimEncoder<20, 21, 22, Config>());
+         default: return(new RotarySimEncoder<23, 24, 25, Config>());
+       }
+     }
+
+     unsigned long nextRandom(unsigned long range) {
+       seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+       return((seed >> 33) % range);
+     }
+
+     void push(unsigned long when, Kind kind, unsigned long index, uint8_t level = 0) {
+       Event ev = { when, sequence++, kind, level, index };
+       queue.push(ev);
+     }
+
+     //A change to level at when, bouncing back and forth up to 3 times 50-200us apart
+     void bouncyEdge(unsigned long when, uint8_t pin, uint8_t level) {
+       int bounces = nextRandom(4);
+
+       for (int i = 0; i < bounces; i++) {
+         push(when, PIN, pin, level);
+         when += 50 + nextRandom(150);
+         push(when, PIN, pin, !level);
+         when += 50 + nextRandom(150);
+       }
+       push(when, PIN, pin, level);
+       report.edges++;
+     }
+
+     //The hand's next move on knobs[n], queued as pin changes, then the one after is
+     //scheduled. None are started that might still be going at the end of the run
+     void gesture(size_t n) {
+       static const uint8_t gray[4] = { 3, 1, 0, 2 };  //A, B from rest (both high), clockwise
+       RotarySimKnob *knob = knobs[n];
+       unsigned long t = knob->nextGesture, quarter, held;
+       unsigned kind = nextRandom(100), clicks, i;
+       bool cw;
+
+       if (t >= stopAt) return;
+       if (kind < 50) {          //Idle 0.2-20s
+         t += 200000 + nextRandom(20000000);
+       } else if (kind < 85) {   //Turn 1-30 clicks at 6-150ms a click
+         clicks = 1 + nextRandom(30);
+         quarter = (6000 + nextRandom(144000)) / 4;
+         cw = nextRandom(2);
+         for (i = 0; i < 4 * clicks; i++, t += quarter) {
+           uint8_t from = gray[knob->phase], to = gray[(knob->phase + (cw ? 1 : 3)) & 3];
+           knob->phase = (knob->phase + (cw ? 1 : 3)) & 3;
+           if ((from ^ to) & 2) bouncyEdge(t, knob->pinA, (to >> 1) & 1);
+           else bouncyEdge(t, knob->pinB, to & 1);
+         }
+         knob->turned += cw ? (long)clicks : -(long)clicks;
+         report.clicks += clicks;
+         t += 20000;
+       } else {                  //Press - 60-600ms, or a long one of 3.2-4s
+         held = (kind < 95) ? 60000 + nextRandom(540000) : RotaryEncoderConfig::longPressInterval + 200000 + nextRandom(800000);
+         bouncyEdge(t, knob->pinC, LOW);
+         bouncyEdge(t + held, knob->pinC, HIGH);
+         if (held >= (unsigned long)RotaryEncoderConfig::longPressInterval) knob->longPresses++;
+         else knob->shortPresses++;
+         report.presses++;
+         t += held + 100000;
+       }
+       knob->nextGesture = t;
+       push(t, HAND, n);
+     }
+
+     //Set the pin, and its interrupt pending if the change matches the attached mode
+     void pinChange(unsigned long when, uint8_t pin, uint8_t level) {
+       bool changed = mockPins[pin] != level;
+       uint8_t mode = mockIsrMode[pin];
+
+       mockPins[pin] = level;
+       if (!changed || mockIsr[pin] == NULL || pending[pin]) return;
+       if (mode == CHANGE || (mode == RISING && level) || (mode == FALLING && !level)) {
+         pending[pin] = true;
+         requested[pin] = when;
+         push(when + costs.isrLatency > irqFreeAt ? when + costs.isrLatency : irqFreeAt, ISR, pin);
+       }
+     }
+
+     //The main loop is free - run the task that has been due longest, or idle until the next is due
+     void runTask(unsigned long now, unsigned long &busy) {
+       Task *next = NULL;
+
+       for (size_t i = 0; i < tasks.size(); i++)
+         if (next == NULL || tasks[i].due < next->due) next = &tasks[i];
+       if (next == NULL) return;
+       if (next->due > now) {
+         push(next->due, MAIN, mainGeneration);
+         return;
+       }
+       if (now - next->due > report.maxTaskLate) report.maxTaskLate = now - next->due;
+       next->due += next->period;
+       if (next->knob != NULL) {
+         next->knob->scan();
+       } else if (next->blocking) {
+         if (now + next->cost > irqFreeAt) irqFreeAt = now + next->cost;
+       } else if (next->app) {
+         for (size_t i = 0; i < knobs.size(); i++) drain(knobs[i]);
+       }
+       busy += next->cost;
+       mainFreeAt = now + next->cost;
+       push(mainFreeAt, MAIN, mainGeneration);
+     }
+
+     //The application's side - take each knob's events
+     void drain(RotarySimKnob *knob) {
+       RotaryEvent ev;
+
+       while (knob->getEvent(ev)) {
+         if (ev.type == RotaryEvent::ROTATION) knob->rotation += ev.delta;
+         else if (ev.type == RotaryEvent::SHORT_PRESS) knob->gotShort++;
+         else if (ev.type == RotaryEvent::LONG_PRESS) knob->gotLong++;
+       }
+       report.droppedEvents += knob->getDroppedEvents();
+     }
+
+     //The ground truth against what was received
+     void finish() {
+       for (size_t i = 0; i < knobs.size(); i++) {
+         RotarySimKnob *knob = knobs[i];
+         drain(knob);
+         report.lostClicks += labs(knob->turned - knob->getPosition());
+         report.eventClicks += labs(knob->turned - knob->rotation);
+         report.missedPresses += labs((long)knob->shortPresses - (long)knob->gotShort)
+                                 + labs((long)knob->longPresses - (long)knob->gotLong);
+       }
+     }
+
+     RotarySimCosts costs;
+     unsigned long seed, sequence = 0, stopAt = 0;
+     std::priority_queue<Event> queue;
+     std::vector<Task> tasks;
+     RotarySimReport report;
+     bool pending[64] = {};
+     unsigned long requested[64] = {};
+     unsigned long irqFreeAt = 0;     //Interrupts can next run - after the last handler, or a task with them off
+     unsigned long mainFreeAt = 0;    //The task running ends
+     unsigned long mainGeneration = 0;
+     unsigned long isrBusy = 0;
+};
+
+#endif
@@ -0,0 +1,118 @@
+/*
+  The discrete event simulator (RotarySim.hpp) - ground truth, latency and capacity
+
+  Encoders with the default Config are twiddled by the simulator's hand, and what
+  the application gets has to match what the hand did: every click in getPosition()
+  and the ROTATION events, and every press as a SHORT_PRESS or LONG_PRESS, with the
+  same run repeated giving the same report. The handler latency has to follow the
+  modelled latency and interrupts-off sections.
+
+  The capacity table runs 10 simulated minutes for 1 to 8 encoders, scan() every 1,
+  10 and 50ms, and a display refresh every 50ms with interrupts off for 0, 2 or 8ms,
+  and prints the CPU load, the worst handler latency and what was lost. With
+  interrupts on nothing may be lost whatever the count and the scan() period; with
+  them off for 8ms, longer than a quarter of the fastest click, clicks are lost and
+  the simulator has to see it. Last, an hour of 4 encoders is timed.
+*/
+#include "Arduino.h"
+#include "RotarySim.hpp"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+static const unsigned long minute = 60000000UL;
+
+static bool same(const RotarySimReport &a, const RotarySimReport &b) {
+  return(a.interrupts == b.interrupts && a.edges == b.edges && a.clicks == b.clicks && a.presses == b.presses
+         && a.maxIsrLatency == b.maxIsrLatency && a.maxTaskLate == b.maxTaskLate && a.cpu == b.cpu
+         && a.lostClicks == b.lostClicks && a.missedPresses == b.missedPresses);
+}
+
+static RotarySimReport simulate(unsigned knobs, unsigned long scanPeriod, unsigned long blocked,
+                                unsigned long duration, unsigned long seed = 1,
+                                const RotarySimCosts &costs = RotarySimCosts()) {
+  RotarySim sim(costs, seed);
+
+  sim.addEncoders<RotaryEncoderConfig>(knobs, scanPeriod);
+  if (blocked) sim.addTask(50000, blocked, true);
+  return(sim.run(duration));
+}
+
+//Everything the hand did arrives, and the run is repeatable
+void testGroundTruth() {
+  RotarySimReport first = simulate(2, 10000, 0, 10 * minute);
+  RotarySimReport again = simulate(2, 10000, 0, 10 * minute);
+  RotarySimReport other = simulate(2, 10000, 0, 10 * minute, 2);
+
+  CHECK(first.clicks > 500);
+  CHECK(first.presses > 10);
+  CHECK_EQUAL(0, first.lostClicks);
+  CHECK_EQUAL(0, first.eventClicks);
+  CHECK_EQUAL(0, first.missedPresses);
+  CHECK_EQUAL(0, (long)first.droppedEvents);
+  CHECK(same(first, again));
+  CHECK(!same(first, other));  //Another seed is another hand
+}
+
+//Handlers run isrLatency after the change, or when interrupts come back on
+void testLatency() {
+  RotarySimCosts slow;
+  RotarySimReport report;
+
+  slow.isrLatency = 50;
+  report = simulate(1, 10000, 0, minute, 1, slow);
+  CHECK(report.interrupts > 0);
+  CHECK(report.meanIsrLatency >= 50 && report.meanIsrLatency < 51);
+  CHECK(report.maxIsrLatency >= 50 && report.maxIsrLatency < 50 + 3 * slow.isrCost);
+
+  report = simulate(1, 10000, 3000, minute);
+  CHECK(report.maxIsrLatency > 2000 && report.maxIsrLatency <= 3000 + RotarySimCosts().isrLatency);
+  CHECK(report.maxTaskLate >= 3000);  //scan() waits for the refresh too
+}
+
+void testCapacity() {
+  static const unsigned counts[] = { 1, 2, 4, 8 };
+  static const unsigned long periods[] = { 1000, 10000, 50000 }, blocks[] = { 0, 2000, 8000 };
+  RotarySimReport report;
+  double last;
+
+  printf("RotarySimTest - 10 simulated minutes, default Config and costs, display refresh every 50ms\n");
+  printf("  encoders  scan ms  irq off ms    cpu%%  isr%%  max latency us  lost clicks  missed presses\n");
+  for (unsigned b = 0; b < 3; b++)
+    for (unsigned p = 0; p < 3; p++) {
+      last = 0;
+      for (unsigned c = 0; c < 4; c++) {
+        report = simulate(counts[c], periods[p], blocks[b], 10 * minute);
+        printf("  %8u  %7lu  %10lu  %6.2f  %4.2f  %14lu  %11ld  %14ld\n", counts[c], periods[p] / 1000,
+               blocks[b] / 1000, report.cpu * 100, report.isrCpu * 100, report.maxIsrLatency,
+               report.lostClicks, report.missedPresses);
+        CHECK(report.cpu > last);  //More encoders, more load
+        last = report.cpu;
+        if (blocks[b] == 0) {
+          CHECK_EQUAL(0, report.lostClicks);
+          CHECK_EQUAL(0, report.missedPresses);
+          CHECK_EQUAL(0, report.eventClicks);
+        }
+        if (blocks[b] == 8000) CHECK(report.lostClicks > 0);
+      }
+    }
+}
+
+//Hours in seconds
+void testHour() {
+  RotarySimReport report = simulate(4, 10000, 0, 60 * minute);
+
+  printf("RotarySimTest - an hour of 4 encoders: %lu clicks, %lu presses, %lu interrupts in %.2fs\n",
+         report.clicks, report.presses, report.interrupts, report.wall);
+  CHECK_EQUAL(0, report.lostClicks);
+  CHECK_EQUAL(0, report.missedPresses);
+}
+
+int main() {
+  RUN(testGroundTruth);
+  RUN(testLatency);
+  RUN(testCapacity);
+  RUN(testHour);
+  printf("RotarySimTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
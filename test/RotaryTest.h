@@ -0,0 +1,19 @@
+#ifndef RotaryTest_h
+#define RotaryTest_h
+//Minimal checks for the host tests - a failed check prints where and carries on,
+//main() returns the number of failures so make stops on any
+#include <stdio.h>
+
+extern int rotaryTestFailures;
+
+#define CHECK(cond) do { if (!(cond)) { \
+    printf("%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, __func__, #cond); \
+    rotaryTestFailures++; } } while (0)
+
+#define CHECK_EQUAL(expected, actual) do { long e_ = (expected), a_ = (actual); if (e_ != a_) { \
+    printf("%s:%d: %s: %s is %ld, expected %ld\n", __FILE__, __LINE__, __func__, #actual, a_, e_); \
+    rotaryTestFailures++; } } while (0)
+
+#define RUN(test) do { mockReset(); test(); } while (0)
+
+#endif
@@ -0,0 +1,155 @@
+/*
+  scan() called every 1ms and every 50ms must give the same results
+  
+  The same recorded input - bursts of bouncy clicks in both directions at varying
+  speeds, short and long presses, and an idle spell past the activity timeout - is
+  played into two encoders, one scanned every 1ms and one every 50ms. The event
+  queue, the pulse counts, isActive() and the presses passed on to the StateMachine
+  are logged every 100ms and the logs have to match.
+*/
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "RotaryEncoder.hpp"
+#include "RotaryTest.h"
+
+int rotaryTestFailures = 0;
+
+typedef RotaryEncoder<2, 3, 4> Encoder;
+
+struct Edge {
+  unsigned long when;
+  uint8_t pin, level;
+};
+
+//Small fixed random sequence, so every run plays the same input
+static unsigned long seed = 7;
+static unsigned long nextRandom(unsigned long range) {
+  seed = seed * 1103515245 + 12345;
+  return((seed >> 16) % range);
+}
+
+//A pin change with bounces edges 200us apart
+static void bouncyEdge(std::vector<Edge> &edges, unsigned long when, uint8_t pin, uint8_t level, int bounces) {
+  for (int i = 0; i < bounces; i++) {
+    edges.push_back({ when + i * 200, pin, level });
+    edges.push_back({ when + i * 200 + 100, pin, (uint8_t)!level });
+  }
+  edges.push_back({ when + bounces * 200, pin, level });
+}
+
+static std::vector<Edge> recording() {
+  std::vector<Edge> edges;
+  unsigned long t = 100000, quarter, held;
+  uint8_t first, second;
+
+  for (int burst = 0; burst < 30; burst++) {
+    first = nextRandom(2) ? 2 : 3;
+    second = first == 2 ? 3 : 2;
+    quarter = 2000 + nextRandom(15000);
+    for (int n = 1 + nextRandom(8); n > 0; n--) {
+      bouncyEdge(edges, t, first, HIGH, nextRandom(4));
+      bouncyEdge(edges, t + quarter, second, HIGH, nextRandom(4));
+      bouncyEdge(edges, t + 2 * quarter, first, LOW, nextRandom(4));
+      bouncyEdge(edges, t + 3 * quarter, second, LOW, nextRandom(4));
+      t += 4 * quarter;
+    }
+    t += 200000 + nextRandom(300000);
+    if (burst % 3 == 0) {
+      held = (burst % 2) ? 30000 + nextRandom(200000) : RotaryEncoderConfig::longPressInterval + 500000;
+      bouncyEdge(edges, t, 4, LOW, 2);
+      bouncyEdge(edges, t + held, 4, HIGH, 2);
+      t += held + 400000;
+    }
+    if (burst == 10) t += RotaryEncoderConfig::activityTimeout + 2000000;
+  }
+  return(edges);
+}
+
+static std::string play(const std::vector<Edge> &edges, unsigned long period) {
+  Encoder enc;
+  RotaryEvent ev = {};
+  std::string log;
+  char buff[64];
+  size_t next = 0;
+  unsigned long end = edges.back().when + 1000000;
+
+  mockReset();
+  mockPins[2] = mockPins[3] = LOW;
+  enc.begin();
+  for (unsigned long now = 100; now < end; now += 100) {
+    while (next < edges.size() && edges[next].when <= now) {
+      mockEdge(edges[next].pin, edges[next].level, edges[next].when);
+      next++;
+    }
+    mockMicros = now;
+    if (now % period == 0) enc.scan();
+    if (now % 100000 == 0) {
+      while (enc.getEvent(ev)) {
+        sprintf(buff, "[%d %d] ", ev.type, ev.delta);
+        log += buff;
+      }
+      sprintf(buff, "p%d a%d s%d/%d ", enc.getPulseCount(), enc.isActive(), eventQueue.count, eventQueue.last);
+      log += buff;
+    }
+  }
+  return(log);
+}
+
+void testScanPeriod() {
+  std::vector<Edge> edges = recording();
+  std::string fast = play(edges, 1000), slow = play(edges, 50000);
+
+  CHECK(fast == slow);
+  CHECK(fast.find("[1 0]") != std::string::npos);  //A short press
+  CHECK(fast.find("[2 0]") != std::string::npos);  //and a long one
+  CHECK(fast.find("a0") != std::string::npos);     //and it went idle
+  if (fast != slow) printf("1ms:  %s\n50ms: %s\n", fast.c_str(), slow.c_str());
+}
+
+//scan() held up for 400ms (a slow display refresh, say) during a double tap - both
+//presses must still reach the StateMachine, and up to 4 are kept
+void testStalledScan() {
+  Encoder enc;
+  RotaryEvent ev = {};
+  std::vector<Edge> edges;
+  unsigned long t = 100000;
+  int events = 0;
+
+  mockPins[2] = mockPins[3] = LOW;
+  enc.begin();
+  enc.scan();
+  for (int i = 0; i < 2; i++, t += 150000) {
+    bouncyEdge(edges, t, 4, LOW, 2);
+    bouncyEdge(edges, t + 60000, 4, HIGH, 2);
+  }
+  for (size_t i = 0; i < edges.size(); i++) mockEdge(edges[i].pin, edges[i].level, edges[i].when);
+  mockMicros = 500000;
+  enc.scan();
+  while (enc.getEvent(ev)) if (ev.type == RotaryEvent::SHORT_PRESS) events++;
+  CHECK_EQUAL(2, events);
+  CHECK_EQUAL(2, eventQueue.count);
+  CHECK_EQUAL(SHORTPRESS, eventQueue.last);
+
+  //Five presses in one stall, the fourth a long one - the first 4 get through in order
+  edges.clear();
+  eventQueue.count = 0;
+  t = 600000;
+  for (int i = 0; i < 5; i++, t += 100000) {
+    bouncyEdge(edges, t, 4, LOW, 1);
+    bouncyEdge(edges, t + (i == 3 ? RotaryEncoderConfig::longPressInterval + 100000 : 40000), 4, HIGH, 1);
+    if (i == 3) t += RotaryEncoderConfig::longPressInterval + 100000;
+  }
+  for (size_t i = 0; i < edges.size(); i++) mockEdge(edges[i].pin, edges[i].level, edges[i].when);
+  mockMicros = t;
+  enc.scan();
+  CHECK_EQUAL(4, eventQueue.count);
+  CHECK_EQUAL(LONGPRESS, eventQueue.last);
+}
+
+int main() {
+  RUN(testScanPeriod);
+  RUN(testStalledScan);
+  printf("ScanPeriodTest: %d failures\n", rotaryTestFailures);
+  return(rotaryTestFailures);
+}
@@ -0,0 +1,20 @@
+#ifndef StateMachine_hpp
+#define StateMachine_hpp
+//Stub of the application's state machine for the host tests - counts the button
+//events scan() passes on, and keeps the last one
+enum Event { NONE, SHORTPRESS, LONGPRESS };
+
+struct EventQueue {
+  int count = 0;
+  Event last = NONE;
+  void push(Event *ev) { count++; last = *ev; }
+};
+
+#ifdef __AVR__
+extern Event encoderEvent;
+extern EventQueue eventQueue;
+#else
+extern thread_local Event encoderEvent;     //Per thread, as the stub core is (see Arduino.h)
+extern thread_local EventQueue eventQueue;
+#endif
+#endif
@@ -0,0 +1,7 @@
+#ifndef TaskScheduler_h
+#define TaskScheduler_h
+//Stub of the TaskScheduler library for the host tests - RotaryEncoder.hpp only declares the runner
+struct Scheduler {
+  void execute() {}
+};
+#endif
@@ -0,0 +1,68 @@
+#ifndef Arduino_h
+#define Arduino_h
+/*
+  Bare ATmega328P stub of the Arduino core for the cycle count harness
+  
+  The real core's micros() and interrupt dispatch would add their own (varying)
+  cycles to every measurement, so here the clock is a variable the harness sets and
+  attachInterrupt() just records the handler for the harness to call. The encoder
+  pins read from simPins in RAM rather than PIND, which costs the same ld as the
+  I/O register, so the harness can set the pins. Serial output is dropped.
+
+  noInterrupts() and interrupts() stamp timer 1 (which the harness runs at the CPU
+  clock), and keep the longest stretch with interrupts off in simMaskedMax. The
+  stamps add a few cycles to each stretch, so it errs on the high side.
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define HIGH 1
+#define LOW 0
+
+typedef void (*voidFuncPtr)();
+
+extern volatile unsigned long simMicros;
+extern volatile uint8_t simPins;           //Pins 0-7, as PIND would read
+extern voidFuncPtr simIsr[8];
+extern uint16_t simMaskStart, simMaskedMax;  //Timer 1 at the last noInterrupts(), longest stretch
+
+inline unsigned long micros() { return(simMicros); }
+inline unsigned long millis() { return(simMicros / 1000); }
+inline void pinMode(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t pin) { return((simPins >> pin) & 1); }
+inline uint8_t digitalPinToInterrupt(uint8_t pin) { return(pin); }
+inline void attachInterrupt(uint8_t n, voidFuncPtr isr, int) { simIsr[n] = isr; }
+inline void detachInterrupt(uint8_t n) { simIsr[n] = NULL; }
+inline void noInterrupts() {
+  cli();
+  simMaskStart = TCNT1;
+}
+
+inline void interrupts() {
+  uint16_t masked = TCNT1 - simMaskStart;
+
+  if (masked > simMaskedMax) simMaskedMax = masked;
+  sei();
+}
+
+inline uint8_t digitalPinToPort(uint8_t) { return(0); }
+inline uint8_t digitalPinToBitMask(uint8_t pin) { return(1 << pin); }
+inline volatile uint8_t *portInputRegister(uint8_t) { return(&simPins); }
+
+struct Print {
+  size_t print(const char *) { return(0); }
+  size_t println(const char *) { return(0); }
+  size_t write(const uint8_t *, size_t n) { return(n); }
+};
+extern Print Serial;
+
+#endif
@@ -0,0 +1,194 @@
+/*
+  Cycle counts for the encoder's interrupt handlers and scan() on an ATmega328P
+
+  Built with avr-g++ and run in simavr (see the Makefile), so the counts are exact
+  and the same on every run. Timer 1 runs at the CPU clock and is read either side
+  of each call, less the cost of calling an empty function the same way. The input
+  is set up for each code path in turn, from a click to an edge storm.
+
+  The interrupt handlers run with interrupts off, so their whole time is masked.
+  For scan() the longest stretch from a noInterrupts() to its interrupts() is
+  reported as well, as that is the longest time the interrupts are held off - the
+  stub core stamps timer 1 in both (see Arduino.h). Not counted: the vector and the
+  core's dispatch to the handler attachInterrupt() was given, and micros() (here
+  just a variable).
+
+  With budgets given, any count over its budget prints FAIL and the run fails, so it
+  can gate changes:
+    MAX_ISR_CYCLES     - longest handler
+    MAX_MASKED_CYCLES  - longest interrupts-off stretch in scan()
+  A budget of 0 (the default) just reports the counts. Set the budgets from a measured
+  run, with some headroom - there are no figures to start from in this tree, as it
+  has not been run in simavr yet.
+  Output goes to the UART, which simavr prints.
+*/
+#include "Arduino.h"
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+
+#ifndef MAX_ISR_CYCLES
+#define MAX_ISR_CYCLES 0
+#endif
+#ifndef MAX_MASKED_CYCLES
+#define MAX_MASKED_CYCLES 0
+#endif
+
+#include "RotaryEncoder.hpp"
+
+// -- Stub core and StateMachine storage
+volatile unsigned long simMicros;
+volatile uint8_t simPins;
+voidFuncPtr simIsr[8];
+uint16_t simMaskStart, simMaskedMax;
+Print Serial;
+Scheduler runner;
+Event encoderEvent;
+EventQueue eventQueue;
+
+typedef RotaryEncoder<2, 3, 4> Encoder;
+static Encoder knob;
+static uint16_t overhead;
+static uint8_t failures;
+
+// -- Output on the UART, 115200 baud
+static int uartPut(char c, FILE *) {
+  while (!(UCSR0A & _BV(UDRE0)));
+  UDR0 = c;
+  return(0);
+}
+
+static FILE uart;
+
+static void uartBegin() {
+  UCSR0A = _BV(U2X0);
+  UBRR0 = F_CPU / 8 / 115200 - 1;
+  UCSR0B = _BV(TXEN0);
+  fdev_setup_stream(&uart, uartPut, NULL, _FDEV_SETUP_WRITE);
+  stdout = &uart;
+}
+
+// -- Measurement
+static void nothing() {}
+
+static bool overBudget(uint16_t cycles, uint16_t budget) {
+  return(budget != 0 && cycles > budget);
+}
+
+static void scan() {
+  knob.scan();
+}
+
+//Cycles taken by f(), with the longest stretch it had interrupts off in simMaskedMax
+static uint16_t measure(void (*f)()) {
+  uint16_t start, end;
+
+  simMaskedMax = 0;
+  start = TCNT1;
+  f();
+  end = TCNT1;
+  return(end - start - overhead);
+}
+
+static void setPin(uint8_t pin, uint8_t level) {
+  if (level) simPins |= _BV(pin);
+  else simPins &= ~_BV(pin);
+}
+
+//An interrupt handler - all of it is masked. path is in flash
+static void handler(const char *path, uint8_t pin, unsigned long when) {
+  uint16_t cycles;
+
+  simMicros = when;
+  cycles = measure(simIsr[pin]);
+  printf_P(PSTR("%-48S %5u cycles%S\n"), path, cycles, overBudget(cycles, MAX_ISR_CYCLES) ? PSTR("  FAIL") : PSTR(""));
+  if (overBudget(cycles, MAX_ISR_CYCLES)) failures++;
+}
+
+static void scanAt(const char *path, unsigned long when) {
+  uint16_t cycles;
+
+  simMicros = when;
+  cycles = measure(scan);
+  printf_P(PSTR("%-48S %5u cycles %5u masked%S\n"), path, cycles, simMaskedMax,
+           overBudget(simMaskedMax, MAX_MASKED_CYCLES) ? PSTR("  FAIL") : PSTR(""));
+  if (overBudget(simMaskedMax, MAX_MASKED_CYCLES)) failures++;
+}
+
+//Pin A rising with B low is a clockwise click
+static void click(const char *path, unsigned long when) {
+  setPin(2, LOW);
+  setPin(2, HIGH);
+  handler(path, 2, when);
+}
+
+int main() {
+  uint16_t worst = 0;
+
+  uartBegin();
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);  //CPU clock
+  overhead = 0;
+  overhead = measure(nothing);
+  printf_P(PSTR("RotaryEncoder cycle counts, %lu MHz, budgets %u (handlers) and %u (masked), 0 is none\n"),
+         F_CPU / 1000000, MAX_ISR_CYCLES, MAX_MASKED_CYCLES);
+
+  simPins = _BV(4);  //A and B low, button up
+  simMicros = 1000;
+  knob.begin();
+  sei();
+
+  // -- Rotation
+  click(PSTR("encoderIntHandler() click, pulse start"), 100000);
+  handler(PSTR("encoderIntHandler() bounce in the debounce"), 2, 100300);
+  scanAt(PSTR("scan() during a debounce"), 102000);
+  scanAt(PSTR("scan() ending a debounce"), 106000);
+  click(PSTR("encoderIntHandler() click, pulse end (accel)"), 200000);
+  click(PSTR("encoderIntHandler() click ending a late debounce"), 206000);
+  scanAt(PSTR("scan() with the filter running"), 300000);
+
+  // -- Button
+  setPin(4, LOW);
+  handler(PSTR("buttonIntHandler() press"), 4, 400000);
+  handler(PSTR("buttonIntHandler() bounce in the debounce"), 4, 400300);
+  scanAt(PSTR("scan() with the button held"), 406000);
+  setPin(4, HIGH);
+  handler(PSTR("buttonIntHandler() release, queues the press"), 4, 500000);
+  scanAt(PSTR("scan() passing a press on"), 506000);
+
+  // -- Adaptive debounce, with the worst case of 16 seconds of peak decay
+  knob.setAdaptiveDebounce(true);
+  click(PSTR("encoderIntHandler() click, adaptive"), 600000);
+  knob.peakTime = (600000 >> 10) - 16 * 1024;
+  scanAt(PSTR("scan() learning a burst, 16s of decay"), 606000);
+  click(PSTR("encoderIntHandler() click, adaptive"), 700000);
+  knob.peakTime = (700000 >> 10) - 16 * 1024;
+  setPin(3, HIGH);  //A step back, so it is learned
+  click(PSTR("encoderIntHandler() late bounce, 16s of decay"), 700000 + knob.getDebounceInterval(0) + 100);
+  setPin(3, LOW);
+  knob.setAdaptiveDebounce(false);
+
+  // -- Activity timeout
+  scanAt(PSTR("scan() timing out"), 700000 + RotaryEncoderConfig::activityTimeout + 100000);
+  scanAt(PSTR("scan() inactive"), 700000 + RotaryEncoderConfig::activityTimeout + 200000);
+
+  // -- Edge storm - the edge that trips it detaches the interrupts and queues a FAULT
+  simMicros = 12000000;
+  for (uint16_t i = 0; i < 2 * RotaryEncoderConfig::stormEdges && simIsr[2]; i++) {
+    uint16_t cycles;
+    simMicros += 50;
+    setPin(2, !(simPins & _BV(2)));
+    cycles = measure(simIsr[2]);
+    if (cycles > worst) worst = cycles;
+  }
+  printf_P(PSTR("%-48S %5u cycles%S\n"), PSTR("encoderIntHandler() edge storm, worst edge"), worst,
+           overBudget(worst, MAX_ISR_CYCLES) ? PSTR("  FAIL") : PSTR(""));
+  if (overBudget(worst, MAX_ISR_CYCLES)) failures++;
+  scanAt(PSTR("scan() polling a faulted encoder"), simMicros + 2000);
+
+  printf_P(failures ? PSTR("FAIL\n") : PSTR("PASS\n"));
+  UCSR0A |= _BV(TXC0);  //Let the last character go before stopping
+  while (!(UCSR0A & _BV(TXC0)));
+  cli();
+  sleep_enable();
+  sleep_cpu();  //simavr stops when the CPU sleeps with interrupts off
+}
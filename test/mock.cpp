@@ -0,0 +1,38 @@
+//Storage for the stubs, and the edge helper
+#include "Arduino.h"
+#include "TaskScheduler.h"
+#include "StateMachine.hpp"
+
+thread_local unsigned long mockMicros;
+thread_local uint8_t mockPins[64];
+thread_local voidFuncPtr mockIsr[64];
+thread_local uint8_t mockIsrMode[64];
+thread_local char mockSerial[1024];
+thread_local bool mockInterruptsOff;
+thread_local voidFuncPtr mockInterruptsOn;
+thread_local Print Serial;
+Scheduler runner;
+thread_local Event encoderEvent;
+thread_local EventQueue eventQueue;
+
+void mockEdge(uint8_t pin, uint8_t level, unsigned long when) {
+  bool changed = mockPins[pin] != level;
+
+  mockMicros = when;
+  mockPins[pin] = level;
+  if (mockIsr[pin] == NULL) return;
+  if ( (mockIsrMode[pin] == CHANGE && changed) || (mockIsrMode[pin] == RISING && changed && level)
+       || (mockIsrMode[pin] == FALLING && changed && !level) )
+    mockIsr[pin]();
+}
+
+void mockReset() {
+  mockMicros = 0;
+  memset(mockPins, HIGH, sizeof(mockPins));
+  memset(mockIsr, 0, sizeof(mockIsr));
+  mockSerial[0] = 0;
+  mockInterruptsOff = false;
+  mockInterruptsOn = NULL;
+  eventQueue.count = 0;
+  eventQueue.last = NONE;
+}